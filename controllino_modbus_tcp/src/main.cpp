@@ -21,10 +21,6 @@
 #include <Controllino.h>
 #include <SPI.h>
 #include <Ethernet.h>
-#include <Modbus.h>
-#include <ModbusIP.h>
-
-ModbusIP mb;
 
 byte mac[] = {
 	0x00, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE
@@ -36,6 +32,11 @@ byte ip[] = {
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Log pin changes on Serial. Lines are queued in a ring buffer which is
+ * drained only as fast as the UART takes it, so a burst of changes never
+ * blocks loop(). What does not fit into the ring is dropped. */
+//#define PINS_LOG
+
 enum pin_type {
 	PIN_TYPE_RELAY,
 	PIN_TYPE_DIGITAL_OUTPUT,
@@ -75,7 +76,7 @@ struct pin {
 #define PIN_DIGITAL_INPUT_MB_INDEX_BASE 0
 #define PIN_ANALOG_INPUT_MB_INDEX_BASE 0
 
-/* modbus function code: 0x05
+/* modbus function codes: 0x01, 0x05, 0x0F
  * offset: PIN_RELAY_MB_INDEX_BASE
  * values: 0, 1
  */
@@ -86,7 +87,7 @@ struct pin {
 	.mb_index = _mb_index + PIN_RELAY_MB_INDEX_BASE,				\
 }
 
-/* modbus function code: 0x05
+/* modbus function codes: 0x01, 0x05, 0x0F
  * offset: PIN_DIGITAL_OUTPUT_MB_INDEX_BASE
  * values: 0, 1
  */
@@ -97,7 +98,7 @@ struct pin {
 	.mb_index = _mb_index + PIN_DIGITAL_OUTPUT_MB_INDEX_BASE,			\
 }
 
-/* modbus function code: 0x06
+/* modbus function codes: 0x03, 0x06, 0x10, 0x17
  * offset: PIN_PWM_OUTPUT_MB_INDEX_BASE
  * values: 0 - 255
  */
@@ -233,7 +234,456 @@ struct pin pins[] = {
 #define for_each_pin(pin, i)								\
 	for (i = 0, pin = &pins[i]; i < PINS_COUNT; pin = &pins[++i])
 
-void pins_refresh()
+#ifdef PINS_LOG
+#define LOG_RING_SIZE 256 /* uint8_t indexes wrap around by themselves */
+#define LOG_LINE_LEN 48
+
+char log_ring[LOG_RING_SIZE];
+uint8_t log_head;
+uint8_t log_tail;
+
+void pins_log(const char *fmt, ...)
+{
+	char line[LOG_LINE_LEN];
+	va_list ap;
+	uint8_t len;
+	uint8_t i;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	len = strlen(line);
+	if ((uint8_t) (log_tail - log_head - 1) < len + 2)
+		return;
+	for (i = 0; i < len; i++)
+		log_ring[log_head++] = line[i];
+	log_ring[log_head++] = '\r';
+	log_ring[log_head++] = '\n';
+}
+
+void pins_log_flush(void)
+{
+	int room = Serial.availableForWrite();
+
+	while (room-- > 0 && log_tail != log_head)
+		Serial.write(log_ring[log_tail++]);
+}
+#else
+static inline void pins_log(const char *fmt, ...) {}
+static inline void pins_log_flush(void) {}
+#endif
+
+/* Register map, indexed directly by mb_index, the sizes have to cover the
+ * highest mb_index used in pins[]. The valid bitmaps mark the addresses
+ * some pin is mapped to, anything else is answered by the illegal data
+ * address exception.
+ */
+#define MB_BITS_MAX 256
+#define MB_REGS_MAX 32
+
+struct mb_bits {
+	uint8_t state[MB_BITS_MAX / 8];
+	uint8_t valid[MB_BITS_MAX / 8];
+};
+
+struct mb_regs {
+	word state[MB_REGS_MAX];
+	uint8_t valid[MB_REGS_MAX / 8];
+};
+
+struct mb_bits mb_coils;
+struct mb_bits mb_ists;
+struct mb_regs mb_hregs;
+struct mb_regs mb_iregs;
+
+/* Set by the write function codes, outputs are applied once afterwards. */
+bool mb_outputs_changed;
+
+#define MB_TCP_PORT 502
+#define MB_MBAP_LEN 7 /* including the unit identifier */
+#define MB_PDU_MAX 253
+
+#define MB_FC_READ_COILS 0x01
+#define MB_FC_READ_INPUT_STAT 0x02
+#define MB_FC_READ_REGS 0x03
+#define MB_FC_READ_INPUT_REGS 0x04
+#define MB_FC_WRITE_COIL 0x05
+#define MB_FC_WRITE_REG 0x06
+#define MB_FC_WRITE_COILS 0x0F
+#define MB_FC_WRITE_REGS 0x10
+#define MB_FC_READ_WRITE_REGS 0x17
+
+#define MB_EX_ILLEGAL_FUNCTION 0x01
+#define MB_EX_ILLEGAL_ADDRESS 0x02
+#define MB_EX_ILLEGAL_VALUE 0x03
+
+#define MB_READ_BITS_MAX 2000
+#define MB_READ_REGS_MAX 125
+#define MB_WRITE_BITS_MAX 1968
+#define MB_WRITE_REGS_MAX 123
+#define MB_READ_WRITE_REGS_MAX 121 /* written registers of FC 0x17 */
+
+EthernetServer mb_server(MB_TCP_PORT);
+
+/* Every connected master gets its own session. The chip sockets are
+ * shared with the listening one, which needs one for itself.
+ */
+#define MB_SESSIONS_MAX (MAX_SOCK_NUM - 1)
+#define MB_SESSION_TIMEOUT 60000 /* ms without a request */
+
+struct mb_session {
+	EthernetClient client;
+	unsigned long last_rx;
+	word len; /* bytes of frame received so far */
+	uint8_t frame[MB_MBAP_LEN + MB_PDU_MAX];
+};
+
+struct mb_session mb_sessions[MB_SESSIONS_MAX];
+uint8_t mb_session_first; /* rotates to serve the sessions round-robin */
+
+word mb_word_get(const uint8_t *buf)
+{
+	return (buf[0] << 8) | buf[1];
+}
+
+void mb_word_put(uint8_t *buf, word val)
+{
+	buf[0] = val >> 8;
+	buf[1] = val & 0xff;
+}
+
+uint8_t mb_exception(uint8_t *pdu, uint8_t code)
+{
+	pdu[0] |= 0x80;
+	pdu[1] = code;
+	return 2;
+}
+
+bool mb_valid(const uint8_t *valid, word max, word start, word count)
+{
+	unsigned int addr;
+
+	if ((unsigned long) start + count > max)
+		return false;
+	for (addr = start; addr < start + count; addr++)
+		if (!bitRead(valid[addr / 8], addr % 8))
+			return false;
+	return true;
+}
+
+/* The PDU buffer is reused for the reply, all replies fit into MB_PDU_MAX. */
+
+uint8_t mb_bits_read(uint8_t *pdu, uint8_t len, struct mb_bits *bits)
+{
+	uint8_t *out = &pdu[2];
+	word start, count;
+	unsigned int i;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_READ_BITS_MAX)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_valid(bits->valid, MB_BITS_MAX, start, count))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	pdu[1] = (count + 7) / 8;
+	memset(out, 0, pdu[1]);
+	for (i = 0; i < count; i++)
+		if (bitRead(bits->state[(start + i) / 8], (start + i) % 8))
+			bitSet(out[i / 8], i % 8);
+	return 2 + pdu[1];
+}
+
+void mb_regs_get(uint8_t *out, struct mb_regs *regs, word start, word count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		mb_word_put(&out[i * 2], regs->state[start + i]);
+}
+
+void mb_regs_put(struct mb_regs *regs, word start, word count,
+		 const uint8_t *in)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		regs->state[start + i] = mb_word_get(&in[i * 2]);
+}
+
+uint8_t mb_regs_read(uint8_t *pdu, uint8_t len, struct mb_regs *regs)
+{
+	word start, count;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_READ_REGS_MAX)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_valid(regs->valid, MB_REGS_MAX, start, count))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	pdu[1] = count * 2;
+	mb_regs_get(&pdu[2], regs, start, count);
+	return 2 + pdu[1];
+}
+
+uint8_t mb_coil_write(uint8_t *pdu, uint8_t len)
+{
+	word addr, val;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	addr = mb_word_get(&pdu[1]);
+	val = mb_word_get(&pdu[3]);
+	if (val != 0xff00 && val != 0x0000)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_valid(mb_coils.valid, MB_BITS_MAX, addr, 1))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	bitWrite(mb_coils.state[addr / 8], addr % 8, val == 0xff00);
+	mb_outputs_changed = true;
+	return len; /* echo the request */
+}
+
+uint8_t mb_reg_write(uint8_t *pdu, uint8_t len)
+{
+	word addr;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	addr = mb_word_get(&pdu[1]);
+	if (!mb_valid(mb_hregs.valid, MB_REGS_MAX, addr, 1))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	mb_hregs.state[addr] = mb_word_get(&pdu[3]);
+	mb_outputs_changed = true;
+	return len; /* echo the request */
+}
+
+/* The bulk writes check the whole range first and change nothing on an
+ * exception. The outputs are then applied together in one pass.
+ */
+
+uint8_t mb_coils_write(uint8_t *pdu, uint8_t len)
+{
+	const uint8_t *in = &pdu[6];
+	word start, count;
+	unsigned int i;
+
+	if (len < 6)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_WRITE_BITS_MAX ||
+	    pdu[5] != (count + 7) / 8 || len != 6 + pdu[5])
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_valid(mb_coils.valid, MB_BITS_MAX, start, count))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	for (i = 0; i < count; i++)
+		bitWrite(mb_coils.state[(start + i) / 8], (start + i) % 8,
+			 bitRead(in[i / 8], i % 8));
+	mb_outputs_changed = true;
+	return 5; /* function code, start and count */
+}
+
+uint8_t mb_regs_write(uint8_t *pdu, uint8_t len)
+{
+	word start, count;
+
+	if (len < 6)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_WRITE_REGS_MAX ||
+	    pdu[5] != count * 2 || len != 6 + pdu[5])
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_valid(mb_hregs.valid, MB_REGS_MAX, start, count))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	mb_regs_put(&mb_hregs, start, count, &pdu[6]);
+	mb_outputs_changed = true;
+	return 5; /* function code, start and count */
+}
+
+/* The write is done before the read, so the reply has the new values. */
+uint8_t mb_regs_read_write(uint8_t *pdu, uint8_t len)
+{
+	word read_start, read_count;
+	word write_start, write_count;
+
+	if (len < 10)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	read_start = mb_word_get(&pdu[1]);
+	read_count = mb_word_get(&pdu[3]);
+	write_start = mb_word_get(&pdu[5]);
+	write_count = mb_word_get(&pdu[7]);
+	if (!read_count || read_count > MB_READ_REGS_MAX ||
+	    !write_count || write_count > MB_READ_WRITE_REGS_MAX ||
+	    pdu[9] != write_count * 2 || len != 10 + pdu[9])
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_valid(mb_hregs.valid, MB_REGS_MAX, read_start, read_count) ||
+	    !mb_valid(mb_hregs.valid, MB_REGS_MAX, write_start, write_count))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	mb_regs_put(&mb_hregs, write_start, write_count, &pdu[10]);
+	mb_outputs_changed = true;
+	pdu[1] = read_count * 2;
+	mb_regs_get(&pdu[2], &mb_hregs, read_start, read_count);
+	return 2 + pdu[1];
+}
+
+uint8_t mb_pdu_process(uint8_t *pdu, uint8_t len)
+{
+	switch (pdu[0]) {
+	case MB_FC_READ_COILS:
+		return mb_bits_read(pdu, len, &mb_coils);
+	case MB_FC_READ_INPUT_STAT:
+		return mb_bits_read(pdu, len, &mb_ists);
+	case MB_FC_READ_REGS:
+		return mb_regs_read(pdu, len, &mb_hregs);
+	case MB_FC_READ_INPUT_REGS:
+		return mb_regs_read(pdu, len, &mb_iregs);
+	case MB_FC_WRITE_COIL:
+		return mb_coil_write(pdu, len);
+	case MB_FC_WRITE_REG:
+		return mb_reg_write(pdu, len);
+	case MB_FC_WRITE_COILS:
+		return mb_coils_write(pdu, len);
+	case MB_FC_WRITE_REGS:
+		return mb_regs_write(pdu, len);
+	case MB_FC_READ_WRITE_REGS:
+		return mb_regs_read_write(pdu, len);
+	default:
+		return mb_exception(pdu, MB_EX_ILLEGAL_FUNCTION);
+	}
+}
+
+void mb_session_close(struct mb_session *session)
+{
+	session->client.stop();
+	session->len = 0;
+}
+
+void mb_session_accept(void)
+{
+	EthernetClient client = mb_server.accept();
+	struct mb_session *session;
+	uint8_t i;
+
+	if (!client)
+		return;
+	for (i = 0; i < MB_SESSIONS_MAX; i++) {
+		session = &mb_sessions[i];
+		if (session->client)
+			continue;
+		session->client = client;
+		session->last_rx = millis();
+		session->len = 0;
+		return;
+	}
+	client.stop();
+}
+
+word mb_frame_len(const uint8_t *frame)
+{
+	/* Length covers the unit identifier, which is part of MBAP here. */
+	return MB_MBAP_LEN + mb_word_get(&frame[4]) - 1;
+}
+
+bool mb_mbap_valid(const uint8_t *frame)
+{
+	word len = mb_word_get(&frame[4]);
+
+	/* Protocol identifier is always 0. */
+	return !mb_word_get(&frame[2]) && len >= 2 && len <= MB_PDU_MAX + 1;
+}
+
+/* Takes whatever the socket has without waiting for the rest, never reads
+ * past the end of the current frame. Returns true once a whole frame is
+ * in.
+ */
+bool mb_session_rx(struct mb_session *session)
+{
+	int avail, len;
+	word need;
+
+	while ((avail = session->client.available()) > 0) {
+		if (session->len < MB_MBAP_LEN)
+			need = MB_MBAP_LEN - session->len;
+		else
+			need = mb_frame_len(session->frame) - session->len;
+		if (need > avail)
+			need = avail;
+		len = session->client.read(&session->frame[session->len], need);
+		if (len <= 0)
+			return false;
+		session->len += len;
+		session->last_rx = millis();
+		if (session->len == MB_MBAP_LEN &&
+		    !mb_mbap_valid(session->frame)) {
+			/* No way to find the next frame boundary. */
+			mb_session_close(session);
+			return false;
+		}
+		if (session->len > MB_MBAP_LEN &&
+		    session->len == mb_frame_len(session->frame))
+			return true;
+	}
+	return false;
+}
+
+void mb_session_task(struct mb_session *session)
+{
+	uint8_t len;
+
+	if (!session->client)
+		return;
+	if (!session->client.connected() ||
+	    millis() - session->last_rx > MB_SESSION_TIMEOUT) {
+		mb_session_close(session);
+		return;
+	}
+	if (!mb_session_rx(session))
+		return;
+	len = mb_pdu_process(&session->frame[MB_MBAP_LEN],
+			     session->len - MB_MBAP_LEN);
+	mb_word_put(&session->frame[4], len + 1);
+	session->client.write(session->frame, MB_MBAP_LEN + len);
+	session->len = 0;
+}
+
+/* At most one request per session per call, so a master sending
+ * back-to-back requests does not starve the others.
+ */
+void mb_task(void)
+{
+	uint8_t i;
+
+	mb_session_accept();
+	for (i = 0; i < MB_SESSIONS_MAX; i++)
+		mb_session_task(&mb_sessions[(mb_session_first + i) %
+					     MB_SESSIONS_MAX]);
+	mb_session_first = (mb_session_first + 1) % MB_SESSIONS_MAX;
+}
+
+void pin_mb_init(struct pin *pin)
+{
+	switch (pin->type) {
+	case PIN_TYPE_RELAY:
+	case PIN_TYPE_DIGITAL_OUTPUT:
+		bitSet(mb_coils.valid[pin->mb_index / 8], pin->mb_index % 8);
+		break;
+	case PIN_TYPE_PWM_OUTPUT:
+		bitSet(mb_hregs.valid[pin->mb_index / 8], pin->mb_index % 8);
+		break;
+	case PIN_TYPE_DIGITAL_INPUT:
+		bitSet(mb_ists.valid[pin->mb_index / 8], pin->mb_index % 8);
+		break;
+	case PIN_TYPE_ANALOG_INPUT:
+		bitSet(mb_iregs.valid[pin->mb_index / 8], pin->mb_index % 8);
+		break;
+	}
+}
+
+void pins_outputs_apply(void)
 {
 	struct pin *pin;
 	word new_state;
@@ -243,46 +693,67 @@ void pins_refresh()
 		switch (pin->type) {
 		case PIN_TYPE_RELAY:
 		case PIN_TYPE_DIGITAL_OUTPUT:
-			new_state = mb.Coil(pin->mb_index);
+			new_state = bitRead(mb_coils.state[pin->mb_index / 8],
+					    pin->mb_index % 8);
 			break;
 		case PIN_TYPE_PWM_OUTPUT:
-			new_state = mb.Hreg(pin->mb_index);
-			break;
-		case PIN_TYPE_DIGITAL_INPUT:
-			new_state = digitalRead(pin->pin);
-			break;
-		case PIN_TYPE_ANALOG_INPUT:
-			new_state = analogRead(pin->pin);
+			new_state = mb_hregs.state[pin->mb_index];
 			break;
+		default:
+			continue;
 		}
 		if (pin->state == new_state)
 			continue;
 		switch (pin->type) {
 		case PIN_TYPE_RELAY:
-			Serial.println((String) "Setting relay R" +
-				       pin->index + " to " + new_state);
+			pins_log("Setting relay R%d to %u",
+				 pin->index, new_state);
 			digitalWrite(pin->pin, new_state);
 			break;
 		case PIN_TYPE_DIGITAL_OUTPUT:
-			Serial.println((String) "Setting digital output D" +
-				       pin->index + " to " + new_state);
+			pins_log("Setting digital output D%d to %u",
+				 pin->index, new_state);
 			digitalWrite(pin->pin, new_state);
 			break;
 		case PIN_TYPE_PWM_OUTPUT:
-			Serial.println((String) "Setting PWM output D" +
-				       pin->index + " to " + new_state);
+			pins_log("Setting PWM output D%d to %u",
+				 pin->index, new_state);
 			analogWrite(pin->pin, new_state);
 			break;
+		default:
+			break;
+		}
+		pin->state = new_state;
+	}
+}
+
+void pins_inputs_refresh(void)
+{
+	struct pin *pin;
+	word new_state;
+	unsigned int i;
+
+	for_each_pin(pin, i) {
+		switch (pin->type) {
 		case PIN_TYPE_DIGITAL_INPUT:
-			mb.Ists(pin->mb_index, new_state);
-			Serial.println((String) "Updating digital input A" +
-				       pin->index + " to " + new_state);
+			new_state = digitalRead(pin->pin);
+			if (pin->state == new_state)
+				continue;
+			bitWrite(mb_ists.state[pin->mb_index / 8],
+				 pin->mb_index % 8, new_state);
+			pins_log("Updating digital input A%d to %u",
+				 pin->index, new_state);
 			break;
 		case PIN_TYPE_ANALOG_INPUT:
-			mb.Ireg(pin->mb_index, new_state);
-			Serial.println((String) "Updating analog input A" +
-				       pin->index + " to " + new_state);
+			new_state = analogRead(pin->pin);
+			if (pin->state == new_state)
+				continue;
+			mb_iregs.state[pin->mb_index] = new_state;
+			pins_log("Updating analog input A%d to %u",
+				 pin->index, new_state);
 			break;
+		default:
+			continue;
 		}
 		pin->state = new_state;
 	}
@@ -297,33 +768,32 @@ void pins_init(void)
 		switch (pin->type) {
 		case PIN_TYPE_RELAY:
 		case PIN_TYPE_DIGITAL_OUTPUT:
-			pinMode(pin->pin, OUTPUT);
-			mb.addCoil(pin->mb_index);
-			break;
 		case PIN_TYPE_PWM_OUTPUT:
 			pinMode(pin->pin, OUTPUT);
-			mb.addHreg(pin->mb_index);
 			break;
 		case PIN_TYPE_DIGITAL_INPUT:
-			pinMode(pin->pin, INPUT);
-			mb.addIsts(pin->mb_index);
-			break;
 		case PIN_TYPE_ANALOG_INPUT:
 			pinMode(pin->pin, INPUT);
-			mb.addIreg(pin->mb_index);
 			break;
 		}
+		pin_mb_init(pin);
 	}
 }
 
 void setup() {
 	Serial.begin(9600);
 	Serial.println("Controllino Modbus TCP slave");
-	mb.config(mac, ip);
+	Ethernet.begin(mac, ip);
+	mb_server.begin();
 	pins_init();
 }
 
 void loop() {
-	mb.task();
-	pins_refresh();
+	mb_task();
+	if (mb_outputs_changed) {
+		mb_outputs_changed = false;
+		pins_outputs_apply();
+	}
+	pins_inputs_refresh();
+	pins_log_flush();
 }
@@ -48,51 +48,123 @@ struct eeprom_settings {
 	bool debug;
 };
 
-#define EEPROM_CRC_ADDR 0
-#define EEPROM_CRC_LEN sizeof(unsigned long)
-#define EEPROM_PAYLOAD_ADDR (EEPROM_CRC_ADDR + EEPROM_CRC_LEN)
-#define EEPROM_MAGIC_ADDR (EEPROM_CRC_ADDR + EEPROM_CRC_LEN)
+/* Settings and every alias slot are stored as separate records, each
+ * followed by its own CRC, so storing one of them only touches and
+ * checksums that record.
+ */
+#define EEPROM_MAGIC_ADDR 0
 #define EEPROM_MAGIC_LEN sizeof(unsigned long)
-#define EEPROM_MAGIC_VAL 0xE38A2C54UL /* This needs to be changed
+#define EEPROM_MAGIC_VAL 0x5B1E07C3UL /* This needs to be changed
 				       * whenever EEPROM layout is changed
 				       */
+#define EEPROM_CRC_LEN sizeof(uint32_t)
 #define EEPROM_SETTINGS_ADDR (EEPROM_MAGIC_ADDR + EEPROM_MAGIC_LEN)
 #define EEPROM_SETTINGS_LEN sizeof(struct eeprom_settings)
-#define EEPROM_ALIASES_ADDR (EEPROM_SETTINGS_ADDR + EEPROM_SETTINGS_LEN)
+#define EEPROM_ALIASES_ADDR (EEPROM_SETTINGS_ADDR + EEPROM_SETTINGS_LEN + \
+			     EEPROM_CRC_LEN)
 #define EEPROM_ALIAS_LEN sizeof(struct eeprom_name)
 #define EEPROM_ALIAS_ADDR(index) (EEPROM_ALIASES_ADDR + \
-				  EEPROM_ALIAS_LEN * index)
+				  (EEPROM_ALIAS_LEN + EEPROM_CRC_LEN) * (index))
+
+/* CRC-32 (IEEE 802.3), reflected polynomial 0xEDB88320 */
+const uint32_t crc32_table[256] PROGMEM = {
+	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
+	0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
+	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
+	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
+	0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
+	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
+	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
+	0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
+	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
+	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
+	0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940,
+	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
+	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116,
+	0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
+	0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
+	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
+	0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a,
+	0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
+	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818,
+	0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
+	0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
+	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
+	0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c,
+	0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
+	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
+	0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
+	0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
+	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
+	0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086,
+	0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
+	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4,
+	0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
+	0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
+	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
+	0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
+	0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
+	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe,
+	0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
+	0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
+	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
+	0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252,
+	0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
+	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60,
+	0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
+	0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
+	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
+	0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04,
+	0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
+	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
+	0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
+	0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
+	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
+	0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e,
+	0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
+	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
+	0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
+	0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
+	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
+	0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0,
+	0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
+	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6,
+	0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
+	0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
+	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
+};
 
-unsigned long eeprom_crc(void)
+uint32_t crc32(const void *buf, unsigned int len)
 {
-	const unsigned long crc_table[16] = {
-		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
-		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
-		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
-		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
-	};
-	unsigned long crc = ~0L;
-	unsigned int i;
+	const uint8_t *data = (const uint8_t *) buf;
+	uint32_t crc = 0xffffffffUL;
 
-	for (i = EEPROM_MAGIC_ADDR; i < EEPROM.length(); i++) {
-		crc = crc_table[(crc ^ EEPROM[i]) & 0x0f] ^ (crc >> 4);
-		crc = crc_table[(crc ^ (EEPROM[i] >> 4)) & 0x0f] ^ (crc >> 4);
-		crc = ~crc;
-	}
-	return crc;
+	while (len--)
+		crc = pgm_read_dword(&crc32_table[(crc ^ *data++) & 0xff]) ^
+		      (crc >> 8);
+	return ~crc;
 }
 
-bool eeprom_crc_ok(void)
+bool eeprom_record_load(unsigned int addr, void *buf, unsigned int len)
 {
-	unsigned long crc;
+	uint8_t *data = (uint8_t *) buf;
+	uint32_t crc;
+	unsigned int i;
 
-	EEPROM.get(EEPROM_CRC_ADDR, crc);
-	return crc == eeprom_crc();
+	for (i = 0; i < len; i++)
+		data[i] = EEPROM.read(addr + i);
+	EEPROM.get(addr + len, crc);
+	return crc == crc32(buf, len);
 }
 
-void eeprom_crc_store(void)
+void eeprom_record_store(unsigned int addr, const void *buf, unsigned int len)
 {
-	EEPROM.put(EEPROM_CRC_ADDR, eeprom_crc());
+	const uint8_t *data = (const uint8_t *) buf;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		EEPROM.update(addr + i, data[i]);
+	EEPROM.put(addr + len, crc32(buf, len));
 }
 
 bool eeprom_magic_ok(void)
@@ -110,36 +182,43 @@ void eeprom_magic_store(void)
 
 static bool eeprom_ok = false;
 
-void eeprom_reset(void)
+void eeprom_reset(unsigned int aliases_count)
 {
+	struct eeprom_settings eeprom_settings;
+	struct eeprom_name name;
 	unsigned int i;
 
 	Serial.println("EEPROM: Performing reset");
-	for (i = 0; i < EEPROM.length(); i++) {
+	memset(&eeprom_settings, 0, sizeof(eeprom_settings));
+	eeprom_record_store(EEPROM_SETTINGS_ADDR, &eeprom_settings,
+			    EEPROM_SETTINGS_LEN);
+	memset(&name, 0, sizeof(name));
+	for (i = 0; i < aliases_count; i++) {
 		wdt_reset();
-		EEPROM.write(i, 0);
+		eeprom_record_store(EEPROM_ALIAS_ADDR(i), &name,
+				    EEPROM_ALIAS_LEN);
 	}
+	/* Magic goes last so that an interrupted reset is redone. */
 	Serial.println("EEPROM: Storing magic");
 	eeprom_magic_store();
-	Serial.println("EEPROM: Sroring CRC");
-	eeprom_crc_store();
 }
 
-void eeprom_check(void)
+void eeprom_check(unsigned int aliases_count)
 {
-	if (!eeprom_crc_ok()) {
-		Serial.println("EEPROM: Incorrect CRC");
-		goto eeprom_reset;
-	}
-	if (!eeprom_magic_ok()) {
-		Serial.println("EEPROM: Incorrect magic");
-		goto eeprom_reset;
-	}
-	goto all_fine;
+	struct eeprom_settings eeprom_settings;
 
-eeprom_reset:
-	eeprom_reset();
-	if (!eeprom_crc_ok() || !eeprom_magic_ok()) {
+	if (EEPROM_ALIAS_ADDR(aliases_count) > EEPROM.length()) {
+		Serial.println("EEPROM: Layout does not fit, disabling EEPROM usage");
+		return;
+	}
+	if (eeprom_magic_ok())
+		goto all_fine;
+
+	Serial.println("EEPROM: Incorrect magic");
+	eeprom_reset(aliases_count);
+	if (!eeprom_magic_ok() ||
+	    !eeprom_record_load(EEPROM_SETTINGS_ADDR, &eeprom_settings,
+				EEPROM_SETTINGS_LEN)) {
 		Serial.println("EEPROM: Reset was not successful, disabling EEPROM usage");
 		return;
 	}
@@ -149,7 +228,7 @@ all_fine:
 }
 
 struct settings {
-	String name;
+	char name[NAME_LEN];
 	uint8_t mac[ETH_ALEN];
 	IPAddress ip;
 	IPAddress server_ip;
@@ -157,17 +236,24 @@ struct settings {
 	bool debug;
 };
 
-String eeprom_string_load(struct eeprom_name *name)
+/* Copies at most NAME_LEN - 1 characters, zero-padding the rest. */
+void name_copy(char *dst, const char *src)
+{
+	strncpy(dst, src, NAME_LEN - 1);
+	dst[NAME_LEN - 1] = '\0';
+}
+
+void eeprom_string_load(struct eeprom_name *name, char *str)
 {
 	name->name[NAME_LEN - 1] = '\0';
-	return String(name->name);
+	name_copy(str, name->name);
 }
 
-void eeprom_string_store(struct eeprom_name *name, String str)
+void eeprom_string_store(struct eeprom_name *name, const char *str)
 {
-	if (str.length() >= NAME_LEN)
+	if (strlen(str) >= NAME_LEN)
 		Serial.println("EEPROM: Trimming string during store");
-	str.toCharArray(name->name, NAME_LEN);
+	name_copy(name->name, str);
 }
 
 void eeprom_settings_load(struct settings *settings)
@@ -175,7 +261,6 @@ void eeprom_settings_load(struct settings *settings)
 	struct eeprom_settings eeprom_settings;
 
 	memset(settings, 0, sizeof(*settings));
-	settings->name = "";
 	settings->ip = INADDR_NONE;
 	settings->server_ip = INADDR_NONE;
 	settings->debug = false;
@@ -183,9 +268,13 @@ void eeprom_settings_load(struct settings *settings)
 	if (!eeprom_ok)
 		return;
 
-	EEPROM.get(EEPROM_SETTINGS_ADDR, eeprom_settings);
+	if (!eeprom_record_load(EEPROM_SETTINGS_ADDR, &eeprom_settings,
+				EEPROM_SETTINGS_LEN)) {
+		Serial.println("EEPROM: Incorrect settings CRC");
+		return;
+	}
 
-	settings->name = eeprom_string_load(&eeprom_settings.name);
+	eeprom_string_load(&eeprom_settings.name, settings->name);
 	memcpy(settings->mac, eeprom_settings.mac, ETH_ALEN);
 	settings->ip = IPAddress(eeprom_settings.ip);
 	settings->server_ip = IPAddress(eeprom_settings.server_ip);
@@ -200,6 +289,8 @@ void eeprom_settings_store(struct settings *settings)
 	if (!eeprom_ok)
 		return;
 
+	/* Keep the unused tail zeroed so unchanged bytes are not rewritten. */
+	memset(&eeprom_settings, 0, sizeof(eeprom_settings));
 	eeprom_string_store(&eeprom_settings.name, settings->name);
 	memcpy(eeprom_settings.mac, settings->mac, ETH_ALEN);
 	eeprom_settings.ip = settings->ip;
@@ -207,32 +298,37 @@ void eeprom_settings_store(struct settings *settings)
 	eeprom_settings.server_port = settings->server_port;
 	eeprom_settings.debug = settings->debug;
 
-	EEPROM.put(EEPROM_SETTINGS_ADDR, eeprom_settings);
-	eeprom_crc_store();
+	eeprom_record_store(EEPROM_SETTINGS_ADDR, &eeprom_settings,
+			    EEPROM_SETTINGS_LEN);
 }
 
-String eeprom_alias_load(unsigned int index)
+void eeprom_alias_load(unsigned int index, char *alias)
 {
 	struct eeprom_name name;
 
+	alias[0] = '\0';
 	if (!eeprom_ok)
-		return "";
+		return;
 
-	EEPROM.get(EEPROM_ALIAS_ADDR(index), name);
-	return eeprom_string_load(&name);
+	if (!eeprom_record_load(EEPROM_ALIAS_ADDR(index), &name,
+				EEPROM_ALIAS_LEN)) {
+		Serial.println("EEPROM: Incorrect alias CRC");
+		return;
+	}
+	eeprom_string_load(&name, alias);
 }
 
-void eeprom_alias_store(unsigned int index, String alias)
+void eeprom_alias_store(unsigned int index, const char *alias)
 {
 	struct eeprom_name name;
 
 	if (!eeprom_ok)
 		return;
 
+	memset(&name, 0, sizeof(name));
 	eeprom_string_store(&name, alias);
 
-	EEPROM.put(EEPROM_ALIAS_ADDR(index), name);
-	eeprom_crc_store();
+	eeprom_record_store(EEPROM_ALIAS_ADDR(index), &name, EEPROM_ALIAS_LEN);
 }
 
 byte zero_mac[ETH_ALEN] = { 0, };
@@ -292,9 +388,9 @@ void settings_load()
 {
 	eeprom_settings_load(&settings);
 
-	if (!settings.name.length()) {
+	if (!settings.name[0]) {
 		Serial.println("Using default \"name\" setting");
-		settings.name = settings_dflt.name;
+		name_copy(settings.name, settings_dflt.name);
 	}
 	if (!memcmp(settings.mac, zero_mac, sizeof(settings.mac))) {
 		Serial.println("Using default \"mac\" setting");
@@ -333,7 +429,7 @@ enum pin_type {
 	PIN_TYPE_ANALOG_INPUT,
 };
 
-String pin_type_subtopic[] = {
+const char *pin_type_subtopic[] = {
 	[PIN_TYPE_RELAY] = "relay",
 	[PIN_TYPE_DIGITAL_OUTPUT] = "digital_output",
 	[PIN_TYPE_PWM_OUTPUT] = "pwm_output",
@@ -347,7 +443,7 @@ struct pin {
 	uint8_t pin; /* pin number */
 	word old_state;
 	word state;
-	String alias;
+	unsigned int alias; /* offset in alias_pool */
 };
 
 bool pin_type_output(struct pin *pin)
@@ -512,46 +608,108 @@ struct pin pins[] = {
 #define for_each_pin(pin, i)								\
 	for (i = 0, pin = &pins[i]; i < PINS_COUNT; pin = &pins[++i])
 
-String pin_topic(struct pin *pin)
+/* Topics are formatted into a single static buffer, valid until the next
+ * call, so no topic string ever lives on the heap.
+ */
+#define TOPIC_BUF_LEN 64
+
+char topic_buf[TOPIC_BUF_LEN];
+
+char *pin_topic(struct pin *pin, const char *suffix)
+{
+	snprintf(topic_buf, TOPIC_BUF_LEN, "%s/%s/%d%s", settings.name,
+		 pin_type_subtopic[pin->type], pin->index, suffix);
+	return topic_buf;
+}
+
+/* Aliases are kept back to back in one pool, each NUL-terminated,
+ * pin->alias holding the offset of its string. Removing an alias closes
+ * the gap, so the pool never fragments.
+ */
+#define ALIAS_POOL_LEN 512
+#define ALIAS_NONE 0xffff
+
+char alias_pool[ALIAS_POOL_LEN];
+unsigned int alias_pool_used;
+
+bool pin_alias_exists(struct pin *pin)
 {
-	return settings.name + "/" +
-	       pin_type_subtopic[pin->type] + "/" +
-	       pin->index;
+	return pin->alias != ALIAS_NONE;
 }
 
-String pin_topic_set(struct pin *pin)
+const char *pin_alias(struct pin *pin)
 {
-	return pin_topic(pin) + "/set";
+	return &alias_pool[pin->alias];
 }
 
-String pin_topic_alias(struct pin *pin)
+char *pin_alias_topic(struct pin *pin, const char *suffix)
 {
-	return pin_topic(pin) + "/alias";
+	snprintf(topic_buf, TOPIC_BUF_LEN, "%s/%s%s", settings.name,
+		 pin_alias(pin), suffix);
+	return topic_buf;
 }
 
-bool pin_alias_exists(struct pin *pin)
+void pin_alias_remove(struct pin *pin)
+{
+	unsigned int offset = pin->alias;
+	unsigned int len;
+	struct pin *other;
+	unsigned int i;
+
+	if (!pin_alias_exists(pin))
+		return;
+	len = strlen(&alias_pool[offset]) + 1;
+	memmove(&alias_pool[offset], &alias_pool[offset + len],
+		alias_pool_used - offset - len);
+	alias_pool_used -= len;
+	pin->alias = ALIAS_NONE;
+	for_each_pin(other, i)
+		if (pin_alias_exists(other) && other->alias > offset)
+			other->alias -= len;
+}
+
+bool pin_alias_add(struct pin *pin, const char *alias)
 {
-	return pin->alias != "";
+	unsigned int len = strlen(alias);
+
+	if (len >= NAME_LEN)
+		len = NAME_LEN - 1;
+	if (alias_pool_used + len + 1 > ALIAS_POOL_LEN)
+		return false;
+	memcpy(&alias_pool[alias_pool_used], alias, len);
+	alias_pool[alias_pool_used + len] = '\0';
+	pin->alias = alias_pool_used;
+	alias_pool_used += len + 1;
+	return true;
 }
 
-String pin_alias_topic(struct pin *pin)
+void pin_alias_print(struct pin *pin)
 {
-	return settings.name + "/" + pin->alias;
+	Serial.print("\"");
+	Serial.print(pin_topic(pin, ""));
+	Serial.print("\" -> \"");
+	Serial.print(pin_alias_topic(pin, ""));
+	Serial.println("\"");
 }
 
-String pin_alias_topic_set(struct pin *pin)
+void pin_debug_print(const char *msg, struct pin *pin)
 {
-	return pin_alias_topic(pin) + "/set";
+	if (!settings.debug)
+		return;
+	Serial.print(msg);
+	Serial.print(pin->index);
+	Serial.print(" to ");
+	Serial.println(pin->state);
 }
 
 void pin_publish(struct pin *pin)
 {
 	char state_buf[16];
 
-	String(pin->state).toCharArray(state_buf, sizeof(state_buf));
-	client.publish(pin_topic(pin).c_str(), state_buf);
+	snprintf(state_buf, sizeof(state_buf), "%u", pin->state);
+	client.publish(pin_topic(pin, ""), state_buf);
 	if (pin_alias_exists(pin))
-		client.publish(pin_alias_topic(pin).c_str(), state_buf);
+		client.publish(pin_alias_topic(pin, ""), state_buf);
 }
 
 void input_pins_update_state()
@@ -588,9 +746,7 @@ void input_pins_publish(bool changed_only)
 			if (pin->old_state == pin->state && changed_only)
 				continue;
 			pin_publish(pin);
-			if (settings.debug)
-				Serial.println((String) "Updating digital input D" +
-					       pin->index + " to " + pin->state);
+			pin_debug_print("Updating digital input D", pin);
 			pin->old_state = pin->state;
 			break;
 		case PIN_TYPE_ANALOG_INPUT:
@@ -598,9 +754,7 @@ void input_pins_publish(bool changed_only)
 			    changed_only)
 				continue;
 			pin_publish(pin);
-			if (settings.debug)
-				Serial.println((String) "Updating analog input A" +
-					       pin->index + " to " + pin->state);
+			pin_debug_print("Updating analog input A", pin);
 			pin->old_state = pin->state;
 			break;
 		default:
@@ -616,25 +770,19 @@ void output_pin_update_state(struct pin *pin, word new_state)
 	switch (pin->type) {
 	case PIN_TYPE_RELAY:
 		pin->state = new_state;
-		if (settings.debug)
-			Serial.println((String) "Setting relay R" +
-				       pin->index + " to " + pin->state);
+		pin_debug_print("Setting relay R", pin);
 		digitalWrite(pin->pin, pin->state);
 		pin_publish(pin);
 		break;
 	case PIN_TYPE_DIGITAL_OUTPUT:
 		pin->state = new_state;
-		if (settings.debug)
-			Serial.println((String) "Setting digital output D" +
-				       pin->index + " to " + pin->state);
+		pin_debug_print("Setting digital output D", pin);
 		digitalWrite(pin->pin, pin->state);
 		pin_publish(pin);
 		break;
 	case PIN_TYPE_PWM_OUTPUT:
 		pin->state = new_state;
-		if (settings.debug)
-			Serial.println((String) "Setting PWM output D" +
-				       pin->index + " to " + pin->state);
+		pin_debug_print("Setting PWM output D", pin);
 		analogWrite(pin->pin, pin->state);
 		pin_publish(pin);
 		break;
@@ -643,33 +791,80 @@ void output_pin_update_state(struct pin *pin, word new_state)
 	}
 }
 
-void pin_alias_set(struct pin *pin, unsigned int pin_index, String alias)
+void pin_alias_set(struct pin *pin, unsigned int pin_index, const char *alias)
 {
 	if (pin_alias_exists(pin))
-		client.unsubscribe((pin_alias_topic_set(pin)).c_str());
-	pin->alias = alias;
-	eeprom_alias_store(pin_index, pin->alias);
-	client.subscribe((pin_alias_topic_set(pin)).c_str());
-	if (settings.debug)
-		Serial.println((String) "Set alias \"" + pin_topic(pin) +
-			       "\" -> \"" + pin_alias_topic(pin) + "\"");
+		client.unsubscribe(pin_alias_topic(pin, "/set"));
+	pin_alias_remove(pin);
+	if (alias[0] && !pin_alias_add(pin, alias))
+		Serial.println("Alias pool is full");
+	eeprom_alias_store(pin_index, pin_alias_exists(pin) ? pin_alias(pin) : "");
+	if (!pin_alias_exists(pin))
+		return;
+	client.subscribe(pin_alias_topic(pin, "/set"));
+	if (settings.debug) {
+		Serial.print("Set alias ");
+		pin_alias_print(pin);
+	}
+}
+
+/* Returns the rest of the topic after "<subtopic>/" or NULL. */
+const char *subtopic_match(const char *topic, const char *subtopic)
+{
+	size_t len = strlen(subtopic);
+
+	if (strncmp(topic, subtopic, len) || topic[len] != '/')
+		return NULL;
+	return topic + len + 1;
+}
+
+const char *topic_strip_prefix(const char *topic)
+{
+	return subtopic_match(topic, settings.name);
+}
+
+/* Returns the rest of the topic after "<type>/<index>/" or NULL. */
+const char *pin_subtopic_match(struct pin *pin, const char *subtopic)
+{
+	const char *index_str;
+	char *end;
+
+	index_str = subtopic_match(subtopic, pin_type_subtopic[pin->type]);
+	if (!index_str || !isdigit(index_str[0]) ||
+	    (index_str[0] == '0' && index_str[1] != '/'))
+		return NULL;
+	if (strtol(index_str, &end, 10) != pin->index || *end != '/')
+		return NULL;
+	return end + 1;
 }
 
-void pins_msg_process(String topic, String value)
+void pins_msg_process(const char *topic, const char *value)
 {
+	const char *subtopic;
+	const char *rest;
 	struct pin *pin;
 	unsigned int i;
 
-	if (settings.debug)
-		Serial.println((String) "Processing topic \"" + topic +
-			       "\" with value \"" + value + "\"");
+	if (settings.debug) {
+		Serial.print("Processing topic \"");
+		Serial.print(topic);
+		Serial.print("\" with value \"");
+		Serial.print(value);
+		Serial.println("\"");
+	}
+	subtopic = topic_strip_prefix(topic);
+	if (!subtopic)
+		return;
 	for_each_pin(pin, i) {
-		if (pin_type_output(pin) &&
-		    (pin_topic_set(pin) == topic ||
-		     (pin_alias_exists(pin) &&
-		      pin_alias_topic_set(pin) == topic)))
-			output_pin_update_state(pin, value.toInt());
-		else if (pin_topic_alias(pin) == topic)
+		rest = pin_subtopic_match(pin, subtopic);
+		if (!rest && pin_alias_exists(pin))
+			rest = subtopic_match(subtopic, pin_alias(pin));
+		if (!rest)
+			continue;
+		if (pin_type_output(pin) && !strcmp(rest, "set"))
+			output_pin_update_state(pin, strtol(value, NULL, 10));
+		else if (!strcmp(rest, "alias") &&
+			 pin_subtopic_match(pin, subtopic))
 			pin_alias_set(pin, i, value);
 	}
 }
@@ -681,29 +876,46 @@ void pins_subscribe(void)
 
 	for_each_pin(pin, i) {
 		if (pin_type_output(pin)) {
-			client.subscribe((pin_topic_set(pin)).c_str());
+			client.subscribe(pin_topic(pin, "/set"));
 			if (pin_alias_exists(pin))
-				client.subscribe((pin_alias_topic_set(pin)).c_str());
+				client.subscribe(pin_alias_topic(pin, "/set"));
 		}
-		client.subscribe((pin_topic_alias(pin)).c_str());
+		client.subscribe(pin_topic(pin, "/alias"));
 	}
 }
 
 void pins_init(void)
 {
+	char alias[NAME_LEN];
 	struct pin *pin;
 	unsigned int i;
 
+	alias_pool_used = 0;
+	for_each_pin(pin, i)
+		pin->alias = ALIAS_NONE;
 	for_each_pin(pin, i) {
-		pin->alias = eeprom_alias_load(i);
+		eeprom_alias_load(i, alias);
+		if (alias[0] && !pin_alias_add(pin, alias))
+			Serial.println("Alias pool is full");
 		pinMode(pin->pin, pin_type_output(pin) ? OUTPUT : INPUT);
 	}
 }
 
+/* Topic and payload point into the client buffer which gets reused by
+ * publish(), so take a copy before acting on the message.
+ */
+char msg_topic[TOPIC_BUF_LEN];
+char msg_value[NAME_LEN];
+
 void callback(char *topic, byte *payload, unsigned int length)
 {
-	payload[length] = '\0';
-	pins_msg_process(String(topic), String((char *) payload));
+	if (length >= sizeof(msg_value))
+		length = sizeof(msg_value) - 1;
+	memcpy(msg_value, payload, length);
+	msg_value[length] = '\0';
+	strncpy(msg_topic, topic, sizeof(msg_topic) - 1);
+	msg_topic[sizeof(msg_topic) - 1] = '\0';
+	pins_msg_process(msg_topic, msg_value);
 }
 
 void delay_with_wdt(unsigned int ms)
@@ -718,25 +930,40 @@ void delay_with_wdt(unsigned int ms)
 	}
 }
 
-String cmdline_cut(String *cmdline)
+char *str_trim(char *str)
 {
-	int space_index = (*cmdline).indexOf(' ');
-	String first;
-	String rest;
+	char *end;
+
+	while (isspace(*str))
+		str++;
+	end = str + strlen(str);
+	while (end > str && isspace(end[-1]))
+		*--end = '\0';
+	return str;
+}
+
+/* Cuts the first word off the command line in place and returns it. */
+char *cmdline_cut(char **cmdline)
+{
+	char *first = *cmdline;
+	char *space = strchr(first, ' ');
 
-	if (space_index == -1) {
-		first = *cmdline;
-		*cmdline = "";
+	if (!space) {
+		*cmdline = first + strlen(first);
 	} else {
-		first = (*cmdline).substring(0, space_index);
-		first.trim();
-		rest = (*cmdline).substring(space_index);
-		rest.trim();
-		*cmdline = rest;
+		*space = '\0';
+		*cmdline = str_trim(space + 1);
 	}
 	return first;
 }
 
+void cmd_unknown(const char *cmd)
+{
+	Serial.print("Unknown command \"");
+	Serial.print(cmd);
+	Serial.println("\"");
+}
+
 void cmd_reset(void)
 {
 	Serial.println("Performing system reset");
@@ -747,37 +974,37 @@ void cmd_reset(void)
 
 void cmd_factory_reset(void)
 {
-	eeprom_reset();
+	eeprom_reset(PINS_COUNT);
 	cmd_reset();
 }
 
-void cmd_status(String cmdline)
+void cmd_status(char *cmdline)
 {
-	String cmd;
+	char *cmd;
 
 	cmd = cmdline_cut(&cmdline);
-	if (cmd == "" || cmd == "print")
+	if (!cmd[0] || !strcmp(cmd, "print"))
 		Serial.println(mqtt_connected ? "connected" : "disconnected");
 	else
-		Serial.println((String) "Unknown command \"" + cmd + "\"");
+		cmd_unknown(cmd);
 }
 
-void cmd_settings_set(String cmdline)
+void cmd_settings_set(char *cmdline)
 {
-	String cmd;
+	char *cmd;
 
 	cmd = cmdline_cut(&cmdline);
-	if (cmd == "") {
+	if (!cmd[0]) {
 		Serial.println("Failed to parse command line");
 		return;
 	}
-	if (cmd == "name") {
-		if (cmdline == "") {
+	if (!strcmp(cmd, "name")) {
+		if (!cmdline[0]) {
 			Serial.println("Invalid name");
 			return;
 		}
-		settings.name = cmdline;
-	} else if (cmd == "ip") {
+		name_copy(settings.name, cmdline);
+	} else if (!strcmp(cmd, "ip")) {
 		IPAddress ip;
 
 		if (!ip.fromString(cmdline)) {
@@ -785,7 +1012,7 @@ void cmd_settings_set(String cmdline)
 			return;
 		}
 		settings.ip = ip;
-	} else if (cmd == "server_ip") {
+	} else if (!strcmp(cmd, "server_ip")) {
 		IPAddress ip;
 
 		if (!ip.fromString(cmdline)) {
@@ -793,39 +1020,47 @@ void cmd_settings_set(String cmdline)
 			return;
 		}
 		settings.server_ip = ip;
-	} else if (cmd == "server_port") {
-		long port = cmdline.toInt();
+	} else if (!strcmp(cmd, "server_port")) {
+		long port = strtol(cmdline, NULL, 10);
 
 		if (port < 0 || port > 0xffff) {
 			Serial.println("Invalid port");
 			return;
 		}
 		settings.server_port = port;
-	} else if (cmd == "debug") {
-		if (cmdline == "true")
+	} else if (!strcmp(cmd, "debug")) {
+		if (!strcmp(cmdline, "true"))
 			settings.debug = true;
-		else if (cmdline == "false")
+		else if (!strcmp(cmdline, "false"))
 			settings.debug = false;
 		else
 			Serial.println("Invalid value (not \"true\" or \"false\"");
 	} else {
-		Serial.println((String) "Unknown command \"" + cmd + "\"");
+		cmd_unknown(cmd);
 	}
 }
 
-void cmd_settings(String cmdline)
+void cmd_settings(char *cmdline)
 {
-	String cmd;
+	char *cmd;
 
 	cmd = cmdline_cut(&cmdline);
-	if (cmd == "" || cmd == "print")
+	if (!cmd[0] || !strcmp(cmd, "print"))
 		settings_print();
-	else if (cmd == "store")
+	else if (!strcmp(cmd, "store"))
 		settings_store();
-	else if (cmd == "set")
+	else if (!strcmp(cmd, "set"))
 		cmd_settings_set(cmdline);
 	else
-		Serial.println((String) "Unknown command \"" + cmd + "\"");
+		cmd_unknown(cmd);
+}
+
+void topic_print(const char *kind, const char *topic)
+{
+	Serial.print(kind);
+	Serial.print(" \"");
+	Serial.print(topic);
+	Serial.println("\"");
 }
 
 void cmd_topics_print(void)
@@ -835,26 +1070,26 @@ void cmd_topics_print(void)
 
 	for_each_pin(pin, i) {
 		if (pin_type_output(pin)) {
-			Serial.println((String) "S \"" + pin_topic_set(pin) + "\"");
+			topic_print("S", pin_topic(pin, "/set"));
 			if (pin_alias_exists(pin))
-				Serial.println((String) "S \"" + pin_alias_topic_set(pin) + "\"");
+				topic_print("S", pin_alias_topic(pin, "/set"));
 		}
-		Serial.println((String) "S \"" + pin_topic_alias(pin) + "\"");
-		Serial.println((String) "P \"" + pin_topic(pin) + "\"");
+		topic_print("S", pin_topic(pin, "/alias"));
+		topic_print("P", pin_topic(pin, ""));
 		if (pin_alias_exists(pin))
-			Serial.println((String) "P \"" + pin_alias_topic(pin) + "\"");
+			topic_print("P", pin_alias_topic(pin, ""));
 	}
 }
 
-void cmd_topics(String cmdline)
+void cmd_topics(char *cmdline)
 {
-	String cmd;
+	char *cmd;
 
 	cmd = cmdline_cut(&cmdline);
-	if (cmd == "" || cmd == "print")
+	if (!cmd[0] || !strcmp(cmd, "print"))
 		cmd_topics_print();
 	else
-		Serial.println((String) "Unknown command \"" + cmd + "\"");
+		cmd_unknown(cmd);
 }
 
 void cmd_aliases_print(void)
@@ -865,20 +1100,19 @@ void cmd_aliases_print(void)
 	for_each_pin(pin, i) {
 		if (!pin_alias_exists(pin))
 			continue;
-		Serial.println((String) "\"" + pin_topic(pin) +
-			       "\" -> \"" + pin_alias_topic(pin) + "\"");
+		pin_alias_print(pin);
 	}
 }
 
-void cmd_aliases(String cmdline)
+void cmd_aliases(char *cmdline)
 {
-	String cmd;
+	char *cmd;
 
 	cmd = cmdline_cut(&cmdline);
-	if (cmd == "" || cmd == "print")
+	if (!cmd[0] || !strcmp(cmd, "print"))
 		cmd_aliases_print();
 	else
-		Serial.println((String) "Unknown command \"" + cmd + "\"");
+		cmd_unknown(cmd);
 }
 
 void cmd_help(void)
@@ -898,32 +1132,35 @@ void cmd_help(void)
 	Serial.println("  aliases print");
 }
 
-void cmdline_exec(String cmdline)
+void cmdline_exec(char *cmdline)
 {
-	String cmd;
+	char *cmd;
 
 	cmd = cmdline_cut(&cmdline);
-	if (cmd == "")
+	if (!cmd[0])
 		return;
-	if (cmd == "help" || cmd == "?")
+	if (!strcmp(cmd, "help") || !strcmp(cmd, "?"))
 		cmd_help();
-	else if (cmd == "reset")
+	else if (!strcmp(cmd, "reset"))
 		cmd_reset();
-	else if (cmd == "factory_reset")
+	else if (!strcmp(cmd, "factory_reset"))
 		cmd_factory_reset();
-	else if (cmd == "status")
+	else if (!strcmp(cmd, "status"))
 		cmd_status(cmdline);
-	else if (cmd == "settings")
+	else if (!strcmp(cmd, "settings"))
 		cmd_settings(cmdline);
-	else if (cmd == "topics")
+	else if (!strcmp(cmd, "topics"))
 		cmd_topics(cmdline);
-	else if (cmd == "aliases")
+	else if (!strcmp(cmd, "aliases"))
 		cmd_aliases(cmdline);
 	else
-		Serial.println((String) "Unknown command \"" + cmd + "\"");
+		cmd_unknown(cmd);
 }
 
-String cmdline = "";
+#define CMDLINE_LEN 64
+
+char cmdline[CMDLINE_LEN];
+uint8_t cmdline_len;
 
 void cmdline_process(void)
 {
@@ -934,12 +1171,15 @@ void cmdline_process(void)
 
 	c = Serial.read();
 	Serial.print(c);
-	cmdline += c;
-	if (c != '\n')
+	if (c != '\n') {
+		/* Overlong lines are cut, the rest is dropped. */
+		if (cmdline_len < CMDLINE_LEN - 1)
+			cmdline[cmdline_len++] = c;
 		return;
-	cmdline.trim();
-	cmdline_exec(cmdline);
-	cmdline = "";
+	}
+	cmdline[cmdline_len] = '\0';
+	cmdline_exec(str_trim(cmdline));
+	cmdline_len = 0;
 	Serial.print("$ ");
 }
 
@@ -949,7 +1189,7 @@ void setup(void)
 	Serial.begin(9600);
 	Serial.println("Controllino MQTT client");
 
-	eeprom_check();
+	eeprom_check(PINS_COUNT);
 	settings_load();
 	wdt_reset();
 
@@ -980,7 +1220,7 @@ void loop(void)
 		    mqtt_last_attempt + MQTT_RETRY_TIMEOUT < now ||
 		    mqtt_last_attempt > now) {
 			mqtt_last_attempt = now;
-			if (client.connect(settings.name.c_str())) {
+			if (client.connect(settings.name)) {
 				if (settings.debug)
 					Serial.println("Connected to MQTT server");
 				mqtt_connected = true;
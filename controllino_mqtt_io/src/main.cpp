@@ -33,6 +33,31 @@ char name[NAME_SIZE];
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Subscribe to a few wildcard filters instead of each config item and
+ * output pin topic separately, saving a SUBSCRIBE round trip per topic
+ * on every connect. callback() ignores topics it does not know. */
+//#define MQTT_WILDCARD_SUBSCRIBE
+
+/* Besides the per-pin topics, publish the state of all pins as one
+ * retained JSON object on "<name>/state" on connect. Define this to also
+ * publish it after every loop() pass in which some pin changed. */
+//#define STATE_SNAPSHOT_ON_CHANGE
+
+/* Reading PINx directly avoids the port lookup and timer check digitalRead()
+ * does for every pin. Input pins are grouped by port in pins_init() so each
+ * used input register is read only once per scan. */
+#ifdef __AVR__
+#define INPUT_PORT_SCAN
+#endif
+
+/* Sample analog inputs in background, chaining conversions from the ADC
+ * complete interrupt round-robin over all analog input pins. Each channel
+ * is smoothed by an exponential moving average, input_pins_update_state()
+ * only picks up the cached values instead of blocking in analogRead(). */
+#ifdef __AVR__
+#define ADC_SAMPLER
+#endif
+
 enum pin_type {
 	PIN_TYPE_RELAY,
 	PIN_TYPE_DIGITAL_OUTPUT,
@@ -55,10 +80,19 @@ struct pin {
 	enum pin_type type;
 	int index; /* index within the group (R,D,A) */
 	uint8_t pin; /* pin number */
-	uint8_t new_state_cnt;
+	uint8_t filter; /* debounce window, ms */
+	volatile uint8_t debounced; /* level stable for at least filter */
+	uint8_t debounce_ms; /* how long the level differs from debounced */
 	word old_state;
 	word state;
 	unsigned long on_millis;
+#ifdef INPUT_PORT_SCAN
+	uint8_t port; /* index into input_ports */
+	uint8_t mask; /* bit within the input port register */
+#endif
+#ifdef ADC_SAMPLER
+	uint8_t adc; /* index into adc_channels */
+#endif
 };
 
 /* It is not possible to control D20-D23 using digitalWrite()
@@ -188,16 +222,12 @@ bool pin_type_output(struct pin *pin)
 	.pin = MY_CONTROLLINO_AI##_index,						\
 },
 
-#if 0
 /* values: 0 - 1023 */
 #define PIN_ANALOG_INPUT(_index) {							\
 	.type = PIN_TYPE_ANALOG_INPUT,							\
 	.index = _index,								\
 	.pin = MY_CONTROLLINO_AI##_index,						\
 },
-#else
-#define PIN_ANALOG_INPUT(_index)
-#endif
 
 /* values: 0, 1 */
 #define PIN_DIGITAL_INPUT_IN(_index) {							\
@@ -318,6 +348,134 @@ struct pin pins[] = {
 #define for_each_pin(pin, i)								\
 	for (i = 0, pin = &pins[i]; i < PINS_COUNT; pin = &pins[++i])
 
+#ifdef INPUT_PORT_SCAN
+#define INPUT_PORTS_MAX 11 /* PORTA to PORTL, there is no PORTI */
+
+struct input_port {
+	volatile uint8_t *reg;
+	uint8_t val;
+};
+
+struct input_port input_ports[INPUT_PORTS_MAX];
+uint8_t input_ports_count;
+
+void input_port_pin_init(struct pin *pin)
+{
+	volatile uint8_t *reg = portInputRegister(digitalPinToPort(pin->pin));
+	uint8_t i;
+
+	for (i = 0; i < input_ports_count; i++)
+		if (input_ports[i].reg == reg)
+			break;
+	if (i == input_ports_count)
+		input_ports[input_ports_count++].reg = reg;
+	pin->port = i;
+	pin->mask = digitalPinToBitMask(pin->pin);
+}
+
+void input_ports_read(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < input_ports_count; i++)
+		input_ports[i].val = *input_ports[i].reg;
+}
+
+uint8_t input_port_pin_read(struct pin *pin)
+{
+	return input_ports[pin->port].val & pin->mask ? HIGH : LOW;
+}
+#else
+static inline void input_port_pin_init(struct pin *pin) {}
+static inline void input_ports_read(void) {}
+
+static inline uint8_t input_port_pin_read(struct pin *pin)
+{
+	return digitalRead(pin->pin);
+}
+#endif
+
+#ifdef ADC_SAMPLER
+#define ADC_CHANNELS_MAX 16
+#define ADC_EMA_SHIFT 3 /* weight of a new sample is 1/8 */
+
+struct adc_channel {
+	uint8_t mux; /* MUX5:0 */
+	bool primed;
+	uint16_t acc; /* average << ADC_EMA_SHIFT */
+};
+
+volatile struct adc_channel adc_channels[ADC_CHANNELS_MAX];
+uint8_t adc_channels_count;
+volatile uint8_t adc_channel_cur;
+
+static void adc_mux_set(uint8_t mux)
+{
+	ADCSRB = (ADCSRB & ~_BV(MUX5)) | ((mux & 0x20) ? _BV(MUX5) : 0);
+	ADMUX = _BV(REFS0) | (mux & 0x1f); /* AVCC reference */
+}
+
+/* Single conversions with the next channel selected before each start,
+ * so no sample is taken from a channel that is being switched. */
+ISR(ADC_vect)
+{
+	volatile struct adc_channel *channel = &adc_channels[adc_channel_cur];
+	uint16_t sample = ADC;
+
+	if (channel->primed) {
+		channel->acc = channel->acc - (channel->acc >> ADC_EMA_SHIFT) +
+			       sample;
+	} else {
+		channel->acc = sample << ADC_EMA_SHIFT;
+		channel->primed = true;
+	}
+
+	if (++adc_channel_cur == adc_channels_count)
+		adc_channel_cur = 0;
+	adc_mux_set(adc_channels[adc_channel_cur].mux);
+	ADCSRA |= _BV(ADSC);
+}
+
+void adc_pin_init(struct pin *pin)
+{
+	uint8_t channel = pin->pin - A0;
+
+	if (adc_channels_count == ADC_CHANNELS_MAX)
+		return;
+	pin->adc = adc_channels_count;
+	/* Channels 8-15 are selected by MUX5 and MUX2:0. */
+	adc_channels[adc_channels_count++].mux = (channel & 0x08) << 2 |
+						 (channel & 0x07);
+}
+
+void adc_start(void)
+{
+	if (!adc_channels_count)
+		return;
+	adc_channel_cur = 0;
+	adc_mux_set(adc_channels[0].mux);
+	ADCSRA |= _BV(ADEN) | _BV(ADIE) | _BV(ADSC);
+}
+
+uint16_t adc_pin_read(struct pin *pin)
+{
+	uint16_t acc;
+
+	noInterrupts();
+	acc = adc_channels[pin->adc].acc;
+	interrupts();
+	return acc >> ADC_EMA_SHIFT;
+}
+#else
+static inline void adc_pin_init(struct pin *pin) {}
+static inline void adc_start(void) {}
+
+static inline uint16_t adc_pin_read(struct pin *pin)
+{
+	return analogRead(pin->pin);
+}
+#endif
+
 #define TMP_BUF_LEN 128
 char tmp_buf[TMP_BUF_LEN];
 
@@ -334,28 +492,337 @@ char *config_topic(const char *item)
 	return tmp_buf;
 }
 
+enum config_item {
+	CONFIG_ITEM_NAME,
+	CONFIG_ITEM_MAC,
+	CONFIG_ITEM_IP,
+	CONFIG_ITEM_MQTTIP,
+	CONFIG_ITEM_FILTER,
+	CONFIG_ITEM_THRESHOLD,
+	CONFIG_ITEM_TEMP_INTERVAL,
+	CONFIG_ITEM_EMERG_OFF_TIMEOUT,
+	CONFIG_ITEM_COUNT,
+	CONFIG_ITEM_NONE = CONFIG_ITEM_COUNT,
+};
+
+const char *config_item_subtopic[] = {
+	[CONFIG_ITEM_NAME] = "name",
+	[CONFIG_ITEM_MAC] = "mac",
+	[CONFIG_ITEM_IP] = "ip",
+	[CONFIG_ITEM_MQTTIP] = "mqttip",
+	[CONFIG_ITEM_FILTER] = "filter",
+	[CONFIG_ITEM_THRESHOLD] = "threshold",
+	[CONFIG_ITEM_TEMP_INTERVAL] = "temp_interval",
+	[CONFIG_ITEM_EMERG_OFF_TIMEOUT] = "emerg_off_timeout",
+};
+
+/* Inbound topics are dispatched without formatting any topic string.
+ * The "<name>/" prefix is stripped once, then the subtopic is matched
+ * against the small type/config tables and the pin index is looked up
+ * directly in pin_lookup[type][index].
+ */
+
+#define PIN_INDEX_MAX 24
+#define PIN_LOOKUP_NONE 0xff
+
+uint8_t pin_lookup[ARRAY_SIZE(pin_type_subtopic)][PIN_INDEX_MAX];
+
+char topic_prefix[NAME_SIZE + 1];
+uint8_t topic_prefix_len;
+
+void topics_init(void)
+{
+	struct pin *pin;
+	unsigned int i;
+
+	snprintf(topic_prefix, sizeof(topic_prefix), "%s/", name);
+	topic_prefix_len = strlen(topic_prefix);
+
+	memset(pin_lookup, PIN_LOOKUP_NONE, sizeof(pin_lookup));
+	for_each_pin(pin, i)
+		pin_lookup[pin->type][pin->index] = i;
+}
+
+const char *topic_strip_prefix(const char *topic)
+{
+	if (strncmp(topic, topic_prefix, topic_prefix_len))
+		return NULL;
+	return topic + topic_prefix_len;
+}
+
+/* Returns the rest of the topic after "<subtopic>/" or NULL. */
+const char *subtopic_match(const char *topic, const char *subtopic)
+{
+	size_t len = strlen(subtopic);
+
+	if (strncmp(topic, subtopic, len) || topic[len] != '/')
+		return NULL;
+	return topic + len + 1;
+}
+
+enum config_item config_item_lookup(const char *subtopic)
+{
+	const char *item;
+	uint8_t i;
+
+	item = subtopic_match(subtopic, "config");
+	if (!item)
+		return CONFIG_ITEM_NONE;
+	for (i = 0; i < CONFIG_ITEM_COUNT; i++)
+		if (!strcmp(item, config_item_subtopic[i]))
+			return (enum config_item) i;
+	return CONFIG_ITEM_NONE;
+}
+
+/* Looks up "<type>/<index><suffix>". */
+struct pin *pin_subtopic_lookup(const char *subtopic, const char *suffix)
+{
+	const char *index_str;
+	uint8_t type;
+	char *end;
+	long index;
+
+	for (type = 0; type < ARRAY_SIZE(pin_type_subtopic); type++) {
+		index_str = subtopic_match(subtopic, pin_type_subtopic[type]);
+		if (index_str)
+			break;
+	}
+	if (!index_str || !isdigit(index_str[0]) ||
+	    (index_str[0] == '0' && index_str[1]))
+		return NULL;
+	index = strtol(index_str, &end, 10);
+	if (strcmp(end, suffix) || index >= PIN_INDEX_MAX ||
+	    pin_lookup[type][index] == PIN_LOOKUP_NONE)
+		return NULL;
+	return &pins[pin_lookup[type][index]];
+}
+
+struct pin *pin_topic_lookup(const char *subtopic)
+{
+	return pin_subtopic_lookup(subtopic, "");
+}
+
+bool is_pin_debounced(struct pin *pin)
+{
+	return pin->type == PIN_TYPE_DIGITAL_INPUT ||
+	       pin->type == PIN_TYPE_DIGITAL_INPUT_IN;
+}
+
+/* "config/<type>/<index>/filter" */
+struct pin *pin_filter_config_lookup(const char *subtopic)
+{
+	const char *pin_subtopic;
+	struct pin *pin;
+
+	pin_subtopic = subtopic_match(subtopic, "config");
+	if (!pin_subtopic)
+		return NULL;
+	pin = pin_subtopic_lookup(pin_subtopic, "/filter");
+	if (!pin || !is_pin_debounced(pin))
+		return NULL;
+	return pin;
+}
+
+char *pin_filter_config_topic(struct pin *pin)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/config/%s/%d/filter", name,
+		 pin_type_subtopic[pin->type], pin->index);
+	return tmp_buf;
+}
+
+bool state_changed; /* since the last state snapshot */
+
 void pin_publish(struct pin *pin)
 {
 	char state_buf[16];
 
 	sprintf(state_buf, "%u", pin->state);
+	state_changed = true;
 	client.publish(pin_topic(pin), state_buf);
 }
 
+/* beginPublish() needs the payload length up front, this only counts. */
+class CountingPrint : public Print {
+public:
+	size_t len = 0;
+
+	size_t write(uint8_t c) { len++; return 1; }
+	using Print::write;
+};
+
+/* The client sends every write() on its own, with Ethernet that is a TCP
+ * segment each. This collects the payload and passes it on in chunks.
+ */
+class BufferedPrint : public Print {
+public:
+	BufferedPrint(Print &out) : out(out) {}
+
+	size_t write(uint8_t c)
+	{
+		buf[len++] = c;
+		if (len == sizeof(buf))
+			flush();
+		return 1;
+	}
+	using Print::write;
+
+	void flush(void)
+	{
+		if (len)
+			out.write(buf, len);
+		len = 0;
+	}
+
+private:
+	Print &out;
+	uint8_t buf[64];
+	size_t len = 0;
+};
+
+char *state_topic(void)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/state", name);
+	return tmp_buf;
+}
+
+/* {"<pin subtopic>":<state>,...} */
+void state_snapshot_print(Print &out)
+{
+	bool first = true;
+	struct pin *pin;
+	unsigned int i;
+
+	out.print('{');
+	for_each_pin(pin, i) {
+		if (!first)
+			out.print(',');
+		first = false;
+		out.print('"');
+		out.print(pin_type_subtopic[pin->type]);
+		out.print('/');
+		out.print(pin->index);
+		out.print("\":");
+		out.print(pin->state);
+	}
+	out.print('}');
+}
+
+void state_snapshot_publish(void)
+{
+	CountingPrint counter;
+	BufferedPrint out(client);
+
+	state_changed = false;
+	state_snapshot_print(counter);
+	if (!client.beginPublish(state_topic(), counter.len, true))
+		return;
+	state_snapshot_print(out);
+	out.flush();
+	client.endPublish();
+}
+
+/* Digital inputs are sampled and debounced from a 1 ms timer tick rather
+ * than by counting loop() passes, so the filter window does not depend on
+ * how busy loop() is. A new level has to hold for the pin's filter time
+ * before it becomes pin->debounced, loop() only picks that up. */
+uint8_t input_filter; /* default filter, ms */
+uint8_t debounce_pins[PINS_COUNT];
+uint8_t debounce_pins_count;
+
+void debounce_tick(uint8_t ms)
+{
+	struct pin *pin;
+	uint8_t level;
+	uint8_t i;
+
+	input_ports_read();
+	for (i = 0; i < debounce_pins_count; i++) {
+		pin = &pins[debounce_pins[i]];
+		level = input_port_pin_read(pin);
+		if (level == pin->debounced) {
+			pin->debounce_ms = 0;
+			continue;
+		}
+		pin->debounce_ms = min(pin->debounce_ms + ms, 0xff);
+		if (pin->debounce_ms < pin->filter)
+			continue;
+		pin->debounced = level;
+		pin->debounce_ms = 0;
+	}
+}
+
+#ifdef __AVR__
+/* Timer0 already runs for millis(). Its compare A interrupt fires once per
+ * 1.024 ms period whatever OCR0A is set to, so PWM output on the Timer0
+ * pins is not disturbed. Timer2 would only tick at 490 Hz in the
+ * phase-correct PWM mode the core sets up. */
+ISR(TIMER0_COMPA_vect)
+{
+	debounce_tick(1);
+}
+
+void debounce_timer_start(void)
+{
+	TIMSK0 |= _BV(OCIE0A);
+}
+
+static inline void debounce_poll(void) {}
+#else
+unsigned long debounce_last;
+
+void debounce_timer_start(void)
+{
+	debounce_last = millis();
+}
+
+/* No timer hooked up, run the elapsed time as one tick from loop(). */
+void debounce_poll(void)
+{
+	unsigned long now = millis();
+	unsigned long ms = now - debounce_last;
+
+	if (!ms)
+		return;
+	debounce_last = now;
+	debounce_tick(min(ms, 0xffUL));
+}
+#endif
+
+void debounce_pin_init(struct pin *pin, uint8_t pin_index, uint8_t filter)
+{
+	pin->filter = filter && filter != 0xff ? filter : input_filter;
+	debounce_pins[debounce_pins_count++] = pin_index;
+}
+
+void debounce_start(void)
+{
+	struct pin *pin;
+	uint8_t i;
+
+	input_ports_read();
+	for (i = 0; i < debounce_pins_count; i++) {
+		pin = &pins[debounce_pins[i]];
+		pin->debounced = input_port_pin_read(pin);
+		pin->debounce_ms = 0;
+	}
+	debounce_timer_start();
+}
+
 void input_pins_update_state()
 {
 	struct pin *pin;
 	word new_state;
 	unsigned int i;
 
+	debounce_poll();
 	for_each_pin(pin, i) {
 		switch (pin->type) {
 		case PIN_TYPE_DIGITAL_INPUT:
 		case PIN_TYPE_DIGITAL_INPUT_IN:
-			new_state = digitalRead(pin->pin);
+			new_state = pin->debounced;
 			break;
 		case PIN_TYPE_ANALOG_INPUT:
-			new_state = analogRead(pin->pin);
+			new_state = adc_pin_read(pin);
 			break;
 		default:
 			continue;
@@ -364,7 +831,6 @@ void input_pins_update_state()
 	}
 }
 
-uint8_t input_filter;
 uint8_t input_threshold;
 uint32_t temp_interval;
 uint32_t emerg_off_timeout;
@@ -379,17 +845,10 @@ void input_pins_publish(bool changed_only)
 		switch (pin->type) {
 		case PIN_TYPE_DIGITAL_INPUT:
 		case PIN_TYPE_DIGITAL_INPUT_IN:
-			if (changed_only) {
-				if (pin->old_state == pin->state) {
-					pin->new_state_cnt = 0;
-					continue;
-				}
-				if (pin->new_state_cnt++ < input_filter)
-					continue;
-			}
+			if (changed_only && pin->old_state == pin->state)
+				continue;
 			pin_publish(pin);
 			pin->old_state = pin->state;
-			pin->new_state_cnt = 0;
 			break;
 		case PIN_TYPE_ANALOG_INPUT:
 			delta = abs((int) pin->old_state - (int) pin->state);
@@ -397,7 +856,6 @@ void input_pins_publish(bool changed_only)
 				continue;
 			pin_publish(pin);
 			pin->old_state = pin->state;
-			pin->new_state_cnt = 0;
 			break;
 		default:
 			continue;
@@ -418,6 +876,7 @@ void pin_state_set(struct pin *pin)
 void output_pin_update_state(struct pin *pin, word new_state)
 {
 	pin->state = new_state;
+	state_changed = true;
 	switch (pin->type) {
 	case PIN_TYPE_RELAY: /* fall-through */
 	case PIN_TYPE_DIGITAL_OUTPUT:
@@ -445,6 +904,7 @@ void pins_emerg_off_timeout_check(unsigned long now, uint32_t timeout)
 			if (pin->state == NEW_STATE_EMERG_OFF_MAGIC &&
 			    pin->on_millis + timeout < now) {
 				pin->state = 0;
+				state_changed = true;
 				pin_state_set(pin);
 			}
 			break;
@@ -454,15 +914,13 @@ void pins_emerg_off_timeout_check(unsigned long now, uint32_t timeout)
 	}
 }
 
-void pins_msg_process(const char *topic, const char *value)
+void pins_msg_process(const char *subtopic, const char *value)
 {
 	struct pin *pin;
-	unsigned int i;
 
-	for_each_pin(pin, i) {
-		if (pin_type_output(pin) && !strcmp(topic, pin_topic(pin)))
-			output_pin_update_state(pin, strtol(value, NULL, 10));
-	}
+	pin = pin_topic_lookup(subtopic);
+	if (pin && pin_type_output(pin))
+		output_pin_update_state(pin, strtol(value, NULL, 10));
 }
 
 void pins_subscribe(void)
@@ -476,17 +934,44 @@ void pins_subscribe(void)
 	}
 }
 
+void config_subscribe(void)
+{
+	struct pin *pin;
+	unsigned int i;
+
+	for (i = 0; i < CONFIG_ITEM_COUNT; i++)
+		client.subscribe(config_topic(config_item_subtopic[i]));
+	for_each_pin(pin, i)
+		if (is_pin_debounced(pin))
+			client.subscribe(pin_filter_config_topic(pin));
+}
+
+struct pin_filters {
+	uint8_t pin_filters[PINS_COUNT]; /* ms, 0 or 0xff means config/filter */
+};
+
+struct pin_filters pin_filters;
+
 void pins_init(void)
 {
 	struct pin *pin;
 	unsigned int i;
 
+	debounce_pins_count = 0;
 	for_each_pin(pin, i) {
 		if (is_port_pin(pin->pin))
 			port_pinModeOutput(pin->pin);
 		else
 			pinMode(pin->pin, pin_type_output(pin) ? OUTPUT : INPUT);
+		if (is_pin_debounced(pin)) {
+			input_port_pin_init(pin);
+			debounce_pin_init(pin, i, pin_filters.pin_filters[i]);
+		} else if (pin->type == PIN_TYPE_ANALOG_INPUT) {
+			adc_pin_init(pin);
+		}
 	}
+	adc_start();
+	debounce_start();
 }
 
 char *temp_serial_topic(char *device_address)
@@ -575,7 +1060,8 @@ uint8_t eeprom_default_filter = 16;
 uint8_t eeprom_default_threshold = 16;
 uint32_t eeprom_default_temp_interval = 60000;
 uint32_t eeprom_default_emerg_off_timeout = 30000;
-#define EEPROM_FILTER_MAX 32
+static struct pin_filters eeprom_default_pin_filters; /* all zeroes means config/filter for all */
+#define EEPROM_FILTER_MAX 256 /* ms */
 #define EEPROM_THRESHOLD_MAX 128
 
 #define EEPROM_MAGIC_OFFSET 0
@@ -608,6 +1094,9 @@ uint32_t eeprom_default_emerg_off_timeout = 30000;
 #define EEPROM_EMERG_OFF_TIMEOUT_OFFSET EEPROM_TEMP_INTERVAL_OFFSET + EEPROM_TEMP_INTERVAL_SIZE
 #define EEPROM_EMERG_OFF_TIMEOUT_SIZE sizeof(eeprom_default_emerg_off_timeout)
 
+#define EEPROM_PIN_FILTERS_OFFSET EEPROM_EMERG_OFF_TIMEOUT_OFFSET + EEPROM_EMERG_OFF_TIMEOUT_SIZE
+#define EEPROM_PIN_FILTERS_SIZE sizeof(struct pin_filters)
+
 void eeprom_check(void)
 {
 	uint32_t magic;
@@ -626,6 +1115,7 @@ void eeprom_check(void)
 	EEPROM.put(EEPROM_THRESHOLD_OFFSET, eeprom_default_threshold);
 	EEPROM.put(EEPROM_TEMP_INTERVAL_OFFSET, eeprom_default_temp_interval);
 	EEPROM.put(EEPROM_EMERG_OFF_TIMEOUT_OFFSET, eeprom_default_emerg_off_timeout);
+	EEPROM.put(EEPROM_PIN_FILTERS_OFFSET, eeprom_default_pin_filters);
 }
 
 void payload_mac_to_eeprom(int offset, int size, byte *payload, int length)
@@ -634,7 +1124,7 @@ void payload_mac_to_eeprom(int offset, int size, byte *payload, int length)
 	uint8_t i;
 
 	for (i = 0; i < 6; i++) {
-		EEPROM.write(offset + i, strtol(pos, &pos, 16));
+		EEPROM.update(offset + i, strtol(pos, &pos, 16));
 		pos++;
 		if (pos >= (char *) payload + length)
 			return;
@@ -648,55 +1138,194 @@ void str_to_eeprom(int offset, int size, byte *payload, int length)
 
 	for (i = 0; i < size; i++) {
 		if (i + 1 == size || i >= length)
-			EEPROM.write(offset + i, 0);
+			EEPROM.update(offset + i, 0);
 		else
-			EEPROM.write(offset + i, *pos++);
+			EEPROM.update(offset + i, *pos++);
 	}
 }
 
+bool check_pin_filter_to_eeprom(const char *subtopic, byte *payload)
+{
+	struct pin *pin;
+	uint32_t filter;
+
+	pin = pin_filter_config_lookup(subtopic);
+	if (!pin)
+		return false;
+	filter = strtol((const char *) payload, NULL, 10);
+	if (filter < 0xff) {
+		pin_filters.pin_filters[pin - pins] = filter;
+		EEPROM.put(EEPROM_PIN_FILTERS_OFFSET, pin_filters);
+	}
+	return true;
+}
+
 void callback(char *topic, byte *payload, unsigned int length)
 {
+	const char *subtopic;
+
 	payload[length] = '\0';
 
-	if (!strcmp(topic, config_topic("name"))) {
+	subtopic = topic_strip_prefix(topic);
+	if (!subtopic)
+		return;
+
+	switch (config_item_lookup(subtopic)) {
+	case CONFIG_ITEM_NAME:
 		str_to_eeprom(EEPROM_NAME_OFFSET, EEPROM_NAME_SIZE,
 			      payload, length);
-	} else if (!strcmp(topic, config_topic("mac"))) {
+		break;
+	case CONFIG_ITEM_MAC:
 		payload_mac_to_eeprom(EEPROM_MAC_OFFSET, EEPROM_MAC_SIZE,
 				      payload, length);
-	} else if (!strcmp(topic, config_topic("ip"))) {
+		break;
+	case CONFIG_ITEM_IP: {
 		IPAddress ip;
 
 		if (ip.fromString((const char *) payload))
 			EEPROM.put(EEPROM_IP_OFFSET, ip);
-	} else if (!strcmp(topic, config_topic("mqttip"))) {
+		break;
+	}
+	case CONFIG_ITEM_MQTTIP: {
 		IPAddress mqttip;
 
 		if (mqttip.fromString((const char *) payload))
 			EEPROM.put(EEPROM_MQTTIP_OFFSET, mqttip);
-	} else if (!strcmp(topic, config_topic("filter"))) {
+		break;
+	}
+	case CONFIG_ITEM_FILTER: {
 		uint32_t filter = strtol((const char *) payload, NULL, 10);
 
 		if (filter < EEPROM_FILTER_MAX)
 			EEPROM.put(EEPROM_FILTER_OFFSET, (uint8_t) filter);
-	} else if (!strcmp(topic, config_topic("threshold"))) {
+		break;
+	}
+	case CONFIG_ITEM_THRESHOLD: {
 		uint32_t threshold = strtol((const char *) payload, NULL, 10);
 
 		if (threshold < EEPROM_THRESHOLD_MAX)
 			EEPROM.put(EEPROM_THRESHOLD_OFFSET, (uint8_t) threshold);
-	} else if (!strcmp(topic, config_topic("temp_interval"))) {
+		break;
+	}
+	case CONFIG_ITEM_TEMP_INTERVAL: {
 		uint32_t temp_interval = strtol((const char *) payload, NULL, 10);
 
 		EEPROM.put(EEPROM_TEMP_INTERVAL_OFFSET, temp_interval);
-	} else if (!strcmp(topic, config_topic("emerg_off_timeout"))) {
+		break;
+	}
+	case CONFIG_ITEM_EMERG_OFF_TIMEOUT: {
 		uint32_t emerg_off_timeout = strtol((const char *) payload, NULL, 10);
 
 		EEPROM.put(EEPROM_EMERG_OFF_TIMEOUT_OFFSET, emerg_off_timeout);
-	} else {
-		pins_msg_process(topic, (const char *) payload);
+		break;
+	}
+	default:
+		if (!check_pin_filter_to_eeprom(subtopic, payload))
+			pins_msg_process(subtopic, (const char *) payload);
+		break;
 	}
 }
 
+/* The MQTT connection is driven from loop() one step per pass, TCP connect
+ * first, MQTT CONNECT/CONNACK in the next pass, each bounded by a short
+ * timeout, so local I/O keeps running while the broker is away. Failed
+ * attempts are retried with jittered exponential backoff. */
+#define MQTT_PORT 1883
+#define MQTT_TCP_TIMEOUT 500 /* ms */
+#define MQTT_SOCKET_TIMEOUT 1 /* s, CONNACK wait */
+#define MQTT_RETRY_TIMEOUT_MIN 1000
+#define MQTT_RETRY_TIMEOUT_MAX 60000
+
+enum mqtt_state {
+	MQTT_STATE_TCP_CONNECT,
+	MQTT_STATE_MQTT_CONNECT,
+	MQTT_STATE_CONNECTED,
+	MQTT_STATE_BACKOFF,
+};
+
+static enum mqtt_state mqtt_state;
+static IPAddress mqtt_server;
+static unsigned long mqtt_retry_timeout = MQTT_RETRY_TIMEOUT_MIN;
+static unsigned long mqtt_backoff_timeout;
+static unsigned long mqtt_last_attempt;
+
+void mqtt_backoff(unsigned long now)
+{
+	/* Jitter spreads out reconnects of devices that lost the broker
+	 * at the same time. */
+	mqtt_backoff_timeout = mqtt_retry_timeout +
+			       random(mqtt_retry_timeout / 2);
+	mqtt_retry_timeout = min(mqtt_retry_timeout * 2,
+				 (unsigned long) MQTT_RETRY_TIMEOUT_MAX);
+	mqtt_last_attempt = now;
+	mqtt_state = MQTT_STATE_BACKOFF;
+}
+
+#ifdef MQTT_WILDCARD_SUBSCRIBE
+char *pin_type_wildcard_topic(enum pin_type type)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/%s/#", name, pin_type_subtopic[type]);
+	return tmp_buf;
+}
+
+void wildcard_subscribe(void)
+{
+	client.subscribe(config_topic("#"));
+	client.subscribe(pin_type_wildcard_topic(PIN_TYPE_RELAY));
+	client.subscribe(pin_type_wildcard_topic(PIN_TYPE_DIGITAL_OUTPUT));
+	client.subscribe(pin_type_wildcard_topic(PIN_TYPE_PWM_OUTPUT));
+}
+#endif
+
+void mqtt_connected_setup(void)
+{
+	input_pins_update_state();
+	input_pins_publish(false);
+	state_snapshot_publish();
+#ifdef MQTT_WILDCARD_SUBSCRIBE
+	wildcard_subscribe();
+#else
+	config_subscribe();
+	pins_subscribe();
+#endif
+}
+
+bool mqtt_process(unsigned long now)
+{
+	switch (mqtt_state) {
+	case MQTT_STATE_TCP_CONNECT:
+		if (ethClient.connect(mqtt_server, MQTT_PORT))
+			mqtt_state = MQTT_STATE_MQTT_CONNECT;
+		else
+			mqtt_backoff(now);
+		break;
+	case MQTT_STATE_MQTT_CONNECT:
+		/* TCP is up already, so this only does CONNECT/CONNACK. */
+		if (!client.connect(name)) {
+			ethClient.stop();
+			mqtt_backoff(now);
+			break;
+		}
+		Serial.println("CONNECTED");
+		mqtt_retry_timeout = MQTT_RETRY_TIMEOUT_MIN;
+		mqtt_state = MQTT_STATE_CONNECTED;
+		mqtt_connected_setup();
+		break;
+	case MQTT_STATE_CONNECTED:
+		if (client.connected())
+			return true;
+		Serial.println("DISCONNECTED");
+		ethClient.stop();
+		mqtt_state = MQTT_STATE_TCP_CONNECT;
+		break;
+	case MQTT_STATE_BACKOFF:
+		if (now - mqtt_last_attempt >= mqtt_backoff_timeout)
+			mqtt_state = MQTT_STATE_TCP_CONNECT;
+		break;
+	}
+	return false;
+}
+
 void setup(void)
 {
 	byte mac[MAC_LEN];
@@ -714,10 +1343,12 @@ void setup(void)
 	EEPROM.get(EEPROM_NAME_OFFSET, name);
 	Serial.print("NAME:");
 	Serial.println(name);
+	topics_init();
 
 	EEPROM.get(EEPROM_MAC_OFFSET, mac);
 	mac[0] &= 0xfe; /* Clear multicast bit. */
 	mac[0] |= 0x02; /* Set local assignment bit. */
+	randomSeed(mac[3] << 16 | mac[4] << 8 | mac[5]);
 
 	sprintf(macstr, "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 	Serial.print("MAC:");
@@ -747,52 +1378,29 @@ void setup(void)
 	Serial.print("EMERG_OFF_TIMEOUT:");
 	Serial.println(emerg_off_timeout);
 
+	EEPROM.get(EEPROM_PIN_FILTERS_OFFSET, pin_filters);
+
 	Ethernet.begin(mac, ip);
 	pins_init();
 
-	client.setServer(mqttip, 1883);
+	client.setServer(mqttip, MQTT_PORT);
+	client.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+	mqtt_server = mqttip;
+	ethClient.setConnectionTimeout(MQTT_TCP_TIMEOUT);
 	client.setCallback(callback);
 }
 
-#define MQTT_RETRY_TIMEOUT 5000
-
-static bool mqtt_connected;
-static unsigned long mqtt_last_attempt;
-
 void loop(void)
 {
 	unsigned long now = millis();
 
-	if (!client.connected()) {
-		if (mqtt_connected) {
-			mqtt_last_attempt = 0;
-			Serial.println("DISCONNECTED");
-			mqtt_connected = false;
-		}
-		if (!mqtt_last_attempt ||
-		    mqtt_last_attempt + MQTT_RETRY_TIMEOUT < now ||
-		    mqtt_last_attempt > now) {
-			mqtt_last_attempt = now;
-
-			if (client.connect(name)) {
-				Serial.println("CONNECTED");
-				mqtt_connected = true;
-				input_pins_update_state();
-				input_pins_publish(false);
-				client.subscribe(config_topic("name"));
-				client.subscribe(config_topic("mac"));
-				client.subscribe(config_topic("ip"));
-				client.subscribe(config_topic("mqttip"));
-				client.subscribe(config_topic("filter"));
-				client.subscribe(config_topic("threshold"));
-				client.subscribe(config_topic("temp_interval"));
-				client.subscribe(config_topic("emerg_off_timeout"));
-				pins_subscribe();
-			}
-		}
-	} else {
+	if (mqtt_process(now)) {
 		input_pins_update_state();
 		input_pins_publish(true);
+#ifdef STATE_SNAPSHOT_ON_CHANGE
+		if (state_changed)
+			state_snapshot_publish();
+#endif
 		client.loop();
 		temp_serial_process(now);
 	}
@@ -22,10 +22,21 @@
 #include <DallasTemperature.h>
 #include <EEPROM.h>
 #include <FastLED.h>
-#include <ModbusSerial.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Start the temperature conversion on all devices of all buses at once
+ * with a skip ROM Convert T, wait one conversion time and then read the
+ * scratchpads one by one. Comment out to convert device by device, which
+ * takes up to a conversion time per device.
+ */
+#define OW_TEMP_PARALLEL_CONVERSION
+
+/* Keep the ROM list found by the last bus search in EEPROM too, so after
+ * a reboot the readings start right away, without a search first.
+ */
+//#define OW_TEMP_ROM_CACHE_EEPROM
+
 enum pin_type {
 	PIN_TYPE_G,
 };
@@ -37,6 +48,9 @@ struct pin {
 	uint8_t pin; /* pin number */
 	uint8_t index; /* filled-up during init */
 	bool printed;
+	bool converting; /* Convert T issued, not yet complete */
+	uint8_t resolution; /* bits, for all devices on the bus */
+	bool resolution_changed; /* not yet written to the devices */
 	struct {
 		OneWire *oneWire;
 		DallasTemperature *sensors;
@@ -91,10 +105,25 @@ static void ow_temp_pin_init(struct pin *pin)
 	
 #define OW_TEMP_INVALID DEVICE_DISCONNECTED_C
 
+#define OW_TEMP_RESOLUTION_MIN 9
+#define OW_TEMP_RESOLUTION_MAX 12
+#define OW_TEMP_RESOLUTION_DEFAULT 12
+
+/* DS18B20 needs 750 ms at 12 bits, half of it for each bit less. Don't
+ * bother the bus before that, give up a while after.
+ */
+#define OW_TEMP_CONVERSION_TIME(resolution) (750 >> (12 - (resolution)))
+#define OW_TEMP_CONVERSION_MARGIN 200
+#define OW_TEMP_CONVERSION_TIMEOUT(resolution)				\
+	(OW_TEMP_CONVERSION_TIME(resolution) + OW_TEMP_CONVERSION_MARGIN)
+
 struct ow_temp_device {
 	DeviceAddress address;
 	struct pin *pin;
 	float value;
+	unsigned long read_millis; /* last successful read */
+	bool seen; /* found by the current search */
+	uint8_t slot; /* in the Modbus device region */
 };
 
 static float ow_temp_pin_value(struct pin *pin)
@@ -103,12 +132,30 @@ static float ow_temp_pin_value(struct pin *pin)
 }
 
 #define OW_TEMP_DEVICE_MAX 16
+#define OW_TEMP_RESCAN_INTERVAL 600000 /* ms */
+
+/* Every device gets a slot in the Modbus device region. A slot can be
+ * pinned to a ROM, then it is kept for that device even while it is
+ * missing. Other devices keep their slot as long as they are found, new
+ * ones take the first free slot which is not pinned.
+ */
+#define OW_TEMP_SLOT_COUNT OW_TEMP_DEVICE_MAX
+#define OW_TEMP_SLOT_NONE 0xff
 
+DeviceAddress ow_temp_slot_rom[OW_TEMP_SLOT_COUNT]; /* pinned ROMs */
+
+/* The device list is kept across read cycles. The buses are searched again
+ * only when the list is not known yet, once per OW_TEMP_RESCAN_INTERVAL
+ * and on the next cycle after some device failed to read.
+ */
 struct ow_temp {
+	bool search_needed;
+	unsigned long last_search_millis;
 	bool read_in_progress;
 	unsigned long last_read_millis;
 	bool waiting_on_conversion;
 	unsigned long start_conversion_millis;
+	bool conversion_done;
 	int current_device;
 	uint8_t device_count;
 	struct ow_temp_device device[OW_TEMP_DEVICE_MAX];
@@ -121,42 +168,195 @@ ow_temp_device_get(struct ow_temp *temp, uint8_t index)
 }
 
 void mb_pin_update(struct pin *pin);
+static void mb_device_update(struct ow_temp_device *temp_device);
+static void mb_devices_update(struct ow_temp *temp);
 
-static void ow_temp_scan(struct ow_temp *temp, unsigned int interval)
+static void ow_temp_pins_link(struct ow_temp *temp)
 {
 	struct ow_temp_device *temp_device;
-	unsigned long now = millis();
-	DeviceAddress address;
 	struct pin *pin;
 	uint8_t i;
 
-	if (temp->last_read_millis &&
-	    (now - temp->last_read_millis < interval))
-		return;
+	for_each_pin(pin, i)
+		pin->temp_device = NULL;
+	for (i = 0; i < temp->device_count; i++) {
+		temp_device = ow_temp_device_get(temp, i);
+		temp_device->pin->temp_device = temp_device; /* the last one */
+	}
+	for_each_pin(pin, i) {
+		if (!pin->temp_device) {
+			pin->printed = false;
+			mb_pin_update(pin);
+		}
+	}
+}
+
+static struct ow_temp_device *
+ow_temp_device_find(struct ow_temp *temp, const DeviceAddress address)
+{
+	struct ow_temp_device *temp_device;
+	uint8_t i;
+
+	for (i = 0; i < temp->device_count; i++) {
+		temp_device = ow_temp_device_get(temp, i);
+		if (!memcmp(temp_device->address, address, sizeof(DeviceAddress)))
+			return temp_device;
+	}
+	return NULL;
+}
+
+static bool ow_temp_slot_rom_valid(const DeviceAddress address)
+{
+	return OneWire::crc8(address, 7) == address[7] && address[0];
+}
+
+static uint8_t ow_temp_slot_pinned(const DeviceAddress address)
+{
+	uint8_t slot;
+
+	for (slot = 0; slot < OW_TEMP_SLOT_COUNT; slot++)
+		if (ow_temp_slot_rom_valid(ow_temp_slot_rom[slot]) &&
+		    !memcmp(ow_temp_slot_rom[slot], address, sizeof(DeviceAddress)))
+			return slot;
+	return OW_TEMP_SLOT_NONE;
+}
+
+static void ow_temp_slots_assign(struct ow_temp *temp)
+{
+	uint8_t slots[OW_TEMP_DEVICE_MAX];
+	struct ow_temp_device *temp_device;
+	uint32_t used = 0;
+	uint8_t slot;
+	uint8_t i;
+
+	for (slot = 0; slot < OW_TEMP_SLOT_COUNT; slot++)
+		if (ow_temp_slot_rom_valid(ow_temp_slot_rom[slot]))
+			used |= 1UL << slot;
+
+	for (i = 0; i < temp->device_count; i++)
+		slots[i] = ow_temp_slot_pinned(temp->device[i].address);
+
+	for (i = 0; i < temp->device_count; i++) {
+		slot = temp->device[i].slot;
+		if (slots[i] != OW_TEMP_SLOT_NONE || slot == OW_TEMP_SLOT_NONE ||
+		    used & (1UL << slot))
+			continue;
+		slots[i] = slot;
+		used |= 1UL << slot;
+	}
+
+	for (i = 0; i < temp->device_count; i++) {
+		temp_device = ow_temp_device_get(temp, i);
+		temp_device->slot = slots[i];
+		if (slots[i] != OW_TEMP_SLOT_NONE)
+			continue;
+		for (slot = 0; slot < OW_TEMP_SLOT_COUNT; slot++) {
+			if (used & (1UL << slot))
+				continue;
+			temp_device->slot = slot;
+			used |= 1UL << slot;
+			break;
+		}
+	}
+	mb_devices_update(temp);
+}
+
+static void ow_temp_roms_store(struct ow_temp *temp);
+
+/* Devices found again keep their last value, new ones are appended and
+ * the ones which did not answer are dropped.
+ */
+static void ow_temp_search(struct ow_temp *temp)
+{
+	struct ow_temp_device *temp_device;
+	DeviceAddress address;
+	struct pin *pin;
+	uint8_t i, j;
+
+	for (i = 0; i < temp->device_count; i++)
+		ow_temp_device_get(temp, i)->seen = false;
 
-	memset(temp, 0, sizeof(*temp));
-	temp->last_read_millis = now;
-	
 	for_each_pin(pin, i) {
-		temp_device = NULL;
 		pin->oneWire->reset_search();
 		while (pin->oneWire->search(address)) {
-			if (OneWire::crc8(address, 7) != address[7] ||
-			    temp->device_count == OW_TEMP_DEVICE_MAX)
+			if (OneWire::crc8(address, 7) != address[7])
 				continue;
-			temp_device = ow_temp_device_get(temp,
-							 temp->device_count++);
-			memcpy(temp_device->address, address, sizeof(address));
+			temp_device = ow_temp_device_find(temp, address);
+			if (!temp_device) {
+				if (temp->device_count == OW_TEMP_DEVICE_MAX)
+					continue;
+				temp_device = ow_temp_device_get(temp,
+								 temp->device_count++);
+				memcpy(temp_device->address, address, sizeof(address));
+				temp_device->value = OW_TEMP_INVALID;
+				temp_device->slot = OW_TEMP_SLOT_NONE;
+			}
 			temp_device->pin = pin;
+			temp_device->seen = true;
 		}
-		pin->temp_device = temp_device; /* save the last one if any */
-		if (!pin->temp_device) {
-			pin->printed = false;
-			mb_pin_update(pin);
-		}
 	}
+
+	for (i = 0, j = 0; i < temp->device_count; i++) {
+		if (!temp->device[i].seen)
+			continue;
+		if (i != j)
+			temp->device[j] = temp->device[i];
+		j++;
+	}
+	temp->device_count = j;
+	ow_temp_pins_link(temp);
+	ow_temp_slots_assign(temp);
+
+	/* Newly found devices may run at a different resolution. */
+	for_each_pin(pin, i)
+		pin->resolution_changed = true;
+
+	temp->search_needed = false;
+	temp->last_search_millis = millis();
+	ow_temp_roms_store(temp);
+}
+
+/* Only between cycles, not while a conversion may be running. The library
+ * writes the configuration only to devices where it differs.
+ */
+static void ow_temp_resolution_apply(struct ow_temp *temp)
+{
+	struct ow_temp_device *temp_device;
+	struct pin *pin;
+	uint8_t i;
+
+	for (i = 0; i < temp->device_count; i++) {
+		temp_device = ow_temp_device_get(temp, i);
+		pin = temp_device->pin;
+		if (pin->resolution_changed)
+			pin->sensors->setResolution(temp_device->address,
+						    pin->resolution, true);
+	}
+	for_each_pin(pin, i)
+		pin->resolution_changed = false;
+}
+
+static void ow_temp_scan(struct ow_temp *temp, unsigned int interval)
+{
+	unsigned long now = millis();
+
+	if (temp->last_read_millis &&
+	    (now - temp->last_read_millis < interval))
+		return;
+
+	temp->last_read_millis = now;
+	if (temp->search_needed ||
+	    now - temp->last_search_millis > OW_TEMP_RESCAN_INTERVAL)
+		ow_temp_search(temp);
+	ow_temp_resolution_apply(temp);
+
+	temp->current_device = 0;
+	temp->waiting_on_conversion = false;
+	temp->conversion_done = false;
 	if (temp->device_count)
 		temp->read_in_progress = true;
+	else
+		temp->search_needed = true;
 }
 
 static bool ow_temp_device_next(struct ow_temp *temp)
@@ -172,6 +372,74 @@ static bool ow_temp_device_next(struct ow_temp *temp)
 	return true;
 }
 
+static void ow_temp_device_read(struct ow_temp *temp,
+				struct ow_temp_device *temp_device)
+{
+	struct pin *pin = temp_device->pin;
+
+	temp_device->value = pin->sensors->getTempC(temp_device->address);
+	if (temp_device->value == OW_TEMP_INVALID)
+		temp->search_needed = true;
+	else
+		temp_device->read_millis = millis();
+	pin->printed = false;
+	mb_pin_update(pin);
+	mb_device_update(temp_device);
+}
+
+#ifdef OW_TEMP_PARALLEL_CONVERSION
+static void ow_temp_conversion_start(struct ow_temp *temp)
+{
+	struct pin *pin;
+	uint8_t i;
+
+	for_each_pin(pin, i) {
+		pin->converting = !!pin->temp_device;
+		if (pin->converting)
+			pin->sensors->requestTemperatures();
+	}
+	temp->waiting_on_conversion = true;
+	temp->start_conversion_millis = millis();
+}
+
+static void ow_temp_conversion_wait_check(struct ow_temp *temp)
+{
+	unsigned long elapsed = millis() - temp->start_conversion_millis;
+	bool waiting = false;
+	struct pin *pin;
+	uint8_t i;
+
+	for_each_pin(pin, i) {
+		if (!pin->converting)
+			continue;
+		if (elapsed < OW_TEMP_CONVERSION_TIME(pin->resolution))
+			waiting = true;
+		else if (pin->sensors->isConversionComplete())
+			pin->converting = false;
+		else if (elapsed <= OW_TEMP_CONVERSION_TIMEOUT(pin->resolution))
+			waiting = true;
+		else
+			temp->search_needed = true;
+	}
+	if (waiting)
+		return;
+	temp->waiting_on_conversion = false;
+	temp->conversion_done = true;
+}
+
+/* One scratchpad per call to keep loop() going for mb_task(). Devices on
+ * a bus which did not finish the conversion in time are skipped.
+ */
+static void ow_temp_device_read_next(struct ow_temp *temp)
+{
+	struct ow_temp_device *temp_device;
+
+	temp_device = ow_temp_device_get(temp, temp->current_device);
+	if (!temp_device->pin->converting)
+		ow_temp_device_read(temp, temp_device);
+	ow_temp_device_next(temp);
+}
+#else
 static void ow_temp_conversion_start(struct ow_temp *temp)
 {
 	struct ow_temp_device *temp_device;
@@ -181,6 +449,7 @@ next_device:
 	temp_device = ow_temp_device_get(temp, temp->current_device);
 	pin = temp_device->pin;
 	if (!pin->sensors->requestTemperaturesByAddress(temp_device->address)) {
+		temp->search_needed = true;
 		if (!ow_temp_device_next(temp))
 			return;
 		goto next_device;
@@ -189,36 +458,40 @@ next_device:
 	temp->start_conversion_millis = millis();;
 }
 
-#define OW_TEMP_CONVERSION_TIMEOUT 950
-
 static void ow_temp_conversion_wait_check(struct ow_temp *temp)
 {
+	unsigned long elapsed = millis() - temp->start_conversion_millis;
 	struct ow_temp_device *temp_device;
-	unsigned long now = millis();
-	float temp_value;
 	struct pin *pin;
 
 	temp_device = ow_temp_device_get(temp, temp->current_device);
 	pin = temp_device->pin;
+	if (elapsed < OW_TEMP_CONVERSION_TIME(pin->resolution))
+		return;
 	if (!pin->sensors->isConversionComplete()) {
-		if (now - temp->start_conversion_millis > OW_TEMP_CONVERSION_TIMEOUT)
+		if (elapsed > OW_TEMP_CONVERSION_TIMEOUT(pin->resolution)) {
+			temp->search_needed = true;
 			goto next;
+		}
 		return;
 	}
 
-	temp_device->value = pin->sensors->getTempC(temp_device->address);
-	temp_device->pin->printed = false;
-	mb_pin_update(pin);
+	ow_temp_device_read(temp, temp_device);
 
 next:
 	temp->waiting_on_conversion = false;
 	ow_temp_device_next(temp);
 }
+#endif
 
 static void ow_temp_process(struct ow_temp *temp, unsigned int interval)
 {
 	if (!temp->read_in_progress)
 		ow_temp_scan(temp, interval);
+#ifdef OW_TEMP_PARALLEL_CONVERSION
+	else if (temp->conversion_done)
+		ow_temp_device_read_next(temp);
+#endif
 	else {
 		if (!temp->waiting_on_conversion)
 			ow_temp_conversion_start(temp);
@@ -308,6 +581,7 @@ static struct ow_temp ow_temp;
 uint32_t eeprom_magic = 0x7a3b1fac;
 uint8_t eeprom_default_mb_address = 8;
 uint32_t eeprom_default_temp_interval = 1000;
+uint16_t eeprom_default_mb_serial_config = 0x0003; /* 9600 8N1 */
 
 #define EEPROM_MAGIC_OFFSET 0
 #define EEPROM_MAGIC_SIZE sizeof(eeprom_magic)
@@ -318,13 +592,52 @@ uint32_t eeprom_default_temp_interval = 1000;
 #define EEPROM_TEMP_INTERVAL_OFFSET EEPROM_MB_ADDRESS_OFFSET + EEPROM_MB_ADDRESS_SIZE
 #define EEPROM_TEMP_INTERVAL_SIZE sizeof(eeprom_default_temp_interval)
 
-#define EEPROM_SIZE EEPROM_TEMP_INTERVAL_OFFSET + EEPROM_TEMP_INTERVAL_SIZE
+struct ow_temp_rom {
+	DeviceAddress address;
+	uint8_t pin_index;
+};
+
+#define EEPROM_OW_TEMP_ROM_COUNT_OFFSET EEPROM_TEMP_INTERVAL_OFFSET + EEPROM_TEMP_INTERVAL_SIZE
+#define EEPROM_OW_TEMP_ROM_COUNT_SIZE sizeof(uint8_t)
+
+#define EEPROM_OW_TEMP_ROMS_OFFSET EEPROM_OW_TEMP_ROM_COUNT_OFFSET + EEPROM_OW_TEMP_ROM_COUNT_SIZE
+#define EEPROM_OW_TEMP_ROMS_SIZE (sizeof(struct ow_temp_rom) * OW_TEMP_DEVICE_MAX)
+#define EEPROM_OW_TEMP_ROM_OFFSET(index) \
+	(EEPROM_OW_TEMP_ROMS_OFFSET + sizeof(struct ow_temp_rom) * (index))
+
+#define EEPROM_OW_TEMP_RESOLUTIONS_OFFSET EEPROM_OW_TEMP_ROMS_OFFSET + EEPROM_OW_TEMP_ROMS_SIZE
+#define EEPROM_OW_TEMP_RESOLUTIONS_SIZE (sizeof(uint8_t) * PINS_COUNT)
+#define EEPROM_OW_TEMP_RESOLUTION_OFFSET(index) \
+	(EEPROM_OW_TEMP_RESOLUTIONS_OFFSET + sizeof(uint8_t) * (index))
+
+#define EEPROM_OW_TEMP_SLOT_ROMS_OFFSET EEPROM_OW_TEMP_RESOLUTIONS_OFFSET + EEPROM_OW_TEMP_RESOLUTIONS_SIZE
+#define EEPROM_OW_TEMP_SLOT_ROMS_SIZE sizeof(ow_temp_slot_rom)
+
+#define EEPROM_MB_SERIAL_CONFIG_OFFSET EEPROM_OW_TEMP_SLOT_ROMS_OFFSET + EEPROM_OW_TEMP_SLOT_ROMS_SIZE
+#define EEPROM_MB_SERIAL_CONFIG_SIZE sizeof(eeprom_default_mb_serial_config)
+/* EEPROM grown from older versions reads as zeroes, which is a valid
+ * configuration, so the stored value is marked.
+ */
+#define EEPROM_MB_SERIAL_CONFIG_STORED 0x8000
+
+#define EEPROM_SIZE EEPROM_MB_SERIAL_CONFIG_OFFSET + EEPROM_MB_SERIAL_CONFIG_SIZE
 
 void eeprom_load_defaults(void)
 {
+	uint8_t i;
+
 	EEPROM.put(EEPROM_MAGIC_OFFSET, eeprom_magic);
 	EEPROM.put(EEPROM_MB_ADDRESS_OFFSET, eeprom_default_mb_address);
 	EEPROM.put(EEPROM_TEMP_INTERVAL_OFFSET, eeprom_default_temp_interval);
+	EEPROM.put(EEPROM_OW_TEMP_ROM_COUNT_OFFSET, (uint8_t) 0);
+	for (i = 0; i < PINS_COUNT; i++)
+		EEPROM.put(EEPROM_OW_TEMP_RESOLUTION_OFFSET(i),
+			   (uint8_t) OW_TEMP_RESOLUTION_DEFAULT);
+	memset(ow_temp_slot_rom, 0, sizeof(ow_temp_slot_rom));
+	EEPROM.put(EEPROM_OW_TEMP_SLOT_ROMS_OFFSET, ow_temp_slot_rom);
+	EEPROM.put(EEPROM_MB_SERIAL_CONFIG_OFFSET,
+		   (uint16_t) (eeprom_default_mb_serial_config |
+			       EEPROM_MB_SERIAL_CONFIG_STORED));
 	EEPROM.commit();
 }
 
@@ -340,8 +653,131 @@ void eeprom_check(void)
 	}
 }
 
+#ifdef OW_TEMP_ROM_CACHE_EEPROM
+static void ow_temp_roms_store(struct ow_temp *temp)
+{
+	struct ow_temp_device *temp_device;
+	struct ow_temp_rom rom;
+	uint8_t i;
+
+	for (i = 0; i < temp->device_count; i++) {
+		temp_device = ow_temp_device_get(temp, i);
+		memcpy(rom.address, temp_device->address, sizeof(rom.address));
+		rom.pin_index = temp_device->pin->index;
+		EEPROM.put(EEPROM_OW_TEMP_ROM_OFFSET(i), rom);
+	}
+	EEPROM.put(EEPROM_OW_TEMP_ROM_COUNT_OFFSET, temp->device_count);
+	EEPROM.commit(); /* no flash write if nothing changed */
+}
+
+static bool ow_temp_roms_load(struct ow_temp *temp)
+{
+	struct ow_temp_device *temp_device;
+	struct ow_temp_rom rom;
+	uint8_t count;
+	uint8_t i;
+
+	EEPROM.get(EEPROM_OW_TEMP_ROM_COUNT_OFFSET, count);
+	if (!count || count > OW_TEMP_DEVICE_MAX)
+		return false;
+	for (i = 0; i < count; i++) {
+		EEPROM.get(EEPROM_OW_TEMP_ROM_OFFSET(i), rom);
+		if (rom.pin_index >= PINS_COUNT ||
+		    OneWire::crc8(rom.address, 7) != rom.address[7])
+			return false;
+		temp_device = ow_temp_device_get(temp, i);
+		memcpy(temp_device->address, rom.address, sizeof(rom.address));
+		temp_device->pin = &pins[rom.pin_index];
+		temp_device->value = OW_TEMP_INVALID;
+		temp_device->slot = OW_TEMP_SLOT_NONE;
+	}
+	temp->device_count = count;
+	ow_temp_pins_link(temp);
+	ow_temp_slots_assign(temp);
+	return true;
+}
+#else
+static void ow_temp_roms_store(struct ow_temp *temp) {}
+
+static bool ow_temp_roms_load(struct ow_temp *temp)
+{
+	return false;
+}
+#endif
+
+static void pins_resolution_load(void)
+{
+	struct pin *pin;
+	uint8_t i;
+
+	for_each_pin(pin, i) {
+		EEPROM.get(EEPROM_OW_TEMP_RESOLUTION_OFFSET(i), pin->resolution);
+		if (pin->resolution < OW_TEMP_RESOLUTION_MIN ||
+		    pin->resolution > OW_TEMP_RESOLUTION_MAX)
+			pin->resolution = OW_TEMP_RESOLUTION_DEFAULT;
+		pin->resolution_changed = true;
+	}
+}
+
+static void ow_temp_init(struct ow_temp *temp)
+{
+	uint8_t slot;
+
+	EEPROM.get(EEPROM_OW_TEMP_SLOT_ROMS_OFFSET, ow_temp_slot_rom);
+	for (slot = 0; slot < OW_TEMP_SLOT_COUNT; slot++)
+		if (!ow_temp_slot_rom_valid(ow_temp_slot_rom[slot]))
+			memset(ow_temp_slot_rom[slot], 0, sizeof(DeviceAddress));
+	temp->search_needed = !ow_temp_roms_load(temp);
+	temp->last_search_millis = millis();
+}
+
 #define MB_CONFIG_ENABLE_HREG 0
 #define MB_CONFIG_ADDRESS_HREG 1
+#define MB_CONFIG_SERIAL_HREG 2
+
+/* Serial line configuration, always 8 data bits:
+ * bits 0-3 .. baud rate, index to serial_bauds[]
+ * bits 4-5 .. parity, 0 none, 1 even, 2 odd
+ * bit 6    .. two stop bits
+ */
+#define SERIAL_CONFIG_BAUD(config) ((config) & 0x0f)
+#define SERIAL_CONFIG_PARITY(config) (((config) >> 4) & 0x03)
+#define SERIAL_CONFIG_PARITY_NONE 0
+#define SERIAL_CONFIG_PARITY_EVEN 1
+#define SERIAL_CONFIG_PARITY_ODD 2
+#define SERIAL_CONFIG_STOP2 0x40
+#define SERIAL_CONFIG_MASK 0x7f
+
+static const uint32_t serial_bauds[] = {
+	1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200,
+	250000, 500000, 1000000,
+};
+
+/* Indexed by parity and two stop bits. */
+static const uint32_t serial_modes[][2] = {
+	{ SERIAL_8N1, SERIAL_8N2 },
+	{ SERIAL_8E1, SERIAL_8E2 },
+	{ SERIAL_8O1, SERIAL_8O2 },
+};
+
+static bool serial_config_valid(word config)
+{
+	return !(config & ~SERIAL_CONFIG_MASK) &&
+	       SERIAL_CONFIG_BAUD(config) < ARRAY_SIZE(serial_bauds) &&
+	       SERIAL_CONFIG_PARITY(config) <= SERIAL_CONFIG_PARITY_ODD;
+}
+
+#define MB_PIN_RESOLUTION_HREG_START 10
+#define MB_PIN_RESOLUTION_HREG(pin) (MB_PIN_RESOLUTION_HREG_START + (pin)->index)
+
+/* ROM pinned to the slot, same word order as the ID input registers.
+ * A slot is pinned once all four registers hold a ROM with a valid CRC,
+ * zeroes unpin it.
+ */
+#define MB_SLOT_ROM_HREG_START 100
+#define MB_SLOT_ROM_HREG_COUNT 4
+#define MB_SLOT_ROM_HREG(slot, word) \
+	(MB_SLOT_ROM_HREG_START + MB_SLOT_ROM_HREG_COUNT * (slot) + (word))
 
 #define MB_PIN_TEMP_IREG_START 0
 #define MB_PIN_TEMP_IREG_COUNT 8
@@ -358,34 +794,297 @@ void eeprom_check(void)
 #define MB_PIN_TEMP_ID_3_IREG(pin) __MB_PIN_TEMP_IREG(pin, 6)
 #define MB_PIN_TEMP_UNUSED_IREG(pin) __MB_PIN_TEMP_IREG(pin, 7)
 
-#define MB_SERIAL Serial
-#define MB_SERIAL_BAUDRATE 9600
-#define MB_SERIAL_TXPIN 2
+/* Device region, every device found on any bus, indexed by slot. The count
+ * register holds the number of slots to read, which is the highest used
+ * slot + 1. Unused slots in between read as not valid.
+ */
+#define MB_DEVICE_COUNT_IREG 100
+#define MB_DEVICE_IREG_START 101
+#define MB_DEVICE_IREG_COUNT 10
+
+#define __MB_DEVICE_IREG(slot, reg)		\
+	MB_DEVICE_IREG_START + MB_DEVICE_IREG_COUNT * (slot) + (reg)
+
+#define MB_DEVICE_VALID_IREG(slot) __MB_DEVICE_IREG(slot, 0)
+#define MB_DEVICE_VALUE_HI_IREG(slot) __MB_DEVICE_IREG(slot, 1)
+#define MB_DEVICE_VALUE_LO_IREG(slot) __MB_DEVICE_IREG(slot, 2)
+#define MB_DEVICE_ID_0_IREG(slot) __MB_DEVICE_IREG(slot, 3)
+#define MB_DEVICE_ID_1_IREG(slot) __MB_DEVICE_IREG(slot, 4)
+#define MB_DEVICE_ID_2_IREG(slot) __MB_DEVICE_IREG(slot, 5)
+#define MB_DEVICE_ID_3_IREG(slot) __MB_DEVICE_IREG(slot, 6)
+#define MB_DEVICE_AGE_IREG(slot) __MB_DEVICE_IREG(slot, 7) /* s since read */
+#define MB_DEVICE_PIN_IREG(slot) __MB_DEVICE_IREG(slot, 8) /* GPIO number */
+#define MB_DEVICE_UNUSED_IREG(slot) __MB_DEVICE_IREG(slot, 9)
+
+#define MB_DEVICE_AGE_UPDATE_INTERVAL 1000
+#define MB_DEVICE_AGE_MAX 0xffff
+
+#define MB_HREGS_COUNT MB_SLOT_ROM_HREG(OW_TEMP_SLOT_COUNT, 0)
+#define MB_IREGS_COUNT (__MB_DEVICE_IREG(OW_TEMP_SLOT_COUNT, 0))
+
+static word mb_hregs[MB_HREGS_COUNT];
+static word mb_iregs[MB_IREGS_COUNT];
 
 uint8_t mb_address;
+static word mb_serial_config;
+static bool mb_serial_config_changed;
+
+/* Modbus RTU slave on top of the ESP32 UART driver. The UART runs in RS485
+ * half duplex mode, where the hardware drives RTS, wired to DE and RE of
+ * the RS485 module, for exactly as long as it transmits. The end of a
+ * frame is the UART RX timeout after 3.5 character times of silence, its
+ * callback runs in the UART event task and takes the frame from the
+ * driver. Frames for other slaves are dropped right there, so the receiver
+ * is ready for the next request no matter what loop() is busy with, the
+ * rest is handed over to loop().
+ */
+#define MB_SERIAL Serial
+#define MB_SERIAL_TXPIN 2 /* RS485 module DE and RE, driven as RTS */
 
-ModbusSerial mb(MB_SERIAL, mb_address, MB_SERIAL_TXPIN);
+#define MB_RTU_FRAME_MAX 256
+#define MB_RTU_FRAME_MIN 4 /* address, function code and CRC */
+#define MB_RTU_BROADCAST 0
+#define MB_RTU_RX_TIMEOUT_MAX 92 /* characters the UART can wait for */
+
+enum mb_rtu_state {
+	MB_RTU_STATE_RX,
+	MB_RTU_STATE_FRAME, /* complete frame waiting for loop() */
+};
+
+static uint8_t mb_rtu_state; /* shared with the UART event task */
+static bool mb_rtu_rx_bad; /* drop the frame being received */
+static word mb_rtu_len;
+static uint8_t mb_rtu_frame[MB_RTU_FRAME_MAX];
+
+static void mb_rtu_receive_error(hardwareSerial_error_t error)
+{
+	mb_rtu_rx_bad = true;
+}
+
+static void mb_rtu_receive(void)
+{
+	size_t len = MB_SERIAL.available();
+	bool bad = mb_rtu_rx_bad;
+
+	mb_rtu_rx_bad = false;
+	if (bad || len < MB_RTU_FRAME_MIN || len > MB_RTU_FRAME_MAX ||
+	    __atomic_load_n(&mb_rtu_state, __ATOMIC_ACQUIRE) != MB_RTU_STATE_RX) {
+		while (MB_SERIAL.available())
+			MB_SERIAL.read();
+		return;
+	}
+	MB_SERIAL.readBytes(mb_rtu_frame, len);
+	if (mb_rtu_frame[0] != mb_address &&
+	    mb_rtu_frame[0] != MB_RTU_BROADCAST)
+		return;
+	mb_rtu_len = len;
+	__atomic_store_n(&mb_rtu_state, MB_RTU_STATE_FRAME, __ATOMIC_RELEASE);
+}
+
+/* 3.5 characters, the specification fixes it to 1750 us above 19200 Bd.
+ * The UART counts the timeout in characters of 11 bits at most.
+ */
+static uint8_t mb_rtu_rx_timeout(uint32_t baud)
+{
+	uint32_t chars;
+
+	if (baud <= 19200)
+		return 4;
+	chars = (1750UL * baud / 11 + 999999) / 1000000;
+	if (chars < 4)
+		return 4;
+	if (chars > MB_RTU_RX_TIMEOUT_MAX)
+		return MB_RTU_RX_TIMEOUT_MAX;
+	return chars;
+}
+
+static void mb_rtu_begin(word config)
+{
+	uint32_t baud = serial_bauds[SERIAL_CONFIG_BAUD(config)];
+	uint32_t mode = serial_modes[SERIAL_CONFIG_PARITY(config)]
+				    [!!(config & SERIAL_CONFIG_STOP2)];
+
+	MB_SERIAL.end();
+	MB_SERIAL.setRxBufferSize(2 * MB_RTU_FRAME_MAX);
+	MB_SERIAL.begin(baud, mode);
+	MB_SERIAL.setPins(-1, -1, -1, MB_SERIAL_TXPIN);
+	MB_SERIAL.setMode(UART_MODE_RS485_HALF_DUPLEX);
+	MB_SERIAL.setRxTimeout(mb_rtu_rx_timeout(baud));
+	mb_rtu_rx_bad = false;
+	__atomic_store_n(&mb_rtu_state, MB_RTU_STATE_RX, __ATOMIC_RELEASE);
+	MB_SERIAL.onReceiveError(mb_rtu_receive_error);
+	MB_SERIAL.onReceive(mb_rtu_receive, true);
+}
+
+#define MB_FC_READ_REGS 0x03
+#define MB_FC_READ_INPUT_REGS 0x04
+#define MB_FC_WRITE_REG 0x06
+#define MB_FC_WRITE_REGS 0x10
+
+#define MB_EX_ILLEGAL_FUNCTION 0x01
+#define MB_EX_ILLEGAL_ADDRESS 0x02
+#define MB_EX_ILLEGAL_VALUE 0x03
+
+#define MB_READ_REGS_MAX 125
+#define MB_WRITE_REGS_MAX 123
+
+static word mb_word_get(const uint8_t *buf)
+{
+	return (buf[0] << 8) | buf[1];
+}
+
+static void mb_word_put(uint8_t *buf, word val)
+{
+	buf[0] = val >> 8;
+	buf[1] = val & 0xff;
+}
+
+static uint8_t mb_exception(uint8_t *pdu, uint8_t code)
+{
+	pdu[0] |= 0x80;
+	pdu[1] = code;
+	return 2;
+}
+
+static bool mb_range_valid(word start, word count, word max)
+{
+	return (unsigned long) start + count <= max;
+}
+
+/* The PDU buffer is reused for the reply, all replies fit into it. */
+
+static uint8_t mb_regs_read(uint8_t *pdu, uint8_t len,
+			    const word *regs, word max)
+{
+	word start, count;
+	unsigned int i;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_READ_REGS_MAX)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, max))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	pdu[1] = count * 2;
+	for (i = 0; i < count; i++)
+		mb_word_put(&pdu[2 + i * 2], regs[start + i]);
+	return 2 + pdu[1];
+}
+
+static uint8_t mb_reg_write(uint8_t *pdu, uint8_t len)
+{
+	word addr;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	addr = mb_word_get(&pdu[1]);
+	if (!mb_range_valid(addr, 1, MB_HREGS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	mb_hregs[addr] = mb_word_get(&pdu[3]);
+	return len; /* echo the request */
+}
+
+static uint8_t mb_regs_write(uint8_t *pdu, uint8_t len)
+{
+	word start, count;
+	unsigned int i;
+
+	if (len < 6)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_WRITE_REGS_MAX ||
+	    pdu[5] != count * 2 || len != 6 + pdu[5])
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, MB_HREGS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	for (i = 0; i < count; i++)
+		mb_hregs[start + i] = mb_word_get(&pdu[6 + i * 2]);
+	return 5; /* function code, start and count */
+}
+
+static uint8_t mb_pdu_process(uint8_t *pdu, uint8_t len)
+{
+	switch (pdu[0]) {
+	case MB_FC_READ_REGS:
+		return mb_regs_read(pdu, len, mb_hregs, MB_HREGS_COUNT);
+	case MB_FC_READ_INPUT_REGS:
+		return mb_regs_read(pdu, len, mb_iregs, MB_IREGS_COUNT);
+	case MB_FC_WRITE_REG:
+		return mb_reg_write(pdu, len);
+	case MB_FC_WRITE_REGS:
+		return mb_regs_write(pdu, len);
+	default:
+		return mb_exception(pdu, MB_EX_ILLEGAL_FUNCTION);
+	}
+}
+
+static word mb_crc16(const uint8_t *buf, word len)
+{
+	word crc = 0xffff;
+	uint8_t i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+	}
+	return crc;
+}
+
+/* Returns the length of the reply to send, 0 for none. */
+static word mb_rtu_frame_process(uint8_t *frame, word len)
+{
+	uint8_t address = frame[0];
+	word crc;
+
+	crc = mb_crc16(frame, len - 2);
+	if (frame[len - 2] != (crc & 0xff) || frame[len - 1] != crc >> 8)
+		return 0;
+	len = 1 + mb_pdu_process(&frame[1], len - 3);
+	/* Broadcasts are carried out, but never answered. */
+	if (address == MB_RTU_BROADCAST)
+		return 0;
+	crc = mb_crc16(frame, len);
+	frame[len++] = crc & 0xff;
+	frame[len++] = crc >> 8;
+	return len;
+}
+
+static void mb_task(void)
+{
+	word len;
+
+	if (__atomic_load_n(&mb_rtu_state, __ATOMIC_ACQUIRE) !=
+	    MB_RTU_STATE_FRAME) {
+		/* A new serial configuration is applied between frames,
+		 * once the reply to the write which changed it is out.
+		 */
+		if (mb_serial_config_changed) {
+			mb_serial_config_changed = false;
+			MB_SERIAL.flush();
+			mb_rtu_begin(mb_serial_config);
+		}
+		return;
+	}
+	len = mb_rtu_frame_process(mb_rtu_frame, mb_rtu_len);
+	if (len)
+		MB_SERIAL.write(mb_rtu_frame, len);
+	__atomic_store_n(&mb_rtu_state, MB_RTU_STATE_RX, __ATOMIC_RELEASE);
+}
 
 static void mb_init()
 {
-  	MB_SERIAL.begin(MB_SERIAL_BAUDRATE, SERIAL_8N1);
-	mb.config(MB_SERIAL_BAUDRATE);
-	mb.setSlaveId(mb_address);
-	
-	mb.addHreg(MB_CONFIG_ENABLE_HREG, 0);
-	mb.addHreg(MB_CONFIG_ADDRESS_HREG, mb_address);
+	mb_hregs[MB_CONFIG_ADDRESS_HREG] = mb_address;
+	mb_hregs[MB_CONFIG_SERIAL_HREG] = mb_serial_config;
+	mb_rtu_begin(mb_serial_config);
 }
 
 static void mb_pin_init(struct pin *pin)
 {
-	mb.addIreg(MB_PIN_TEMP_VALID_IREG(pin), 0);
-	mb.addIreg(MB_PIN_TEMP_VALUE_HI_IREG(pin), 0);
-	mb.addIreg(MB_PIN_TEMP_VALUE_LO_IREG(pin), 0);
-	mb.addIreg(MB_PIN_TEMP_ID_0_IREG(pin), 0);
-	mb.addIreg(MB_PIN_TEMP_ID_1_IREG(pin), 0);
-	mb.addIreg(MB_PIN_TEMP_ID_2_IREG(pin), 0);
-	mb.addIreg(MB_PIN_TEMP_ID_3_IREG(pin), 0);
-	mb.addIreg(MB_PIN_TEMP_UNUSED_IREG(pin), 0);
+	mb_hregs[MB_PIN_RESOLUTION_HREG(pin)] = pin->resolution;
 }
 
 static void mb_pin_update(struct pin *pin)
@@ -395,27 +1094,200 @@ static void mb_pin_update(struct pin *pin)
 	
 	value = ow_temp_pin_value(pin);
 	if (value == OW_TEMP_INVALID) {
-		mb.Ireg(MB_PIN_TEMP_VALID_IREG(pin), 0);
-		mb.Ireg(MB_PIN_TEMP_VALUE_HI_IREG(pin), 0);
-		mb.Ireg(MB_PIN_TEMP_VALUE_LO_IREG(pin), 0);
-		mb.Ireg(MB_PIN_TEMP_ID_0_IREG(pin), 0);
-		mb.Ireg(MB_PIN_TEMP_ID_1_IREG(pin), 0);
-		mb.Ireg(MB_PIN_TEMP_ID_2_IREG(pin), 0);
-		mb.Ireg(MB_PIN_TEMP_ID_3_IREG(pin), 0);
+		mb_iregs[MB_PIN_TEMP_VALID_IREG(pin)] = 0;
+		mb_iregs[MB_PIN_TEMP_VALUE_HI_IREG(pin)] = 0;
+		mb_iregs[MB_PIN_TEMP_VALUE_LO_IREG(pin)] = 0;
+		mb_iregs[MB_PIN_TEMP_ID_0_IREG(pin)] = 0;
+		mb_iregs[MB_PIN_TEMP_ID_1_IREG(pin)] = 0;
+		mb_iregs[MB_PIN_TEMP_ID_2_IREG(pin)] = 0;
+		mb_iregs[MB_PIN_TEMP_ID_3_IREG(pin)] = 0;
 		return;
 	}
 
 	tmp = (uint16_t *) &value;
-	mb.Ireg(MB_PIN_TEMP_VALUE_HI_IREG(pin), tmp[0]);
-	mb.Ireg(MB_PIN_TEMP_VALUE_LO_IREG(pin), tmp[1]);
+	mb_iregs[MB_PIN_TEMP_VALUE_HI_IREG(pin)] = tmp[0];
+	mb_iregs[MB_PIN_TEMP_VALUE_LO_IREG(pin)] = tmp[1];
 
 	tmp = (uint16_t *) pin->temp_device->address;
-	mb.Ireg(MB_PIN_TEMP_ID_0_IREG(pin), tmp[0]);
-	mb.Ireg(MB_PIN_TEMP_ID_1_IREG(pin), tmp[1]);
-	mb.Ireg(MB_PIN_TEMP_ID_2_IREG(pin), tmp[2]);
-	mb.Ireg(MB_PIN_TEMP_ID_3_IREG(pin), tmp[3]);
+	mb_iregs[MB_PIN_TEMP_ID_0_IREG(pin)] = tmp[0];
+	mb_iregs[MB_PIN_TEMP_ID_1_IREG(pin)] = tmp[1];
+	mb_iregs[MB_PIN_TEMP_ID_2_IREG(pin)] = tmp[2];
+	mb_iregs[MB_PIN_TEMP_ID_3_IREG(pin)] = tmp[3];
 	
-	mb.Ireg(MB_PIN_TEMP_VALID_IREG(pin), 1);
+	mb_iregs[MB_PIN_TEMP_VALID_IREG(pin)] = 1;
+}
+
+static word mb_device_age(struct ow_temp_device *temp_device)
+{
+	unsigned long age;
+
+	if (temp_device->value == OW_TEMP_INVALID)
+		return MB_DEVICE_AGE_MAX;
+	age = (millis() - temp_device->read_millis) / 1000;
+	return age < MB_DEVICE_AGE_MAX ? age : MB_DEVICE_AGE_MAX;
+}
+
+static void mb_slot_clear(uint8_t slot)
+{
+	uint8_t reg;
+
+	for (reg = 0; reg < MB_DEVICE_IREG_COUNT; reg++)
+		mb_iregs[__MB_DEVICE_IREG(slot, reg)] = 0;
+	mb_iregs[MB_DEVICE_AGE_IREG(slot)] = MB_DEVICE_AGE_MAX;
+}
+
+static void mb_device_update(struct ow_temp_device *temp_device)
+{
+	uint8_t slot = temp_device->slot;
+	uint16_t *tmp;
+
+	if (slot == OW_TEMP_SLOT_NONE)
+		return;
+
+	tmp = (uint16_t *) temp_device->address;
+	mb_iregs[MB_DEVICE_ID_0_IREG(slot)] = tmp[0];
+	mb_iregs[MB_DEVICE_ID_1_IREG(slot)] = tmp[1];
+	mb_iregs[MB_DEVICE_ID_2_IREG(slot)] = tmp[2];
+	mb_iregs[MB_DEVICE_ID_3_IREG(slot)] = tmp[3];
+	mb_iregs[MB_DEVICE_PIN_IREG(slot)] = temp_device->pin->pin;
+	mb_iregs[MB_DEVICE_AGE_IREG(slot)] = mb_device_age(temp_device);
+
+	if (temp_device->value == OW_TEMP_INVALID) {
+		mb_iregs[MB_DEVICE_VALID_IREG(slot)] = 0;
+		mb_iregs[MB_DEVICE_VALUE_HI_IREG(slot)] = 0;
+		mb_iregs[MB_DEVICE_VALUE_LO_IREG(slot)] = 0;
+		return;
+	}
+
+	tmp = (uint16_t *) &temp_device->value;
+	mb_iregs[MB_DEVICE_VALUE_HI_IREG(slot)] = tmp[0];
+	mb_iregs[MB_DEVICE_VALUE_LO_IREG(slot)] = tmp[1];
+	mb_iregs[MB_DEVICE_VALID_IREG(slot)] = 1;
+}
+
+/* Rewrites the whole region, after the slots were assigned again. */
+static void mb_devices_update(struct ow_temp *temp)
+{
+	struct ow_temp_device *temp_device;
+	uint32_t used = 0;
+	uint8_t count = 0;
+	uint8_t slot;
+	uint8_t i;
+
+	for (i = 0; i < temp->device_count; i++) {
+		temp_device = ow_temp_device_get(temp, i);
+		slot = temp_device->slot;
+		if (slot == OW_TEMP_SLOT_NONE)
+			continue;
+		used |= 1UL << slot;
+		if (slot >= count)
+			count = slot + 1;
+		mb_device_update(temp_device);
+	}
+	for (slot = 0; slot < OW_TEMP_SLOT_COUNT; slot++)
+		if (!(used & (1UL << slot)))
+			mb_slot_clear(slot);
+	mb_iregs[MB_DEVICE_COUNT_IREG] = count;
+}
+
+unsigned long mb_device_age_millis;
+
+static void mb_devices_age_update(struct ow_temp *temp)
+{
+	struct ow_temp_device *temp_device;
+	unsigned long now = millis();
+	uint8_t i;
+
+	if (now - mb_device_age_millis < MB_DEVICE_AGE_UPDATE_INTERVAL)
+		return;
+	mb_device_age_millis = now;
+
+	for (i = 0; i < temp->device_count; i++) {
+		temp_device = ow_temp_device_get(temp, i);
+		if (temp_device->slot != OW_TEMP_SLOT_NONE)
+			mb_iregs[MB_DEVICE_AGE_IREG(temp_device->slot)] =
+				mb_device_age(temp_device);
+	}
+}
+
+/* Last seen content of the slot ROM registers. They are only looked at
+ * once per MB_SLOT_ROM_CHECK_INTERVAL and only a slot which differs from
+ * this copy was written since.
+ */
+DeviceAddress mb_slot_rom_hregs[OW_TEMP_SLOT_COUNT];
+unsigned long mb_slot_rom_check_millis;
+
+#define MB_SLOT_ROM_CHECK_INTERVAL 1000
+
+static void mb_slot_rom_hregs_set(uint8_t slot)
+{
+	uint16_t *tmp = (uint16_t *) ow_temp_slot_rom[slot];
+	uint8_t reg;
+
+	for (reg = 0; reg < MB_SLOT_ROM_HREG_COUNT; reg++)
+		mb_hregs[MB_SLOT_ROM_HREG(slot, reg)] = tmp[reg];
+	memcpy(mb_slot_rom_hregs[slot], ow_temp_slot_rom[slot],
+	       sizeof(DeviceAddress));
+}
+
+static void mb_slot_roms_init(void)
+{
+	uint8_t slot;
+
+	for (slot = 0; slot < OW_TEMP_SLOT_COUNT; slot++)
+		mb_slot_rom_hregs_set(slot);
+}
+
+static bool mb_slot_rom_zero(const DeviceAddress address)
+{
+	uint8_t i;
+
+	for (i = 0; i < sizeof(DeviceAddress); i++)
+		if (address[i])
+			return false;
+	return true;
+}
+
+/* A ROM written word by word is taken only once it is complete, that is
+ * once its CRC matches, or once all the registers are zero. All the slots
+ * changed meanwhile go to EEPROM in one commit.
+ */
+static void mb_check_slot_rom_change(bool config_enabled)
+{
+	unsigned long now = millis();
+	DeviceAddress address;
+	uint16_t *tmp = (uint16_t *) address;
+	bool changed = false;
+	uint8_t slot;
+	uint8_t reg;
+
+	if (now - mb_slot_rom_check_millis < MB_SLOT_ROM_CHECK_INTERVAL)
+		return;
+	mb_slot_rom_check_millis = now;
+
+	for (slot = 0; slot < OW_TEMP_SLOT_COUNT; slot++) {
+		for (reg = 0; reg < MB_SLOT_ROM_HREG_COUNT; reg++)
+			tmp[reg] = mb_hregs[MB_SLOT_ROM_HREG(slot, reg)];
+		if (!memcmp(address, mb_slot_rom_hregs[slot], sizeof(address)))
+			continue;
+		memcpy(mb_slot_rom_hregs[slot], address, sizeof(address));
+		if (!memcmp(address, ow_temp_slot_rom[slot], sizeof(address)))
+			continue;
+		if (!config_enabled) {
+			mb_slot_rom_hregs_set(slot);
+			continue;
+		}
+		if (!ow_temp_slot_rom_valid(address) &&
+		    !mb_slot_rom_zero(address))
+			continue;
+		memcpy(ow_temp_slot_rom[slot], address, sizeof(address));
+		changed = true;
+	}
+	if (!changed)
+		return;
+	EEPROM.put(EEPROM_OW_TEMP_SLOT_ROMS_OFFSET, ow_temp_slot_rom);
+	EEPROM.commit();
+	ow_temp_slots_assign(&ow_temp);
 }
 
 uint32_t temp_interval;
@@ -425,20 +1297,65 @@ static void print_default_status(void)
 	print_status("A:" + String(mb_address) + " I:" + String(temp_interval) + "ms");
 }
 
+static void mb_check_resolution_change(bool config_enabled)
+{
+	word resolution;
+	struct pin *pin;
+	uint8_t i;
+
+	for_each_pin(pin, i) {
+		resolution = mb_hregs[MB_PIN_RESOLUTION_HREG(pin)];
+		if (resolution == pin->resolution)
+			continue;
+		if (!config_enabled ||
+		    resolution < OW_TEMP_RESOLUTION_MIN ||
+		    resolution > OW_TEMP_RESOLUTION_MAX) {
+			mb_hregs[MB_PIN_RESOLUTION_HREG(pin)] = pin->resolution;
+			continue;
+		}
+		pin->resolution = resolution;
+		pin->resolution_changed = true;
+		EEPROM.put(EEPROM_OW_TEMP_RESOLUTION_OFFSET(pin->index),
+			   pin->resolution);
+		EEPROM.commit();
+	}
+}
+
+/* Stored right away, applied by mb_task() once the reply is sent. */
+static void mb_check_serial_config_change(bool config_enabled)
+{
+	word new_serial_config = mb_hregs[MB_CONFIG_SERIAL_HREG];
+
+	if (new_serial_config == mb_serial_config)
+		return;
+	if (!config_enabled || !serial_config_valid(new_serial_config)) {
+		mb_hregs[MB_CONFIG_SERIAL_HREG] = mb_serial_config;
+		return;
+	}
+	mb_serial_config = new_serial_config;
+	mb_serial_config_changed = true;
+	EEPROM.put(EEPROM_MB_SERIAL_CONFIG_OFFSET,
+		   (uint16_t) (mb_serial_config | EEPROM_MB_SERIAL_CONFIG_STORED));
+	EEPROM.commit();
+}
+
 static void mb_check_config_change(void)
 {
-	word new_address = mb.Hreg(MB_CONFIG_ADDRESS_HREG);
-	bool config_enabled = mb.Hreg(MB_CONFIG_ENABLE_HREG);
+	word new_address = mb_hregs[MB_CONFIG_ADDRESS_HREG];
+	bool config_enabled = mb_hregs[MB_CONFIG_ENABLE_HREG];
+
+	mb_check_resolution_change(config_enabled);
+	mb_check_slot_rom_change(config_enabled);
+	mb_check_serial_config_change(config_enabled);
 
 	if (!config_enabled) {
-		mb.Hreg(MB_CONFIG_ADDRESS_HREG, mb_address);
+		mb_hregs[MB_CONFIG_ADDRESS_HREG] = mb_address;
 		return;
 	}
 
 	if (new_address == mb_address)
 		return;
 	mb_address = new_address;
-	mb.setSlaveId(mb_address);
 	EEPROM.put(EEPROM_MB_ADDRESS_OFFSET, mb_address);
 	EEPROM.commit();
 	
@@ -470,11 +1387,21 @@ void setup(void)
 
 	EEPROM.get(EEPROM_MB_ADDRESS_OFFSET, mb_address);
 	EEPROM.get(EEPROM_TEMP_INTERVAL_OFFSET, temp_interval);
+	EEPROM.get(EEPROM_MB_SERIAL_CONFIG_OFFSET, mb_serial_config);
+	if (mb_serial_config & EEPROM_MB_SERIAL_CONFIG_STORED)
+		mb_serial_config &= ~EEPROM_MB_SERIAL_CONFIG_STORED;
+	else
+		mb_serial_config = eeprom_default_mb_serial_config;
+	if (!serial_config_valid(mb_serial_config))
+		mb_serial_config = eeprom_default_mb_serial_config;
+	pins_resolution_load();
 
 	leds_init();
 	mb_init();
 	pins_init();
 	pins_print();
+	ow_temp_init(&ow_temp);
+	mb_slot_roms_init();
 
 	print_default_status();
 }
@@ -498,6 +1425,7 @@ void loop(void)
 
 	ow_temp_process(&ow_temp, temp_interval);
 	ow_temp_print(&ow_temp);
-	mb.task();
+	mb_devices_age_update(&ow_temp);
+	mb_task();
 	mb_check_config_change();
 }
@@ -21,6 +21,8 @@
 #include <WiFi.h>
 #include <PubSubClient.h>
 #include <EEPROM.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 WiFiClient espClient;
 PubSubClient client(espClient);
@@ -30,6 +32,22 @@ char name[NAME_SIZE];
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Capture digital input edges from GPIO interrupt instead of polling them
+ * in loop(). Each edge is queued with a timestamp and published, along with
+ * the timestamp on "<pin topic>/us", so a pulse shorter than a loop() pass
+ * is not lost. Input filter does not apply to these pins. */
+//#define INPUT_IRQ
+
+/* Subscribe to a few wildcard filters instead of each config item and
+ * output pin topic separately, saving a SUBSCRIBE round trip per topic
+ * on every connect. callback() ignores topics it does not know. */
+//#define MQTT_WILDCARD_SUBSCRIBE
+
+/* Besides the per-pin topics, publish the state of all pins as one
+ * retained JSON object on "<name>/state" on connect. Define this to also
+ * publish it after every loop() pass in which some pin changed. */
+//#define STATE_SNAPSHOT_ON_CHANGE
+
 enum pin_type {
 	PIN_TYPE_G,
 };
@@ -40,6 +58,7 @@ enum pin_flavour {
 	PIN_FLAVOUR_ANALOG_INPUT,
 	PIN_FLAVOUR_DIGITAL_OUTPUT,
 	PIN_FLAVOUR_PWM_OUTPUT,
+	PIN_FLAVOUR_COUNTER,
 };
 
 const char *pin_type_subtopic[] = {
@@ -52,16 +71,22 @@ const char *pin_flavour_subtopic[] = {
 	[PIN_FLAVOUR_ANALOG_INPUT] = "ain",
 	[PIN_FLAVOUR_DIGITAL_OUTPUT] = "dout",
 	[PIN_FLAVOUR_PWM_OUTPUT] = "pwmout",
+	[PIN_FLAVOUR_COUNTER] = "counter",
 };
 
 struct pin {
 	uint8_t type;
 	uint8_t index; /* index within the group */
 	uint8_t pin; /* pin number */
-	uint16_t old_state;
-	uint16_t state;
-	uint8_t new_state_cnt;
+	uint16_t old_state; /* last input state io_task() sent to loop() */
+	uint16_t state; /* as loop() knows it */
 	uint8_t flavour;
+	uint8_t filter; /* debounce window, ms */
+	uint8_t debounced; /* level stable for at least filter */
+	uint8_t debounce_ms; /* how long the level differs from debounced */
+	volatile uint32_t count; /* falling edges seen by counter_isr() */
+	uint32_t count_last; /* count at the last rate publish */
+	bool output_pending; /* state not passed to io_task() yet */
 };
 
 bool is_pin_output(struct pin *pin)
@@ -95,6 +120,14 @@ struct pin_flavours {
 	uint8_t pin_flavours[PINS_COUNT];
 };
 
+struct pin_filters {
+	uint8_t pin_filters[PINS_COUNT]; /* ms, 0 or 0xff means config/filter */
+};
+
+struct counters {
+	uint32_t counts[PINS_COUNT];
+};
+
 #define for_each_pin(pin, i)								\
 	for (i = 0, pin = &pins[i]; i < PINS_COUNT; pin = &pins[++i])
 
@@ -116,6 +149,13 @@ char *pin_config_topic(struct pin *pin)
 	return tmp_buf;
 }
 
+char *pin_filter_config_topic(struct pin *pin)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/config/%s%u/filter", name,
+		 pin_type_subtopic[pin->type], pin->index);
+	return tmp_buf;
+}
+
 struct pin_flavours pin_flavours;
 
 void load_print_pin_flavours(void)
@@ -132,16 +172,200 @@ void load_print_pin_flavours(void)
 	}
 }
 
+bool state_changed; /* since the last state snapshot */
+
 void pin_publish(struct pin *pin)
 {
 	char state_buf[16];
 
 	sprintf(state_buf, "%u", pin->state);
+	state_changed = true;
 	client.publish(pin_topic(pin), state_buf, true);
 }
 
-void input_pins_update_state()
+/* beginPublish() needs the payload length up front, this only counts. */
+class CountingPrint : public Print {
+public:
+	size_t len = 0;
+
+	size_t write(uint8_t c) { len++; return 1; }
+	using Print::write;
+};
+
+/* The client sends every write() on its own, with Ethernet that is a TCP
+ * segment each. This collects the payload and passes it on in chunks.
+ */
+class BufferedPrint : public Print {
+public:
+	BufferedPrint(Print &out) : out(out) {}
+
+	size_t write(uint8_t c)
+	{
+		buf[len++] = c;
+		if (len == sizeof(buf))
+			flush();
+		return 1;
+	}
+	using Print::write;
+
+	void flush(void)
+	{
+		if (len)
+			out.write(buf, len);
+		len = 0;
+	}
+
+private:
+	Print &out;
+	uint8_t buf[64];
+	size_t len = 0;
+};
+
+char *state_topic(void)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/state", name);
+	return tmp_buf;
+}
+
+/* {"<pin subtopic>":<state>,...} */
+void state_snapshot_print(Print &out)
+{
+	bool first = true;
+	struct pin *pin;
+	uint8_t i;
+
+	out.print('{');
+	for_each_pin(pin, i) {
+		if (pin->flavour == PIN_FLAVOUR_DISABLED ||
+		    pin->flavour == PIN_FLAVOUR_COUNTER)
+			continue;
+		if (!first)
+			out.print(',');
+		first = false;
+		out.print('"');
+		out.print(pin_flavour_subtopic[pin->flavour]);
+		out.print('/');
+		out.print(pin_type_subtopic[pin->type]);
+		out.print(pin->index);
+		out.print("\":");
+		out.print(pin->state);
+	}
+	out.print('}');
+}
+
+void state_snapshot_publish(void)
+{
+	CountingPrint counter;
+	BufferedPrint out(client);
+
+	state_changed = false;
+	state_snapshot_print(counter);
+	if (!client.beginPublish(state_topic(), counter.len, true))
+		return;
+	state_snapshot_print(out);
+	out.flush();
+	client.endPublish();
+}
+
+/* Digital inputs are sampled and debounced every 1 ms by io_task(), so
+ * the filter window does not depend on how busy loop() is. A new level
+ * has to hold for the pin's filter time before it becomes pin->debounced.
+ * INPUT_IRQ pins are not debounced. */
+uint8_t input_filter; /* default filter, ms */
+uint8_t debounce_pins[PINS_COUNT];
+uint8_t debounce_pins_count;
+
+bool is_pin_debounced(struct pin *pin)
+{
+#ifdef INPUT_IRQ
+	return false;
+#else
+	return pin->flavour == PIN_FLAVOUR_DIGITAL_INPUT;
+#endif
+}
+
+void debounce_tick(void)
+{
+	struct pin *pin;
+	uint8_t level;
+	uint8_t i;
+
+	for (i = 0; i < debounce_pins_count; i++) {
+		pin = &pins[debounce_pins[i]];
+		level = digitalRead(pin->pin);
+		if (level == pin->debounced) {
+			pin->debounce_ms = 0;
+			continue;
+		}
+		if (++pin->debounce_ms < pin->filter)
+			continue;
+		pin->debounced = level;
+		pin->debounce_ms = 0;
+	}
+}
+
+void debounce_pin_init(struct pin *pin, uint8_t pin_index, uint8_t filter)
 {
+	pin->filter = filter && filter != 0xff ? filter : input_filter;
+	pin->debounced = digitalRead(pin->pin);
+	pin->debounce_ms = 0;
+	debounce_pins[debounce_pins_count++] = pin_index;
+}
+
+/* Pin state changes between io_task() and loop(), input_msgs one way and
+ * output_msgs the other. Each ring has a single producer and a single
+ * consumer, head is only written by the producer, tail only by the
+ * consumer. The acquire/release pairs make sure the message itself is
+ * seen by the other core before the index that publishes it. */
+#define PIN_MSGS_SIZE 64 /* power of 2 */
+
+struct pin_msg {
+	uint8_t pin_index;
+	uint16_t state;
+};
+
+struct pin_msgs {
+	struct pin_msg msgs[PIN_MSGS_SIZE];
+	uint8_t head;
+	uint8_t tail;
+};
+
+struct pin_msgs input_msgs;
+struct pin_msgs output_msgs;
+
+bool pin_msgs_push(struct pin_msgs *ring, uint8_t pin_index, uint16_t state)
+{
+	uint8_t head = ring->head;
+	struct pin_msg *msg;
+
+	if ((uint8_t) (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) ==
+	    PIN_MSGS_SIZE)
+		return false;
+	msg = &ring->msgs[head % PIN_MSGS_SIZE];
+	msg->pin_index = pin_index;
+	msg->state = state;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+bool pin_msgs_pop(struct pin_msgs *ring, struct pin_msg *msg)
+{
+	uint8_t tail = ring->tail;
+
+	if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		return false;
+	*msg = ring->msgs[tail % PIN_MSGS_SIZE];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+uint8_t input_threshold;
+
+/* io_task() side. pin->old_state is only moved on once loop() has been
+ * told, with the ring full the change is sent on a later tick. */
+void input_pins_sample(void)
+{
+	unsigned int delta;
 	uint16_t new_state;
 	struct pin *pin;
 	uint8_t i;
@@ -149,67 +373,237 @@ void input_pins_update_state()
 	for_each_pin(pin, i) {
 		switch (pin->flavour) {
 		case PIN_FLAVOUR_DIGITAL_INPUT:
-			new_state = digitalRead(pin->pin);
+			if (!is_pin_debounced(pin))
+				continue;
+			new_state = pin->debounced;
+			if (new_state == pin->old_state)
+				continue;
 			break;
 		case PIN_FLAVOUR_ANALOG_INPUT:
 			new_state = analogRead(pin->pin);
+			delta = abs((int) pin->old_state - (int) new_state);
+			if (delta < input_threshold)
+				continue;
 			break;
 		default:
 			continue;
 		}
-		pin->state = new_state;
+		if (pin_msgs_push(&input_msgs, i, new_state))
+			pin->old_state = new_state;
 	}
 }
 
-uint8_t input_filter;
-uint8_t input_threshold;
+/* loop() side. The ring is drained even while disconnected so that
+ * input_pins_publish() has the current states once connected. */
+void input_msgs_process(bool publish)
+{
+	struct pin_msg msg;
+	struct pin *pin;
+
+	while (pin_msgs_pop(&input_msgs, &msg)) {
+		pin = &pins[msg.pin_index];
+		pin->state = msg.state;
+		if (publish)
+			pin_publish(pin);
+	}
+}
 
-void input_pins_publish(bool changed_only)
+void input_pins_publish(void)
 {
-	unsigned int delta;
 	struct pin *pin;
 	uint8_t i;
 
 	for_each_pin(pin, i) {
-		switch (pin->flavour) {
-		case PIN_FLAVOUR_DIGITAL_INPUT:
-			if (changed_only) {
-				if (pin->old_state == pin->state) {
-					pin->new_state_cnt = 0;
-					continue;
-				}
-				if (pin->new_state_cnt++ < input_filter)
-					continue;
-			}
+		if (pin->flavour == PIN_FLAVOUR_DIGITAL_INPUT ||
+		    pin->flavour == PIN_FLAVOUR_ANALOG_INPUT)
 			pin_publish(pin);
-			pin->old_state = pin->state;
-			pin->new_state_cnt = 0;
+	}
+}
+
+#ifdef INPUT_IRQ
+#define PIN_EVENTS_SIZE 64 /* power of 2 */
+
+struct pin_event {
+	uint8_t pin_index;
+	uint8_t level;
+	unsigned long us;
+};
+
+/* Single producer (ISR), single consumer (loop()). Head is only written
+ * by the ISR, tail only by loop(), so no locking is needed. The ISR runs
+ * on the io_task() core, so the indexes are ordered as in pin_msgs. */
+volatile struct pin_event pin_events[PIN_EVENTS_SIZE];
+volatile uint8_t pin_events_head;
+volatile uint8_t pin_events_tail;
+volatile bool pin_events_overflow;
+
+void IRAM_ATTR pin_isr(void *arg)
+{
+	struct pin *pin = (struct pin *) arg;
+	uint8_t head = pin_events_head;
+	volatile struct pin_event *event;
+
+	if ((uint8_t) (head - __atomic_load_n(&pin_events_tail,
+					      __ATOMIC_ACQUIRE)) ==
+	    PIN_EVENTS_SIZE) {
+		pin_events_overflow = true;
+		return;
+	}
+	event = &pin_events[head % PIN_EVENTS_SIZE];
+	event->pin_index = pin - pins;
+	event->level = digitalRead(pin->pin);
+	event->us = micros();
+	__atomic_store_n(&pin_events_head, head + 1, __ATOMIC_RELEASE);
+}
+
+char *pin_us_topic(struct pin *pin)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/%s/%s%u/us", name,
+		 pin_flavour_subtopic[pin->flavour],
+		 pin_type_subtopic[pin->type], pin->index);
+	return tmp_buf;
+}
+
+/* Drop the queued edges and start over from the current levels. */
+void pin_events_resync(void)
+{
+	struct pin *pin;
+	uint8_t i;
+
+	__atomic_store_n(&pin_events_tail,
+			 __atomic_load_n(&pin_events_head, __ATOMIC_ACQUIRE),
+			 __ATOMIC_RELEASE);
+	pin_events_overflow = false;
+	for_each_pin(pin, i)
+		if (pin->flavour == PIN_FLAVOUR_DIGITAL_INPUT)
+			pin->state = digitalRead(pin->pin);
+}
+
+void pin_events_process(void)
+{
+	uint8_t tail = pin_events_tail;
+	volatile struct pin_event *event;
+	char state_buf[16];
+	unsigned long us;
+	struct pin *pin;
+	uint8_t level;
+
+	while (tail != __atomic_load_n(&pin_events_head, __ATOMIC_ACQUIRE)) {
+		event = &pin_events[tail % PIN_EVENTS_SIZE];
+		pin = &pins[event->pin_index];
+		level = event->level;
+		us = event->us;
+		__atomic_store_n(&pin_events_tail, ++tail, __ATOMIC_RELEASE);
+
+		sprintf(state_buf, "%lu", us);
+		client.publish(pin_us_topic(pin), state_buf, true);
+		sprintf(state_buf, "%u", level);
+		client.publish(pin_topic(pin), state_buf, true);
+		pin->state = level;
+		state_changed = true;
+	}
+
+	if (pin_events_overflow) {
+		/* Edges were lost, publish the current state of all pins. */
+		pin_events_resync();
+		input_pins_publish();
+	}
+}
+#endif
+
+/* Pulse counter, meant for S0 outputs of energy and water meters. Falling
+ * edges are counted from interrupt so pulses are not lost while loop()
+ * is blocked. The total is published on the pin topic and the rate, in
+ * pulses per hour, on "<pin topic>/rate" every counter_interval seconds.
+ * For a 1000 imp/kWh meter the rate equals power in W. */
+void IRAM_ATTR counter_isr(void *arg)
+{
+	struct pin *pin = (struct pin *) arg;
+
+	pin->count++;
+}
+
+char *pin_rate_topic(struct pin *pin)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/%s/%s%u/rate", name,
+		 pin_flavour_subtopic[pin->flavour],
+		 pin_type_subtopic[pin->type], pin->index);
+	return tmp_buf;
+}
+
+uint16_t counter_interval; /* seconds */
+static unsigned long counters_last_publish;
+
+void counters_publish(unsigned long now, bool force)
+{
+	unsigned long elapsed = now - counters_last_publish;
+	char state_buf[16];
+	uint32_t count;
+	uint32_t rate;
+	struct pin *pin;
+	uint8_t i;
+
+	if (!force && elapsed < counter_interval * 1000UL)
+		return;
+
+	for_each_pin(pin, i) {
+		if (pin->flavour != PIN_FLAVOUR_COUNTER)
+			continue;
+		count = pin->count;
+		sprintf(state_buf, "%lu", (unsigned long) count);
+		client.publish(pin_topic(pin), state_buf, true);
+		if (force)
+			continue;
+		rate = (uint64_t) (count - pin->count_last) * 3600000 / elapsed;
+		sprintf(state_buf, "%lu", (unsigned long) rate);
+		client.publish(pin_rate_topic(pin), state_buf, true);
+		pin->count_last = count;
+	}
+	if (!force)
+		counters_last_publish = now;
+}
+
+/* io_task() side. */
+void output_msgs_process(void)
+{
+	struct pin_msg msg;
+	struct pin *pin;
+
+	while (pin_msgs_pop(&output_msgs, &msg)) {
+		pin = &pins[msg.pin_index];
+		switch (pin->flavour) {
+		case PIN_FLAVOUR_DIGITAL_OUTPUT:
+			digitalWrite(pin->pin, msg.state);
 			break;
-		case PIN_FLAVOUR_ANALOG_INPUT:
-			delta = abs((int) pin->old_state - (int) pin->state);
-			if (delta < input_threshold && changed_only)
-				continue;
-			pin_publish(pin);
-			pin->old_state = pin->state;
-			pin->new_state_cnt = 0;
+		case PIN_FLAVOUR_PWM_OUTPUT:
+			analogWrite(pin->pin, msg.state);
 			break;
-		default:
-			continue;
 		}
 	}
 }
 
+/* loop() side, with the ring full output_pins_flush() retries later. */
+void output_pin_flush(struct pin *pin)
+{
+	pin->output_pending = !pin_msgs_push(&output_msgs, pin - pins,
+					     pin->state);
+}
+
+void output_pins_flush(void)
+{
+	struct pin *pin;
+	uint8_t i;
+
+	for_each_pin(pin, i)
+		if (pin->output_pending)
+			output_pin_flush(pin);
+}
+
 void output_pin_update_state(struct pin *pin, uint8_t new_state)
 {
 	pin->state = new_state;
-	switch (pin->flavour) {
-	case PIN_FLAVOUR_DIGITAL_OUTPUT:
-		digitalWrite(pin->pin, pin->state);
-		break;
-	case PIN_FLAVOUR_PWM_OUTPUT:
-		analogWrite(pin->pin, pin->state);
-		break;
-	}
+	state_changed = true;
+	output_pin_flush(pin);
 }
 
 void pins_msg_process(const char *topic, const char *value)
@@ -230,24 +624,41 @@ void pins_subscribe(void)
 
 	for_each_pin(pin, i) {
 		client.subscribe(pin_config_topic(pin));
+		client.subscribe(pin_filter_config_topic(pin));
 		if (is_pin_output(pin))
 			client.subscribe(pin_topic(pin));
 	}
 }
 
+struct pin_filters pin_filters;
+
 void pins_init(void)
 {
 	struct pin *pin;
 	uint8_t i;
 
+	debounce_pins_count = 0;
 	for_each_pin(pin, i) {
 		switch (pin->flavour){
 		case PIN_FLAVOUR_DIGITAL_INPUT:
 			pinMode(pin->pin, INPUT_PULLUP);
+#ifdef INPUT_IRQ
+			attachInterruptArg(digitalPinToInterrupt(pin->pin),
+					   pin_isr, pin, CHANGE);
+#endif
+			if (is_pin_debounced(pin))
+				debounce_pin_init(pin, i,
+						  pin_filters.pin_filters[i]);
 			break;
 		case PIN_FLAVOUR_ANALOG_INPUT:
 			pinMode(pin->pin, INPUT);
 			break;
+		case PIN_FLAVOUR_COUNTER:
+			pinMode(pin->pin, INPUT_PULLUP);
+			pin->count_last = pin->count;
+			attachInterruptArg(digitalPinToInterrupt(pin->pin),
+					   counter_isr, pin, FALLING);
+			break;
 		case PIN_FLAVOUR_DIGITAL_OUTPUT: /* fall-through */
 		case PIN_FLAVOUR_PWM_OUTPUT:
 			pinMode(pin->pin, OUTPUT);
@@ -257,6 +668,30 @@ void pins_init(void)
 	}
 }
 
+/* Inputs and outputs are handled by io_task(), pinned to the core loop()
+ * does not run on. loop() is left with MQTT, the network and the display,
+ * so a reconnect or a redraw no longer holds back sampling. The two only
+ * talk through the pin_msgs rings. pins_init() is called from io_task()
+ * so that the GPIO interrupts are serviced on its core as well. */
+#define IO_TASK_CORE 0 /* loop() runs on 1 */
+#define IO_TASK_PRIORITY 10 /* above loop(), below the lwIP and WiFi tasks */
+#define IO_TASK_STACK_SIZE 4096
+#define IO_TASK_PERIOD 1 /* ms, the debounce tick */
+
+void io_task(void *arg)
+{
+	TickType_t last_wake;
+
+	pins_init();
+	last_wake = xTaskGetTickCount();
+	for (;;) {
+		debounce_tick();
+		output_msgs_process();
+		input_pins_sample();
+		vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(IO_TASK_PERIOD));
+	}
+}
+
 char *config_topic(const char *item)
 {
 	snprintf(tmp_buf, TMP_BUF_LEN, "%s/config/%s", name, item);
@@ -284,9 +719,13 @@ IPAddress eeprom_default_ip = IPAddress(172, 22, 1, 10);
 IPAddress eeprom_default_mqttip = IPAddress(172, 22, 1, 1);
 uint8_t eeprom_default_filter = 16;
 uint8_t eeprom_default_threshold = 16;
-#define EEPROM_FILTER_MAX 32
+#define EEPROM_FILTER_MAX 256 /* ms */
 #define EEPROM_THRESHOLD_MAX 255
 static struct pin_flavours eeprom_default_pin_flavours; /* all zeroes means all are disabled */
+uint16_t eeprom_default_counter_interval = 60;
+#define EEPROM_COUNTER_INTERVAL_MAX 3600
+static struct counters eeprom_default_counters;
+static struct pin_filters eeprom_default_pin_filters; /* all zeroes means config/filter for all */
 
 #define EEPROM_MAGIC_OFFSET 0
 #define EEPROM_MAGIC_SIZE sizeof(eeprom_magic)
@@ -323,7 +762,16 @@ static struct pin_flavours eeprom_default_pin_flavours; /* all zeroes means all
 #define EEPROM_PIN_FLAVOURS_OFFSET EEPROM_THRESHOLD_OFFSET + EEPROM_THRESHOLD_SIZE
 #define EEPROM_PIN_FLAVOURS_SIZE sizeof(eeprom_default_pin_flavours)
 
-#define EEPROM_SIZE EEPROM_PIN_FLAVOURS_OFFSET + EEPROM_PIN_FLAVOURS_SIZE
+#define EEPROM_COUNTER_INTERVAL_OFFSET EEPROM_PIN_FLAVOURS_OFFSET + EEPROM_PIN_FLAVOURS_SIZE
+#define EEPROM_COUNTER_INTERVAL_SIZE sizeof(eeprom_default_counter_interval)
+
+#define EEPROM_COUNTERS_OFFSET EEPROM_COUNTER_INTERVAL_OFFSET + EEPROM_COUNTER_INTERVAL_SIZE
+#define EEPROM_COUNTERS_SIZE sizeof(struct counters)
+
+#define EEPROM_PIN_FILTERS_OFFSET EEPROM_COUNTERS_OFFSET + EEPROM_COUNTERS_SIZE
+#define EEPROM_PIN_FILTERS_SIZE sizeof(struct pin_filters)
+
+#define EEPROM_SIZE EEPROM_PIN_FILTERS_OFFSET + EEPROM_PIN_FILTERS_SIZE
 
 void eeprom_check(void)
 {
@@ -344,9 +792,85 @@ void eeprom_check(void)
 	EEPROM.put(EEPROM_FILTER_OFFSET, eeprom_default_filter);
 	EEPROM.put(EEPROM_THRESHOLD_OFFSET, eeprom_default_threshold);
 	EEPROM.put(EEPROM_PIN_FLAVOURS_OFFSET, eeprom_default_pin_flavours);
+	EEPROM.put(EEPROM_COUNTER_INTERVAL_OFFSET, eeprom_default_counter_interval);
+	EEPROM.put(EEPROM_COUNTERS_OFFSET, eeprom_default_counters);
+	EEPROM.put(EEPROM_PIN_FILTERS_OFFSET, eeprom_default_pin_filters);
 	EEPROM.commit();
 }
 
+/* Config writes only touch the RAM copy of the EEPROM area. Every commit
+ * erases and rewrites a whole flash sector, so a burst of config messages
+ * is collected and committed once things have been quiet for
+ * EEPROM_COMMIT_DELAY, or right away on "config/commit". */
+#define EEPROM_COMMIT_DELAY 5000
+
+static bool eeprom_dirty;
+static unsigned long eeprom_dirty_time;
+
+void eeprom_changed(void)
+{
+	eeprom_dirty = true;
+	eeprom_dirty_time = millis();
+}
+
+void eeprom_commit(void)
+{
+	if (!eeprom_dirty)
+		return;
+	EEPROM.commit();
+	eeprom_dirty = false;
+}
+
+void eeprom_commit_check(unsigned long now)
+{
+	if (eeprom_dirty && now - eeprom_dirty_time >= EEPROM_COMMIT_DELAY)
+		eeprom_commit();
+}
+
+/* Counter totals survive reboot, but every checkpoint costs a flash sector
+ * erase. Write them at most once per interval and only if they changed. */
+#define COUNTERS_CHECKPOINT_INTERVAL (60UL * 60 * 1000)
+
+static struct counters counters;
+static unsigned long counters_last_checkpoint;
+
+void counters_load(void)
+{
+	struct pin *pin;
+	uint8_t i;
+
+	EEPROM.get(EEPROM_COUNTERS_OFFSET, counters);
+	for_each_pin(pin, i) {
+		/* Erased area after upgrade from layout without counters. */
+		if (counters.counts[i] == 0xffffffff)
+			counters.counts[i] = 0;
+		pin->count = counters.counts[i];
+	}
+}
+
+void counters_checkpoint(unsigned long now, bool force)
+{
+	bool changed = false;
+	struct pin *pin;
+	uint8_t i;
+
+	if (!force && now - counters_last_checkpoint < COUNTERS_CHECKPOINT_INTERVAL)
+		return;
+	counters_last_checkpoint = now;
+
+	for_each_pin(pin, i) {
+		if (pin->flavour != PIN_FLAVOUR_COUNTER ||
+		    counters.counts[i] == pin->count)
+			continue;
+		counters.counts[i] = pin->count;
+		changed = true;
+	}
+	if (!changed)
+		return;
+	EEPROM.put(EEPROM_COUNTERS_OFFSET, counters);
+	eeprom_changed();
+}
+
 void payload_mac_to_eeprom(int offset, int size, byte *payload, int length)
 {
 	char *pos = (char *) payload;
@@ -356,9 +880,9 @@ void payload_mac_to_eeprom(int offset, int size, byte *payload, int length)
 		EEPROM.write(offset + i, strtol(pos, &pos, 16));
 		pos++;
 		if (pos >= (char *) payload + length)
-			return;
+			break;
 	}
-	EEPROM.commit();
+	eeprom_changed();
 }
 
 void str_to_eeprom(int offset, int size, byte *payload, int length)
@@ -372,7 +896,7 @@ void str_to_eeprom(int offset, int size, byte *payload, int length)
 		else
 			EEPROM.write(offset + i, *pos++);
 	}
-	EEPROM.commit();
+	eeprom_changed();
 }
 
 bool check_pin_flavours_to_eeprom(char *topic, byte *payload,
@@ -399,10 +923,34 @@ bool check_pin_flavours_to_eeprom(char *topic, byte *payload,
 		else if (!strcmp((const char *) payload,
 				 pin_flavour_subtopic[PIN_FLAVOUR_PWM_OUTPUT]))
 			pin_flavours.pin_flavours[i] = PIN_FLAVOUR_PWM_OUTPUT;
+		else if (!strcmp((const char *) payload,
+				 pin_flavour_subtopic[PIN_FLAVOUR_COUNTER]))
+			pin_flavours.pin_flavours[i] = PIN_FLAVOUR_COUNTER;
 		else
 			continue;
 		EEPROM.put(EEPROM_PIN_FLAVOURS_OFFSET, pin_flavours);
-		EEPROM.commit();
+		eeprom_changed();
+		return true;
+	}
+	return false;
+}
+
+bool check_pin_filters_to_eeprom(char *topic, byte *payload,
+				 unsigned int length)
+{
+	struct pin *pin;
+	uint32_t filter;
+	uint8_t i;
+
+	for_each_pin(pin, i) {
+		if (strcmp(topic, pin_filter_config_topic(pin)))
+			continue;
+		filter = strtol((const char *) payload, NULL, 10);
+		if (filter >= 0xff)
+			return true;
+		pin_filters.pin_filters[i] = filter;
+		EEPROM.put(EEPROM_PIN_FILTERS_OFFSET, pin_filters);
+		eeprom_changed();
 		return true;
 	}
 	return false;
@@ -429,30 +977,40 @@ void callback(char *topic, byte *payload, unsigned int length)
 
 		if (ip.fromString((const char *) payload)) {
 			EEPROM.put(EEPROM_IP_OFFSET, ip);
-			EEPROM.commit();
+			eeprom_changed();
 		}
 	} else if (!strcmp(topic, config_topic("mqttip"))) {
 		IPAddress mqttip;
 
 		if (mqttip.fromString((const char *) payload)) {
 			EEPROM.put(EEPROM_MQTTIP_OFFSET, mqttip);
-			EEPROM.commit();
+			eeprom_changed();
 		}
 	} else if (!strcmp(topic, config_topic("filter"))) {
 		uint32_t filter = strtol((const char *) payload, NULL, 10);
 
 		if (filter < EEPROM_FILTER_MAX) {
-			EEPROM.put(EEPROM_FILTER_OFFSET, filter);
-			EEPROM.commit();
+			EEPROM.put(EEPROM_FILTER_OFFSET, (uint8_t) filter);
+			eeprom_changed();
 		}
 	} else if (!strcmp(topic, config_topic("threshold"))) {
 		uint32_t threshold = strtol((const char *) payload, NULL, 10);
 
 		if (threshold < EEPROM_THRESHOLD_MAX) {
 			EEPROM.put(EEPROM_THRESHOLD_OFFSET, (uint8_t) threshold);
-			EEPROM.commit();
+			eeprom_changed();
+		}
+	} else if (!strcmp(topic, config_topic("counter_interval"))) {
+		uint32_t interval = strtol((const char *) payload, NULL, 10);
+
+		if (interval && interval <= EEPROM_COUNTER_INTERVAL_MAX) {
+			EEPROM.put(EEPROM_COUNTER_INTERVAL_OFFSET, (uint16_t) interval);
+			eeprom_changed();
 		}
+	} else if (!strcmp(topic, config_topic("commit"))) {
+		eeprom_commit();
 	} else if (check_pin_flavours_to_eeprom(topic, payload, length)) {
+	} else if (check_pin_filters_to_eeprom(topic, payload, length)) {
 	} else {
 		pins_msg_process(topic, (const char *) payload);
 	}
@@ -474,6 +1032,121 @@ void print_status(String status)
 	Serial.println(status);
 }
 
+/* The MQTT connection is driven from loop() one step per pass, TCP connect
+ * first, MQTT CONNECT/CONNACK in the next pass, each bounded by a short
+ * timeout, so local I/O keeps running while the broker is away. Failed
+ * attempts are retried with jittered exponential backoff. */
+#define MQTT_PORT 1883
+#define MQTT_TCP_TIMEOUT 500 /* ms */
+#define MQTT_SOCKET_TIMEOUT 1 /* s, CONNACK wait */
+#define MQTT_RETRY_TIMEOUT_MIN 1000
+#define MQTT_RETRY_TIMEOUT_MAX 60000
+
+enum mqtt_state {
+	MQTT_STATE_TCP_CONNECT,
+	MQTT_STATE_MQTT_CONNECT,
+	MQTT_STATE_CONNECTED,
+	MQTT_STATE_BACKOFF,
+};
+
+static enum mqtt_state mqtt_state;
+static IPAddress mqtt_server;
+static unsigned long mqtt_retry_timeout = MQTT_RETRY_TIMEOUT_MIN;
+static unsigned long mqtt_backoff_timeout;
+static unsigned long mqtt_last_attempt;
+
+void mqtt_backoff(unsigned long now)
+{
+	/* Jitter spreads out reconnects of devices that lost the broker
+	 * at the same time. */
+	mqtt_backoff_timeout = mqtt_retry_timeout +
+			       random(mqtt_retry_timeout / 2);
+	mqtt_retry_timeout = min(mqtt_retry_timeout * 2,
+				 (unsigned long) MQTT_RETRY_TIMEOUT_MAX);
+	mqtt_last_attempt = now;
+	mqtt_state = MQTT_STATE_BACKOFF;
+}
+
+#ifdef MQTT_WILDCARD_SUBSCRIBE
+void wildcard_subscribe(void)
+{
+	bool subscribed[ARRAY_SIZE(pin_flavour_subtopic)] = {};
+	struct pin *pin;
+	uint8_t i;
+
+	client.subscribe(config_topic("#"));
+	for_each_pin(pin, i) {
+		if (!is_pin_output(pin) || subscribed[pin->flavour])
+			continue;
+		snprintf(tmp_buf, TMP_BUF_LEN, "%s/%s/#", name,
+			 pin_flavour_subtopic[pin->flavour]);
+		client.subscribe(tmp_buf);
+		subscribed[pin->flavour] = true;
+	}
+}
+#endif
+
+void mqtt_connected_setup(unsigned long now)
+{
+#ifdef INPUT_IRQ
+	pin_events_resync();
+#endif
+	input_pins_publish();
+	counters_publish(now, true);
+	state_snapshot_publish();
+#ifdef MQTT_WILDCARD_SUBSCRIBE
+	wildcard_subscribe();
+#else
+	client.subscribe(config_topic("name"));
+	client.subscribe(config_topic("ssid"));
+	client.subscribe(config_topic("pass"));
+	client.subscribe(config_topic("mac"));
+	client.subscribe(config_topic("ip"));
+	client.subscribe(config_topic("mqttip"));
+	client.subscribe(config_topic("filter"));
+	client.subscribe(config_topic("threshold"));
+	client.subscribe(config_topic("counter_interval"));
+	client.subscribe(config_topic("commit"));
+	pins_subscribe();
+#endif
+}
+
+bool mqtt_process(unsigned long now)
+{
+	switch (mqtt_state) {
+	case MQTT_STATE_TCP_CONNECT:
+		if (espClient.connect(mqtt_server, MQTT_PORT, MQTT_TCP_TIMEOUT))
+			mqtt_state = MQTT_STATE_MQTT_CONNECT;
+		else
+			mqtt_backoff(now);
+		break;
+	case MQTT_STATE_MQTT_CONNECT:
+		/* TCP is up already, so this only does CONNECT/CONNACK. */
+		if (!client.connect(name)) {
+			espClient.stop();
+			mqtt_backoff(now);
+			break;
+		}
+		print_status("MQTT CONNECTED");
+		mqtt_retry_timeout = MQTT_RETRY_TIMEOUT_MIN;
+		mqtt_state = MQTT_STATE_CONNECTED;
+		mqtt_connected_setup(now);
+		break;
+	case MQTT_STATE_CONNECTED:
+		if (client.connected())
+			return true;
+		print_status("MQTT DISCONNECTED");
+		espClient.stop();
+		mqtt_state = MQTT_STATE_TCP_CONNECT;
+		break;
+	case MQTT_STATE_BACKOFF:
+		if (now - mqtt_last_attempt >= mqtt_backoff_timeout)
+			mqtt_state = MQTT_STATE_TCP_CONNECT;
+		break;
+	}
+	return false;
+}
+
 void setup(void)
 {
 	char wifi_ssid[WIFI_SSID_LEN];
@@ -507,6 +1180,7 @@ void setup(void)
 	EEPROM.get(EEPROM_MAC_OFFSET, mac);
 	mac[0] &= 0xfe; /* Clear multicast bit. */
 	mac[0] |= 0x02; /* Set local assignment bit. */
+	randomSeed(mac[3] << 16 | mac[4] << 8 | mac[5]);
 
 	sprintf(macstr, "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 	Serial.print("MAC:");
@@ -528,77 +1202,71 @@ void setup(void)
 	Serial.print("THRESHOLD:");
 	Serial.println(input_threshold);
 
+	EEPROM.get(EEPROM_COUNTER_INTERVAL_OFFSET, counter_interval);
+	if (!counter_interval || counter_interval > EEPROM_COUNTER_INTERVAL_MAX)
+		counter_interval = eeprom_default_counter_interval;
+	Serial.print("COUNTER INTERVAL:");
+	Serial.println(counter_interval);
+
 	EEPROM.get(EEPROM_PIN_FLAVOURS_OFFSET, pin_flavours);
 	Serial.println("PIN FLAVOURS:");
 	load_print_pin_flavours();
+	EEPROM.get(EEPROM_PIN_FILTERS_OFFSET, pin_filters);
+	counters_load();
 
 	WiFi.mode(WIFI_STA);
 	WiFi.begin(wifi_ssid, wifi_pass);
 
-	pins_init();
+	xTaskCreatePinnedToCore(io_task, "io", IO_TASK_STACK_SIZE, NULL,
+				IO_TASK_PRIORITY, NULL, IO_TASK_CORE);
 
-	client.setServer(mqttip, 1883);
+	client.setServer(mqttip, MQTT_PORT);
+	client.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+	mqtt_server = mqttip;
 	client.setCallback(callback);
 	M5.Lcd.setCursor(10, 10);
 	print_status("INIT DONE");
 }
 
-#define MQTT_RETRY_TIMEOUT 5000
-
 static bool wifi_connected;
-static bool mqtt_connected;
-static unsigned long mqtt_last_attempt;
 
 void(* reset) (void) = 0;
 
 void loop(void)
 {
 	unsigned long now = millis();
+	bool connected;
 
 	M5.update();
 	if (M5.BtnC.wasPressed()) {
 		print_status("RESET");
+		counters_checkpoint(now, true);
+		eeprom_commit();
 		reset();
 	}
 
-	if (!mqtt_connected && WiFi.status() == WL_CONNECTED) {
+	if (!wifi_connected && WiFi.status() == WL_CONNECTED) {
 		print_status("WIFI CONNECTED");
 		wifi_connected = true;
-	} else if (mqtt_connected && WiFi.status() != WL_CONNECTED) {
+	} else if (wifi_connected && WiFi.status() != WL_CONNECTED) {
 		print_status("WIFI DISCONNECTED");
 		wifi_connected = false;
 	}
 
-	if (!client.connected() && wifi_connected) {
-		if (mqtt_connected) {
-			mqtt_last_attempt = 0;
-			print_status("MQTT DISCONNECTED");
-			mqtt_connected = false;
-		}
-		if (!mqtt_last_attempt ||
-		    mqtt_last_attempt + MQTT_RETRY_TIMEOUT < now ||
-		    mqtt_last_attempt > now) {
-			mqtt_last_attempt = now;
-
-			if (client.connect(name)) {
-				print_status("MQTT CONNECTED");
-				mqtt_connected = true;
-				input_pins_update_state();
-				input_pins_publish(false);
-				client.subscribe(config_topic("name"));
-				client.subscribe(config_topic("ssid"));
-				client.subscribe(config_topic("pass"));
-				client.subscribe(config_topic("mac"));
-				client.subscribe(config_topic("ip"));
-				client.subscribe(config_topic("mqttip"));
-				client.subscribe(config_topic("filter"));
-				client.subscribe(config_topic("threshold"));
-				pins_subscribe();
-			}
-		}
-	} else {
-		input_pins_update_state();
-		input_pins_publish(true);
+	connected = wifi_connected && mqtt_process(now);
+	input_msgs_process(connected);
+	output_pins_flush();
+	if (connected) {
+#ifdef INPUT_IRQ
+		pin_events_process();
+#endif
+#ifdef STATE_SNAPSHOT_ON_CHANGE
+		if (state_changed)
+			state_snapshot_publish();
+#endif
+		counters_publish(now, false);
 		client.loop();
 	}
+	counters_checkpoint(now, false);
+	eeprom_commit_check(now);
 }
@@ -18,15 +18,12 @@
  */
 
 #include "Arduino.h"
-#include <Modbus.h>
 #include <Wire.h>
 #include <SparkFun_SCD30_Arduino_Library.h>
 #include <SparkFunBME280.h>
-#include <ModbusSerial.h>
 
 SCD30 air_sensor;
 BME280 pressure_sensor;
-ModbusSerial mb;
 
 const int LED_COIL = 100;
 const int CO2_IREG = 100;
@@ -47,36 +44,363 @@ const int PRESSURE_AVAILABLE_ISTS = 103;
 const int TEMP2_AVAILABLE_ISTS = 104;
 const int HUMIDITY2_AVAILABLE_ISTS = 105;
 
+#define MB_COILS_START LED_COIL
+#define MB_COILS_COUNT 1
+#define MB_ISTS_START CO2_AVAILABLE_ISTS
+#define MB_ISTS_COUNT (HUMIDITY2_AVAILABLE_ISTS - CO2_AVAILABLE_ISTS + 1)
+#define MB_IREGS_START CO2_IREG
+#define MB_IREGS_COUNT (HUMIDITY2_LO_IREG - CO2_IREG + 1)
+
+static bool mb_coils[MB_COILS_COUNT];
+static bool mb_ists[MB_ISTS_COUNT];
+static word mb_iregs[MB_IREGS_COUNT];
+
+#define MB_ADDRESS 0x31
+#define MB_SERIAL_BAUDRATE 115200 /* 8N1 */
+
 const int sensorPin = A0;
 
-#define TXPIN 2
+#define TXPIN 2 /* RS485 module DE and RE */
 #define LED_BUILTIN 13
 
+/* Modbus RTU slave running directly on USART0, so Serial must not be used
+ * anywhere as it comes with its own interrupt handlers.
+ *
+ * The RX interrupt collects a frame and every byte restarts Timer1, which
+ * fires after 3.5 character times of silence. Frames for other slaves are
+ * dropped right there, so the receiver is ready for the next request no
+ * matter what loop() is busy with, the rest is handed over to loop(). The
+ * reply is fed by the UDRE interrupt and the TXC interrupt releases the
+ * RS485 driver as soon as the last stop bit is out.
+ */
+#define MB_RTU_FRAME_MAX 256
+#define MB_RTU_FRAME_MIN 4 /* address, function code and CRC */
+#define MB_RTU_BROADCAST 0
+
+enum mb_rtu_state {
+	MB_RTU_STATE_RX,
+	MB_RTU_STATE_FRAME, /* complete frame waiting for loop() */
+	MB_RTU_STATE_TX,
+};
+
+static volatile enum mb_rtu_state mb_rtu_state;
+static volatile bool mb_rtu_rx_bad; /* drop the frame being received */
+static volatile word mb_rtu_len;
+static volatile word mb_rtu_tx_pos;
+static uint8_t mb_rtu_frame[MB_RTU_FRAME_MAX];
+
+static void mb_rtu_t35_restart(void)
+{
+	TCNT1 = 0;
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 |= _BV(OCIE1A);
+}
+
+ISR(USART_RX_vect)
+{
+	uint8_t status = UCSR0A;
+	uint8_t c = UDR0;
+
+	mb_rtu_t35_restart();
+	/* Bytes coming in while the previous frame is still being processed
+	 * belong to a frame which is not going to be complete.
+	 */
+	if (status & (_BV(FE0) | _BV(DOR0) | _BV(UPE0)) ||
+	    mb_rtu_state != MB_RTU_STATE_RX || mb_rtu_len == MB_RTU_FRAME_MAX)
+		mb_rtu_rx_bad = true;
+	if (mb_rtu_rx_bad)
+		return;
+	mb_rtu_frame[mb_rtu_len++] = c;
+}
+
+ISR(USART_UDRE_vect)
+{
+	UDR0 = mb_rtu_frame[mb_rtu_tx_pos++];
+	if (mb_rtu_tx_pos < mb_rtu_len)
+		return;
+	/* The last byte is in, wait for it to leave the shift register. */
+	UCSR0B = (UCSR0B & ~_BV(UDRIE0)) | _BV(TXCIE0);
+}
+
+ISR(USART_TX_vect)
+{
+	digitalWrite(TXPIN, LOW);
+	UCSR0B = (UCSR0B & ~_BV(TXCIE0)) | _BV(RXEN0);
+	mb_rtu_len = 0;
+	mb_rtu_rx_bad = false;
+	mb_rtu_state = MB_RTU_STATE_RX;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	TIMSK1 &= ~_BV(OCIE1A);
+	if (mb_rtu_state == MB_RTU_STATE_RX) {
+		if (!mb_rtu_rx_bad && mb_rtu_len >= MB_RTU_FRAME_MIN &&
+		    (mb_rtu_frame[0] == MB_ADDRESS ||
+		     mb_rtu_frame[0] == MB_RTU_BROADCAST))
+			mb_rtu_state = MB_RTU_STATE_FRAME;
+		else
+			mb_rtu_len = 0;
+	}
+	mb_rtu_rx_bad = false;
+}
+
+static void mb_rtu_init(unsigned long baud)
+{
+	unsigned long t35;
+
+	pinMode(TXPIN, OUTPUT);
+	digitalWrite(TXPIN, LOW);
+
+	/* 3.5 characters of 11 bits, the specification fixes it to 1750 us
+	 * above 19200 Bd.
+	 */
+	if (baud > 19200)
+		t35 = 1750;
+	else
+		t35 = 38500000UL / baud;
+
+	noInterrupts();
+	UCSR0B = 0;
+	UCSR0A = _BV(U2X0);
+	UBRR0 = (F_CPU / 4 / baud - 1) / 2;
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+	UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+	TIMSK1 = 0;
+	TCCR1A = 0;
+	TCCR1B = _BV(WGM12) | _BV(CS11); /* CTC, clk/8 */
+	OCR1A = t35 * (F_CPU / 8 / 1000000) - 1;
+	mb_rtu_len = 0;
+	mb_rtu_rx_bad = false;
+	mb_rtu_state = MB_RTU_STATE_RX;
+	interrupts();
+}
+
+static void mb_rtu_tx_start(word len)
+{
+	noInterrupts();
+	mb_rtu_len = len;
+	mb_rtu_tx_pos = 0;
+	mb_rtu_state = MB_RTU_STATE_TX;
+	UCSR0B &= ~_BV(RXEN0);
+	digitalWrite(TXPIN, HIGH);
+	UCSR0A |= _BV(TXC0);
+	UCSR0B |= _BV(UDRIE0);
+	interrupts();
+}
+
+static void mb_rtu_rx_restart(void)
+{
+	noInterrupts();
+	mb_rtu_len = 0;
+	mb_rtu_state = MB_RTU_STATE_RX;
+	interrupts();
+}
+
+#define MB_FC_READ_COILS 0x01
+#define MB_FC_READ_ISTS 0x02
+#define MB_FC_READ_INPUT_REGS 0x04
+#define MB_FC_WRITE_COIL 0x05
+#define MB_FC_WRITE_COILS 0x0F
+
+#define MB_EX_ILLEGAL_FUNCTION 0x01
+#define MB_EX_ILLEGAL_ADDRESS 0x02
+#define MB_EX_ILLEGAL_VALUE 0x03
+
+#define MB_READ_BITS_MAX 2000
+#define MB_READ_REGS_MAX 125
+#define MB_WRITE_BITS_MAX 1968
+
+static word mb_word_get(const uint8_t *buf)
+{
+	return (buf[0] << 8) | buf[1];
+}
+
+static void mb_word_put(uint8_t *buf, word val)
+{
+	buf[0] = val >> 8;
+	buf[1] = val & 0xff;
+}
+
+static uint8_t mb_exception(uint8_t *pdu, uint8_t code)
+{
+	pdu[0] |= 0x80;
+	pdu[1] = code;
+	return 2;
+}
+
+static bool mb_range_valid(word start, word count, word first, word max)
+{
+	return start >= first && (unsigned long) start + count <= first + max;
+}
+
+/* The PDU buffer is reused for the reply, all replies fit into it. */
+
+static uint8_t mb_bits_read(uint8_t *pdu, uint8_t len,
+			    const bool *bits, word first, word max)
+{
+	uint8_t *out = &pdu[2];
+	word start, count;
+	unsigned int i;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_READ_BITS_MAX)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, first, max))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	pdu[1] = (count + 7) / 8;
+	memset(out, 0, pdu[1]);
+	for (i = 0; i < count; i++)
+		if (bits[start - first + i])
+			bitSet(out[i / 8], i % 8);
+	return 2 + pdu[1];
+}
+
+static uint8_t mb_iregs_read(uint8_t *pdu, uint8_t len)
+{
+	word start, count;
+	unsigned int i;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_READ_REGS_MAX)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, MB_IREGS_START, MB_IREGS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	pdu[1] = count * 2;
+	for (i = 0; i < count; i++)
+		mb_word_put(&pdu[2 + i * 2],
+			    mb_iregs[start - MB_IREGS_START + i]);
+	return 2 + pdu[1];
+}
+
+static uint8_t mb_coil_write(uint8_t *pdu, uint8_t len)
+{
+	word addr, val;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	addr = mb_word_get(&pdu[1]);
+	val = mb_word_get(&pdu[3]);
+	if (val != 0xff00 && val != 0x0000)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(addr, 1, MB_COILS_START, MB_COILS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	mb_coils[addr - MB_COILS_START] = val == 0xff00;
+	return len; /* echo the request */
+}
+
+static uint8_t mb_coils_write(uint8_t *pdu, uint8_t len)
+{
+	const uint8_t *in = &pdu[6];
+	word start, count;
+	unsigned int i;
+
+	if (len < 6)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_WRITE_BITS_MAX ||
+	    pdu[5] != (count + 7) / 8 || len != 6 + pdu[5])
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, MB_COILS_START, MB_COILS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	for (i = 0; i < count; i++)
+		mb_coils[start - MB_COILS_START + i] = bitRead(in[i / 8], i % 8);
+	return 5; /* function code, start and count */
+}
+
+static uint8_t mb_pdu_process(uint8_t *pdu, uint8_t len)
+{
+	switch (pdu[0]) {
+	case MB_FC_READ_COILS:
+		return mb_bits_read(pdu, len, mb_coils,
+				    MB_COILS_START, MB_COILS_COUNT);
+	case MB_FC_READ_ISTS:
+		return mb_bits_read(pdu, len, mb_ists,
+				    MB_ISTS_START, MB_ISTS_COUNT);
+	case MB_FC_READ_INPUT_REGS:
+		return mb_iregs_read(pdu, len);
+	case MB_FC_WRITE_COIL:
+		return mb_coil_write(pdu, len);
+	case MB_FC_WRITE_COILS:
+		return mb_coils_write(pdu, len);
+	default:
+		return mb_exception(pdu, MB_EX_ILLEGAL_FUNCTION);
+	}
+}
+
+static word mb_crc16(const uint8_t *buf, word len)
+{
+	word crc = 0xffff;
+	uint8_t i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+	}
+	return crc;
+}
+
+/* Returns the length of the reply to send, 0 for none. */
+static word mb_rtu_frame_process(uint8_t *frame, word len)
+{
+	uint8_t address = frame[0];
+	word crc;
+
+	crc = mb_crc16(frame, len - 2);
+	if (frame[len - 2] != (crc & 0xff) || frame[len - 1] != crc >> 8)
+		return 0;
+	len = 1 + mb_pdu_process(&frame[1], len - 3);
+	/* Broadcasts are carried out, but never answered. */
+	if (address == MB_RTU_BROADCAST)
+		return 0;
+	crc = mb_crc16(frame, len);
+	frame[len++] = crc & 0xff;
+	frame[len++] = crc >> 8;
+	return len;
+}
+
+static void mb_task(void)
+{
+	enum mb_rtu_state state;
+	word len;
+
+	noInterrupts();
+	state = mb_rtu_state;
+	len = mb_rtu_len;
+	interrupts();
+
+	if (state != MB_RTU_STATE_FRAME)
+		return;
+	len = mb_rtu_frame_process(mb_rtu_frame, len);
+	if (len)
+		mb_rtu_tx_start(len);
+	else
+		mb_rtu_rx_restart();
+}
+
+static void Iregs_set(word offset, word value)
+{
+	mb_iregs[offset - MB_IREGS_START] = value;
+}
+
+static void Ists_set(word offset, bool value)
+{
+	mb_ists[offset - MB_ISTS_START] = value;
+}
+
 void setup()
 {
 	pinMode(LED_BUILTIN, OUTPUT);
 
-	mb.config(&Serial, 115200, SERIAL_8N1, TXPIN);
-	mb.setSlaveId(0x31);
-
-	mb.addIreg(CO2_IREG);
-	mb.addIreg(TEMP_HI_IREG);
-	mb.addIreg(TEMP_LO_IREG);
-	mb.addIreg(HUMIDITY_HI_IREG);
-	mb.addIreg(HUMIDITY_LO_IREG);
-	mb.addIreg(PRESSURE_HI_IREG);
-	mb.addIreg(PRESSURE_LO_IREG);
-	mb.addIreg(TEMP2_HI_IREG);
-	mb.addIreg(TEMP2_LO_IREG);
-	mb.addIreg(HUMIDITY2_HI_IREG);
-	mb.addIreg(HUMIDITY2_LO_IREG);
-	mb.addIsts(CO2_AVAILABLE_ISTS);
-	mb.addIsts(TEMP_AVAILABLE_ISTS);
-	mb.addIsts(HUMIDITY_AVAILABLE_ISTS);
-	mb.addIsts(PRESSURE_AVAILABLE_ISTS);
-	mb.addIsts(TEMP2_AVAILABLE_ISTS);
-	mb.addIsts(HUMIDITY2_AVAILABLE_ISTS);
-	mb.addCoil(LED_COIL);
+	mb_rtu_init(MB_SERIAL_BAUDRATE);
 
 	Wire.begin();
 
@@ -92,8 +416,8 @@ static void Iregs_float_set(word hi_offset, word lo_offset, float value)
 	uint32_t *tmp;
 
 	tmp = (uint32_t *) &value;
-	mb.Ireg(hi_offset, (*tmp) >> 16);
-	mb.Ireg(lo_offset, (*tmp) && 0xFFFF);
+	Iregs_set(hi_offset, (*tmp) >> 16);
+	Iregs_set(lo_offset, (*tmp) & 0xFFFF);
 }
 
 static int voidmeasures = 0;
@@ -117,14 +441,14 @@ static void air_sensor_process(void)
 		return;
 	}
 
-	mb.Ireg(CO2_IREG, co2);
-	mb.Ists(CO2_AVAILABLE_ISTS, true);
+	Iregs_set(CO2_IREG, co2);
+	Ists_set(CO2_AVAILABLE_ISTS, true);
 
 	Iregs_float_set(TEMP_HI_IREG, TEMP_LO_IREG, temperature);
-	mb.Ists(TEMP_AVAILABLE_ISTS, true);
+	Ists_set(TEMP_AVAILABLE_ISTS, true);
 
 	Iregs_float_set(HUMIDITY_HI_IREG, HUMIDITY_LO_IREG, humidity);
-	mb.Ists(HUMIDITY_AVAILABLE_ISTS, true);
+	Ists_set(HUMIDITY_AVAILABLE_ISTS, true);
 }
 
 unsigned long last_measurement = 0;
@@ -147,21 +471,21 @@ static void pressure_sensor_process(void)
 	humidity = pressure_sensor.readFloatHumidity();
 
 	Iregs_float_set(PRESSURE_HI_IREG, PRESSURE_LO_IREG, pressure);
-	mb.Ists(PRESSURE_AVAILABLE_ISTS, true);
+	Ists_set(PRESSURE_AVAILABLE_ISTS, true);
 
 	air_sensor.setAmbientPressure((uint16_t) pressure);
 
 	Iregs_float_set(TEMP2_HI_IREG, TEMP2_LO_IREG, temperature);
-	mb.Ists(TEMP2_AVAILABLE_ISTS, true);
+	Ists_set(TEMP2_AVAILABLE_ISTS, true);
 
 	Iregs_float_set(HUMIDITY2_HI_IREG, HUMIDITY2_LO_IREG, humidity);
-	mb.Ists(HUMIDITY2_AVAILABLE_ISTS, true);
+	Ists_set(HUMIDITY2_AVAILABLE_ISTS, true);
 }
 
 void loop()
 {
-	mb.task();
-	digitalWrite(LED_BUILTIN, mb.Coil(LED_COIL));
+	mb_task();
+	digitalWrite(LED_BUILTIN, mb_coils[LED_COIL - MB_COILS_START]);
 
 	air_sensor_process();
 	pressure_sensor_process();
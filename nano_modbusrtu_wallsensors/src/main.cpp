@@ -19,15 +19,22 @@
  */
 
 #include "Arduino.h"
-#include <Modbus.h>
 #include <Wire.h>
 #include <SparkFun_SCD30_Arduino_Library.h>
 #include <SparkFunBME280.h>
 #include <SHT31.h>
 #include <EEPROM.h>
 
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Run the I2C bus at 400 kHz instead of 100 kHz. BME280 and SHT31 can do
+ * that, SCD30 is specified for 100 kHz only.
+ */
+//#define I2C_FAST_MODE
+
 uint32_t eeprom_magic = 0x3b1e2e8a;
 byte eeprom_default_address = 0x31;
+word eeprom_default_serial_config = 0x0003; /* 9600 8N1 */
 
 #define EEPROM_MAGIC_OFFSET 0
 #define EEPROM_MAGIC_SIZE sizeof(eeprom_magic)
@@ -35,6 +42,9 @@ byte eeprom_default_address = 0x31;
 #define EEPROM_ADDRESS_OFFSET EEPROM_MAGIC_OFFSET + EEPROM_MAGIC_SIZE
 #define EEPROM_ADDRESS_SIZE sizeof(eeprom_default_address)
 
+#define EEPROM_SERIAL_CONFIG_OFFSET EEPROM_ADDRESS_OFFSET + EEPROM_ADDRESS_SIZE
+#define EEPROM_SERIAL_CONFIG_SIZE sizeof(eeprom_default_serial_config)
+
 void eeprom_check(void)
 {
 	uint32_t magic;
@@ -45,6 +55,7 @@ void eeprom_check(void)
 
 	EEPROM.put(EEPROM_MAGIC_OFFSET, eeprom_magic);
 	EEPROM.put(EEPROM_ADDRESS_OFFSET, eeprom_default_address);
+	EEPROM.put(EEPROM_SERIAL_CONFIG_OFFSET, eeprom_default_serial_config);
 }
 
 SCD30 scd30;
@@ -59,6 +70,34 @@ const int LED_COIL = 1;
 
 const int CONFIG_ENABLE_HREG = 0;
 const int CONFIG_ADDRESS_HREG = 1;
+const int CONFIG_SERIAL_HREG = 2;
+const int HISTORY_CURSOR_HREG = 3;
+
+/* Serial line configuration, always 8 data bits:
+ * bits 0-3 .. baud rate, index to serial_bauds[]
+ * bits 4-5 .. parity, 0 none, 1 even, 2 odd
+ * bit 6    .. two stop bits
+ */
+#define SERIAL_CONFIG_BAUD(config) ((config) & 0x0f)
+#define SERIAL_CONFIG_PARITY(config) (((config) >> 4) & 0x03)
+#define SERIAL_CONFIG_PARITY_NONE 0
+#define SERIAL_CONFIG_PARITY_EVEN 1
+#define SERIAL_CONFIG_PARITY_ODD 2
+#define SERIAL_CONFIG_STOP2 0x40
+#define SERIAL_CONFIG_MASK 0x7f
+
+/* All of them are within 2.1 % at 16 MHz, the last three exactly. */
+static const uint32_t serial_bauds[] PROGMEM = {
+	1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200,
+	250000, 500000, 1000000,
+};
+
+static bool serial_config_valid(word config)
+{
+	return !(config & ~SERIAL_CONFIG_MASK) &&
+	       SERIAL_CONFIG_BAUD(config) < ARRAY_SIZE(serial_bauds) &&
+	       SERIAL_CONFIG_PARITY(config) <= SERIAL_CONFIG_PARITY_ODD;
+}
 
 #define VALUE_VALID_MAGIC 0
 #define VALUE_INVALID_MAGIC 0xffff
@@ -96,151 +135,709 @@ const int SHT31_HUMIDITY_IREG = 27;
 const int SHT31_HUMIDITY_HI_IREG = 28;
 const int SHT31_HUMIDITY_LO_IREG = 29;
 
+/* History window, starting at the sample the cursor register points to. */
+const int HISTORY_FIRST_IREG = 100;
+const int HISTORY_COUNT_IREG = 101;
+const int HISTORY_LOST_IREG = 102;
+const int HISTORY_SIZE_IREG = 103;
+const int HISTORY_SAMPLES_IREG = 104;
+
+#define HISTORY_SAMPLE_IREGS 5 /* age, CO2, temperature, humidity, pressure */
+#define HISTORY_WINDOW_SAMPLES 24
+#define HISTORY_IREGS_END \
+	(HISTORY_SAMPLES_IREG + HISTORY_SAMPLE_IREGS * HISTORY_WINDOW_SAMPLES)
+
+#define MB_COILS_COUNT (LED_COIL + 1)
+#define MB_HREGS_COUNT (HISTORY_CURSOR_HREG + 1)
+#define MB_IREGS_COUNT (SHT31_HUMIDITY_LO_IREG + 1)
+
+static bool mb_coils[MB_COILS_COUNT];
+static word mb_hregs[MB_HREGS_COUNT];
+
+/* Input registers are published like a seqlock, except that the sequence
+ * count picks one of two copies: a writer fills the copy not in use and
+ * bumps the count once it is done. The reader is the RTU interrupt, which
+ * cannot retry while the writer it interrupted is halfway through, this
+ * way it never sees that copy at all. A whole sensor block goes out in
+ * a single update, so no master reads a float with only one word new.
+ */
+static word mb_iregs[2][MB_IREGS_COUNT];
+static volatile uint8_t mb_iregs_seq;
+
 static byte mb_address;
+static word mb_serial_config;
+static bool mb_serial_config_changed;
 
 //#define SERIAL_DEBUG
 
-#ifdef SERIAL_DEBUG
-class ModbusSerial {
-    public:
-        ModbusSerial();
-
-        void addHreg(word offset, word value = 0);
-        bool Hreg(word offset, word value);
-        word Hreg(word offset);
+static const word *mb_iregs_get(void)
+{
+	return mb_iregs[mb_iregs_seq & 1];
+}
 
-        void addCoil(word offset, bool value = false);
-        void addIreg(word offset, word value = 0);
+static word *mb_iregs_update_begin(void)
+{
+	uint8_t seq = mb_iregs_seq;
+	word *regs = mb_iregs[(seq + 1) & 1];
 
-        bool Ireg(word offset, word value);
+	memcpy(regs, mb_iregs[seq & 1], sizeof(mb_iregs[0]));
+	return regs;
+}
 
-        bool Coil(word offset);
-};
-ModbusSerial::ModbusSerial()
+static void mb_iregs_update_end(void)
 {
+	/* Disabling interrupts also keeps the writes above before the flip. */
+	noInterrupts();
+	mb_iregs_seq++;
+	interrupts();
 }
 
-void ModbusSerial::addHreg(word offset, word value)
+static void mb_ireg_set(word *regs, word offset, word value)
 {
-	if (offset == CONFIG_ADDRESS_HREG)
-		mb_address = value;
-	Serial.print("add Hreg ");
+	regs[offset] = value;
+#ifdef SERIAL_DEBUG
+	Serial.print("set Ireg ");
 	Serial.print(offset);
 	Serial.print(", value ");
 	Serial.println(value);
+#endif
 }
 
-bool ModbusSerial::Hreg(word offset, word value)
+/* Samples taken with every SCD30 measurement, so a master polling less
+ * often than that still gets all of them. The buffer gets whatever SRAM
+ * is left after setup(), except for a reserve for the stack.
+ */
+#define HISTORY_STACK_RESERVE 384 /* bytes */
+#define HISTORY_SIZE_MAX 1024
+
+struct history_sample {
+	word time; /* s since boot */
+	word co2;
+	word temperature;
+	word humidity;
+	word pressure;
+};
+
+static struct history_sample *history;
+static word history_size;
+static word history_head; /* slot the next sample goes to */
+static word history_count;
+static word history_seq; /* sequence number of the next sample */
+
+static size_t sram_free(void)
 {
-	if (offset == CONFIG_ADDRESS_HREG)
-		mb_address = value;
-	return true;
+	extern char __heap_start, *__brkval;
+	char top;
+
+	return &top - (__brkval ? __brkval : &__heap_start);
 }
 
-word ModbusSerial::Hreg(word offset)
+static void history_init(void)
 {
-	if (offset == CONFIG_ADDRESS_HREG)
-		return mb_address;
-	return 0;
+	size_t size = sram_free();
+
+	if (size <= HISTORY_STACK_RESERVE)
+		return;
+	size = (size - HISTORY_STACK_RESERVE) / sizeof(*history);
+	if (size > HISTORY_SIZE_MAX)
+		size = HISTORY_SIZE_MAX;
+	history = (struct history_sample *) malloc(size * sizeof(*history));
+	if (history)
+		history_size = size;
 }
 
-void ModbusSerial::addCoil(word offset, bool value)
+static word history_value(const word *regs, word offset, word valid_offset)
 {
-	Serial.print("add Coil ");
-	Serial.print(offset);
-	Serial.print(", value ");
-	Serial.println(value);
+	if (regs[valid_offset] != VALUE_VALID_MAGIC)
+		return VALUE_INVALID_MAGIC;
+	return regs[offset];
 }
 
-void ModbusSerial::addIreg(word offset, word value)
+static void history_sample_take(void)
 {
-	Serial.print("add Ireg ");
-	Serial.print(offset);
-	Serial.print(", value ");
-	Serial.println(value);
+	const word *regs = mb_iregs_get();
+	struct history_sample sample;
+
+	if (!history_size)
+		return;
+	sample.time = millis() / 1000;
+	sample.co2 = history_value(regs, SCD30_CO2_IREG, SCD30_CO2_VALID_IREG);
+	sample.temperature = history_value(regs, SCD30_TEMP_IREG,
+					   SCD30_TEMP_VALID_IREG);
+	sample.humidity = history_value(regs, SCD30_HUMIDITY_IREG,
+					SCD30_HUMIDITY_VALID_IREG);
+	sample.pressure = history_value(regs, BME280_PRESSURE_IREG,
+					BME280_PRESSURE_VALID_IREG);
+
+	history[history_head] = sample;
+	history_head = (history_head + 1) % history_size;
+	if (history_count < history_size)
+		history_count++;
+	history_seq++;
 }
 
-bool ModbusSerial::Ireg(word offset, word value)
+#define TXPIN 2 /* RS485 module DE and RE */
+
+#ifndef SERIAL_DEBUG
+/* Modbus RTU slave running directly on USART0, so Serial must not be used
+ * anywhere as it comes with its own interrupt handlers.
+ *
+ * The RX interrupt collects a frame and every byte restarts Timer1, which
+ * fires after 3.5 character times of silence and hands the frame over to
+ * loop(), or answers it on its own for input registers. The reply is fed
+ * by the UDRE interrupt and the TXC interrupt releases the RS485 driver as
+ * soon as the last stop bit is out.
+ */
+#define MB_RTU_FRAME_MAX 256
+#define MB_RTU_FRAME_MIN 4 /* address, function code and CRC */
+#define MB_RTU_BROADCAST 0
+
+enum mb_rtu_state {
+	MB_RTU_STATE_RX,
+	MB_RTU_STATE_FRAME, /* complete frame waiting for loop() */
+	MB_RTU_STATE_TX,
+};
+
+static volatile enum mb_rtu_state mb_rtu_state;
+static volatile bool mb_rtu_rx_bad; /* drop the frame being received */
+static volatile word mb_rtu_len;
+static volatile word mb_rtu_tx_pos;
+static uint8_t mb_rtu_frame[MB_RTU_FRAME_MAX];
+
+static void mb_rtu_t35_restart(void)
 {
-	Serial.print("set Ireg ");
-	Serial.print(offset);
-	Serial.print(", value ");
-	Serial.println(value);
-	return true;
+	TCNT1 = 0;
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 |= _BV(OCIE1A);
 }
 
-bool ModbusSerial::Coil(word offset)
+ISR(USART_RX_vect)
 {
-	return true;
+	uint8_t status = UCSR0A;
+	uint8_t c = UDR0;
+
+	mb_rtu_t35_restart();
+	/* Bytes coming in while the previous frame is still being processed
+	 * belong to a frame which is not going to be complete.
+	 */
+	if (status & (_BV(FE0) | _BV(DOR0) | _BV(UPE0)) ||
+	    mb_rtu_state != MB_RTU_STATE_RX || mb_rtu_len == MB_RTU_FRAME_MAX)
+		mb_rtu_rx_bad = true;
+	if (mb_rtu_rx_bad)
+		return;
+	mb_rtu_frame[mb_rtu_len++] = c;
 }
-#else
-#include <ModbusSerial.h>
-#endif
 
-ModbusSerial mb;
+ISR(USART_UDRE_vect)
+{
+	UDR0 = mb_rtu_frame[mb_rtu_tx_pos++];
+	if (mb_rtu_tx_pos < mb_rtu_len)
+		return;
+	/* The last byte is in, wait for it to leave the shift register. */
+	UCSR0B = (UCSR0B & ~_BV(UDRIE0)) | _BV(TXCIE0);
+}
+
+ISR(USART_TX_vect)
+{
+	digitalWrite(TXPIN, LOW);
+	UCSR0B = (UCSR0B & ~_BV(TXCIE0)) | _BV(RXEN0);
+	mb_rtu_len = 0;
+	mb_rtu_rx_bad = false;
+	mb_rtu_state = MB_RTU_STATE_RX;
+}
+
+static void mb_rtu_begin(word config)
+{
+	uint32_t baud = pgm_read_dword(&serial_bauds[SERIAL_CONFIG_BAUD(config)]);
+	uint8_t ucsrc = _BV(UCSZ01) | _BV(UCSZ00);
+	unsigned long t35;
+
+	switch (SERIAL_CONFIG_PARITY(config)) {
+	case SERIAL_CONFIG_PARITY_EVEN:
+		ucsrc |= _BV(UPM01);
+		break;
+	case SERIAL_CONFIG_PARITY_ODD:
+		ucsrc |= _BV(UPM01) | _BV(UPM00);
+		break;
+	}
+	if (config & SERIAL_CONFIG_STOP2)
+		ucsrc |= _BV(USBS0);
+
+	/* 3.5 characters of 11 bits, the specification fixes it to 1750 us
+	 * above 19200 Bd. 32 ms at 1200 Bd still fits Timer1 at clk/8.
+	 */
+	if (baud > 19200)
+		t35 = 1750;
+	else
+		t35 = 38500000UL / baud;
+
+	noInterrupts();
+	UCSR0B = 0;
+	UCSR0A = _BV(U2X0);
+	UBRR0 = (F_CPU / 4 / baud - 1) / 2;
+	UCSR0C = ucsrc;
+	UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+	TIMSK1 = 0;
+	TCCR1A = 0;
+	TCCR1B = _BV(WGM12) | _BV(CS11); /* CTC, clk/8 */
+	OCR1A = t35 * (F_CPU / 8 / 1000000) - 1;
+	mb_rtu_len = 0;
+	mb_rtu_rx_bad = false;
+	mb_rtu_state = MB_RTU_STATE_RX;
+	interrupts();
+}
+
+static void mb_rtu_init(word config)
+{
+	pinMode(TXPIN, OUTPUT);
+	digitalWrite(TXPIN, LOW);
+	mb_rtu_begin(config);
+}
+
+/* Called with interrupts disabled. */
+static void __mb_rtu_tx_start(word len)
+{
+	mb_rtu_len = len;
+	mb_rtu_tx_pos = 0;
+	mb_rtu_state = MB_RTU_STATE_TX;
+	UCSR0B &= ~_BV(RXEN0);
+	digitalWrite(TXPIN, HIGH);
+	UCSR0A |= _BV(TXC0);
+	UCSR0B |= _BV(UDRIE0);
+}
+
+static void mb_rtu_tx_start(word len)
+{
+	noInterrupts();
+	__mb_rtu_tx_start(len);
+	interrupts();
+}
+
+static void mb_rtu_rx_restart(void)
+{
+	noInterrupts();
+	mb_rtu_len = 0;
+	mb_rtu_state = MB_RTU_STATE_RX;
+	interrupts();
+}
+
+#define MB_PDU_MAX 253
+
+#define MB_FC_READ_COILS 0x01
+#define MB_FC_READ_REGS 0x03
+#define MB_FC_READ_INPUT_REGS 0x04
+#define MB_FC_WRITE_COIL 0x05
+#define MB_FC_WRITE_REG 0x06
+#define MB_FC_WRITE_COILS 0x0F
+#define MB_FC_WRITE_REGS 0x10
+
+#define MB_EX_ILLEGAL_FUNCTION 0x01
+#define MB_EX_ILLEGAL_ADDRESS 0x02
+#define MB_EX_ILLEGAL_VALUE 0x03
+
+#define MB_READ_BITS_MAX 2000
+#define MB_READ_REGS_MAX 125
+#define MB_WRITE_BITS_MAX 1968
+#define MB_WRITE_REGS_MAX 123
+
+static word mb_word_get(const uint8_t *buf)
+{
+	return (buf[0] << 8) | buf[1];
+}
+
+static void mb_word_put(uint8_t *buf, word val)
+{
+	buf[0] = val >> 8;
+	buf[1] = val & 0xff;
+}
+
+static uint8_t mb_exception(uint8_t *pdu, uint8_t code)
+{
+	pdu[0] |= 0x80;
+	pdu[1] = code;
+	return 2;
+}
+
+static bool mb_range_valid(word start, word count, word max)
+{
+	return (unsigned long) start + count <= max;
+}
+
+/* The PDU buffer is reused for the reply, all replies fit into MB_PDU_MAX. */
+
+static uint8_t mb_coils_read(uint8_t *pdu, uint8_t len)
+{
+	uint8_t *out = &pdu[2];
+	word start, count;
+	unsigned int i;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_READ_BITS_MAX)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, MB_COILS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	pdu[1] = (count + 7) / 8;
+	memset(out, 0, pdu[1]);
+	for (i = 0; i < count; i++)
+		if (mb_coils[start + i])
+			bitSet(out[i / 8], i % 8);
+	return 2 + pdu[1];
+}
+
+static uint8_t mb_regs_read(uint8_t *pdu, uint8_t len,
+			    const word *regs, word max)
+{
+	word start, count;
+	unsigned int i;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_READ_REGS_MAX)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, max))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	pdu[1] = count * 2;
+	for (i = 0; i < count; i++)
+		mb_word_put(&pdu[2 + i * 2], regs[start + i]);
+	return 2 + pdu[1];
+}
+
+static word mb_history_field(const struct history_sample *sample,
+			     uint8_t field, word now)
+{
+	switch (field) {
+	case 0:
+		return now - sample->time;
+	case 1:
+		return sample->co2;
+	case 2:
+		return sample->temperature;
+	case 3:
+		return sample->humidity;
+	default:
+		return sample->pressure;
+	}
+}
+
+/* Samples the cursor has not moved past yet, the ones already overwritten
+ * are reported as lost. Sequence numbers wrap around. The window is walked
+ * sample by sample from the first slot, so there is no division per
+ * register.
+ */
+static uint8_t mb_history_read(uint8_t *pdu, uint8_t len)
+{
+	word start, count, addr;
+	word first, avail, lost = 0;
+	word index = 0, slot = 0, now;
+	uint8_t field = 0;
+	unsigned int i;
+	word val;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_READ_REGS_MAX)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, HISTORY_IREGS_END))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	avail = history_seq - mb_hregs[HISTORY_CURSOR_HREG];
+	if (avail > history_count) {
+		lost = avail - history_count;
+		avail = history_count;
+	}
+	first = history_seq - avail;
+	if (avail > HISTORY_WINDOW_SAMPLES)
+		avail = HISTORY_WINDOW_SAMPLES;
+	now = millis() / 1000;
+	if (start + count > HISTORY_SAMPLES_IREG) {
+		addr = start > HISTORY_SAMPLES_IREG ?
+		       start - HISTORY_SAMPLES_IREG : 0;
+		index = addr / HISTORY_SAMPLE_IREGS;
+		field = addr % HISTORY_SAMPLE_IREGS;
+		if (index < avail)
+			slot = (history_head + history_size -
+				(word) (history_seq - first - index)) %
+			       history_size;
+	}
+	pdu[1] = count * 2;
+	for (i = 0; i < count; i++) {
+		addr = start + i;
+		switch (addr) {
+		case HISTORY_FIRST_IREG:
+			val = first;
+			break;
+		case HISTORY_COUNT_IREG:
+			val = avail;
+			break;
+		case HISTORY_LOST_IREG:
+			val = lost;
+			break;
+		case HISTORY_SIZE_IREG:
+			val = history_size;
+			break;
+		default:
+			if (index >= avail) {
+				val = VALUE_INVALID_MAGIC;
+				break;
+			}
+			val = mb_history_field(&history[slot], field, now);
+			if (++field < HISTORY_SAMPLE_IREGS)
+				break;
+			field = 0;
+			index++;
+			if (++slot == history_size)
+				slot = 0;
+		}
+		mb_word_put(&pdu[2 + i * 2], val);
+	}
+	return 2 + pdu[1];
+}
+
+static uint8_t mb_coil_write(uint8_t *pdu, uint8_t len)
+{
+	word addr, val;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	addr = mb_word_get(&pdu[1]);
+	val = mb_word_get(&pdu[3]);
+	if (val != 0xff00 && val != 0x0000)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(addr, 1, MB_COILS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	mb_coils[addr] = val == 0xff00;
+	return len; /* echo the request */
+}
+
+static uint8_t mb_reg_write(uint8_t *pdu, uint8_t len)
+{
+	word addr;
+
+	if (len != 5)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	addr = mb_word_get(&pdu[1]);
+	if (!mb_range_valid(addr, 1, MB_HREGS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	mb_hregs[addr] = mb_word_get(&pdu[3]);
+	return len; /* echo the request */
+}
+
+static uint8_t mb_coils_write(uint8_t *pdu, uint8_t len)
+{
+	const uint8_t *in = &pdu[6];
+	word start, count;
+	unsigned int i;
+
+	if (len < 6)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_WRITE_BITS_MAX ||
+	    pdu[5] != (count + 7) / 8 || len != 6 + pdu[5])
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, MB_COILS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	for (i = 0; i < count; i++)
+		mb_coils[start + i] = bitRead(in[i / 8], i % 8);
+	return 5; /* function code, start and count */
+}
+
+static uint8_t mb_regs_write(uint8_t *pdu, uint8_t len)
+{
+	word start, count;
+	unsigned int i;
+
+	if (len < 6)
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	start = mb_word_get(&pdu[1]);
+	count = mb_word_get(&pdu[3]);
+	if (!count || count > MB_WRITE_REGS_MAX ||
+	    pdu[5] != count * 2 || len != 6 + pdu[5])
+		return mb_exception(pdu, MB_EX_ILLEGAL_VALUE);
+	if (!mb_range_valid(start, count, MB_HREGS_COUNT))
+		return mb_exception(pdu, MB_EX_ILLEGAL_ADDRESS);
+	for (i = 0; i < count; i++)
+		mb_hregs[start + i] = mb_word_get(&pdu[6 + i * 2]);
+	return 5; /* function code, start and count */
+}
+
+static uint8_t mb_pdu_process(uint8_t *pdu, uint8_t len)
+{
+	switch (pdu[0]) {
+	case MB_FC_READ_COILS:
+		return mb_coils_read(pdu, len);
+	case MB_FC_READ_REGS:
+		return mb_regs_read(pdu, len, mb_hregs, MB_HREGS_COUNT);
+	case MB_FC_READ_INPUT_REGS:
+		if (len == 5 && mb_word_get(&pdu[1]) >= HISTORY_FIRST_IREG)
+			return mb_history_read(pdu, len);
+		return mb_regs_read(pdu, len, mb_iregs_get(), MB_IREGS_COUNT);
+	case MB_FC_WRITE_COIL:
+		return mb_coil_write(pdu, len);
+	case MB_FC_WRITE_REG:
+		return mb_reg_write(pdu, len);
+	case MB_FC_WRITE_COILS:
+		return mb_coils_write(pdu, len);
+	case MB_FC_WRITE_REGS:
+		return mb_regs_write(pdu, len);
+	default:
+		return mb_exception(pdu, MB_EX_ILLEGAL_FUNCTION);
+	}
+}
+
+static word mb_crc16(const uint8_t *buf, word len)
+{
+	word crc = 0xffff;
+	uint8_t i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+	}
+	return crc;
+}
+
+/* Returns the length of the reply to send, 0 for none. */
+static word mb_rtu_frame_process(uint8_t *frame, word len)
+{
+	uint8_t address = frame[0];
+	word crc;
+
+	if (address != mb_address && address != MB_RTU_BROADCAST)
+		return 0;
+	crc = mb_crc16(frame, len - 2);
+	if (frame[len - 2] != (crc & 0xff) || frame[len - 1] != crc >> 8)
+		return 0;
+	len = 1 + mb_pdu_process(&frame[1], len - 3);
+	/* Broadcasts are carried out, but never answered. */
+	if (address == MB_RTU_BROADCAST)
+		return 0;
+	crc = mb_crc16(frame, len);
+	frame[len++] = crc & 0xff;
+	frame[len++] = crc >> 8;
+	return len;
+}
+
+/* Frames for other slaves on the bus are dropped right here, so the
+ * receiver is ready for the next request no matter what loop() is busy
+ * with. Input register reads are answered right away from the interrupt
+ * too. They only read the published copy of mb_iregs. The rest, including
+ * all the writes, broadcasts and history reads, is left to loop().
+ */
+static void mb_rtu_frame_done(void)
+{
+	word len;
+
+	if (mb_rtu_frame[0] != mb_address &&
+	    mb_rtu_frame[0] != MB_RTU_BROADCAST) {
+		mb_rtu_len = 0;
+		return;
+	}
+	if (mb_rtu_frame[0] != mb_address ||
+	    mb_rtu_frame[1] != MB_FC_READ_INPUT_REGS ||
+	    mb_word_get(&mb_rtu_frame[2]) >= HISTORY_FIRST_IREG) {
+		mb_rtu_state = MB_RTU_STATE_FRAME;
+		return;
+	}
+	len = mb_rtu_frame_process(mb_rtu_frame, mb_rtu_len);
+	if (len)
+		__mb_rtu_tx_start(len);
+	else
+		mb_rtu_len = 0;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	TIMSK1 &= ~_BV(OCIE1A);
+	if (mb_rtu_state == MB_RTU_STATE_RX) {
+		if (!mb_rtu_rx_bad && mb_rtu_len >= MB_RTU_FRAME_MIN)
+			mb_rtu_frame_done();
+		else
+			mb_rtu_len = 0;
+	}
+	mb_rtu_rx_bad = false;
+}
+
+static void mb_task(void)
+{
+	enum mb_rtu_state state;
+	word len;
+
+	noInterrupts();
+	state = mb_rtu_state;
+	len = mb_rtu_len;
+	interrupts();
+
+	/* A new serial configuration is applied between frames, after the
+	 * reply to the write which changed it went out.
+	 */
+	if (mb_serial_config_changed && state == MB_RTU_STATE_RX && !len) {
+		mb_serial_config_changed = false;
+		mb_rtu_begin(mb_serial_config);
+		return;
+	}
+
+	if (state != MB_RTU_STATE_FRAME)
+		return;
+	len = mb_rtu_frame_process(mb_rtu_frame, len);
+	if (len)
+		mb_rtu_tx_start(len);
+	else
+		mb_rtu_rx_restart();
+}
+#endif
 
 const int sensorPin = A0;
 
-#define TXPIN 2
 #define LED_BUILTIN 13
 
 void setup()
 {
+	word *regs;
+
 	pinMode(LED_BUILTIN, OUTPUT);
 
 	eeprom_check();
 
 	EEPROM.get(EEPROM_ADDRESS_OFFSET, mb_address);
+	EEPROM.get(EEPROM_SERIAL_CONFIG_OFFSET, mb_serial_config);
+	/* Not there in EEPROM written by older versions. */
+	if (!serial_config_valid(mb_serial_config))
+		mb_serial_config = eeprom_default_serial_config;
+
+	mb_hregs[CONFIG_ADDRESS_HREG] = mb_address;
+	mb_hregs[CONFIG_SERIAL_HREG] = mb_serial_config;
+
+	regs = mb_iregs_update_begin();
+	mb_ireg_set(regs, SCD30_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
+	mb_ireg_set(regs, SCD30_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
+	mb_ireg_set(regs, SCD30_CO2_VALID_IREG, VALUE_INVALID_MAGIC);
+	mb_ireg_set(regs, BME280_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
+	mb_ireg_set(regs, BME280_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
+	mb_ireg_set(regs, BME280_PRESSURE_VALID_IREG, VALUE_INVALID_MAGIC);
+	mb_ireg_set(regs, SHT31_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
+	mb_ireg_set(regs, SHT31_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
+	mb_iregs_update_end();
 
 #ifdef SERIAL_DEBUG
 	Serial.begin(9600);
 #else
-	mb.config(&Serial, 9600, SERIAL_8N1, TXPIN);
-	mb.setSlaveId(mb_address);
+	mb_rtu_init(mb_serial_config);
 #endif
 
-	mb.addHreg(CONFIG_ENABLE_HREG);
-	mb.addHreg(CONFIG_ADDRESS_HREG, mb_address);
-
-	mb.addIreg(SCD30_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
-	mb.addIreg(SCD30_TEMP_IREG);
-	mb.addIreg(SCD30_TEMP_HI_IREG);
-	mb.addIreg(SCD30_TEMP_LO_IREG);
-	mb.addIreg(SCD30_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
-	mb.addIreg(SCD30_HUMIDITY_IREG);
-	mb.addIreg(SCD30_HUMIDITY_HI_IREG);
-	mb.addIreg(SCD30_HUMIDITY_LO_IREG);
-	mb.addIreg(SCD30_CO2_VALID_IREG, VALUE_INVALID_MAGIC);
-	mb.addIreg(SCD30_CO2_IREG);
-
-	mb.addIreg(BME280_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
-	mb.addIreg(BME280_TEMP_IREG);
-	mb.addIreg(BME280_TEMP_HI_IREG);
-	mb.addIreg(BME280_TEMP_LO_IREG);
-	mb.addIreg(BME280_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
-	mb.addIreg(BME280_HUMIDITY_IREG);
-	mb.addIreg(BME280_HUMIDITY_HI_IREG);
-	mb.addIreg(BME280_HUMIDITY_LO_IREG);
-	mb.addIreg(BME280_PRESSURE_VALID_IREG, VALUE_INVALID_MAGIC);
-	mb.addIreg(BME280_PRESSURE_IREG);
-	mb.addIreg(BME280_PRESSURE_HI_IREG);
-	mb.addIreg(BME280_PRESSURE_LO_IREG);
-
-	mb.addIreg(SHT31_TEMP_VALID_IREG);
-	mb.Ireg(SHT31_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
-	mb.addIreg(SHT31_TEMP_IREG);
-	mb.addIreg(SHT31_TEMP_HI_IREG);
-	mb.addIreg(SHT31_TEMP_LO_IREG);
-	mb.addIreg(SHT31_HUMIDITY_VALID_IREG);
-	mb.Ireg(SHT31_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
-	mb.addIreg(SHT31_HUMIDITY_IREG);
-	mb.addIreg(SHT31_HUMIDITY_HI_IREG);
-	mb.addIreg(SHT31_HUMIDITY_LO_IREG);
-
-	mb.addCoil(LED_COIL);
-
 	Wire.begin();
+#ifdef I2C_FAST_MODE
+	Wire.setClock(400000);
+#else
 	Wire.setClock(100000);
+#endif
 
 	scd30.begin();
 	scd30.setMeasurementInterval(5);
@@ -250,158 +847,283 @@ void setup()
 
 	sht31.begin(0x44);
 
+	history_init();
 }
 
-static void Iregs_int_set(word int_offset, word valid_offset, uint16_t value)
+/* These only fill the copy from mb_iregs_update_begin(). */
+
+static void Iregs_int_set(word *regs, word int_offset, word valid_offset,
+			  uint16_t value)
 {
-	mb.Ireg(valid_offset, VALUE_VALID_MAGIC);
-	mb.Ireg(int_offset, value);
+	mb_ireg_set(regs, valid_offset, VALUE_VALID_MAGIC);
+	mb_ireg_set(regs, int_offset, value);
 }
 
-static void Iregs_float_set(word hi_offset, word lo_offset, word int_offset,
-			    word valid_offset, float value)
+static void Iregs_float_set(word *regs, word hi_offset, word lo_offset,
+			    word int_offset, word valid_offset, float value)
 {
 	uint32_t *tmp;
 
-	mb.Ireg(valid_offset, VALUE_VALID_MAGIC);
-	mb.Ireg(int_offset, (int) (value * 10));
+	mb_ireg_set(regs, valid_offset, VALUE_VALID_MAGIC);
+	mb_ireg_set(regs, int_offset, (int) (value * 10));
 	tmp = (uint32_t *) &value;
-	mb.Ireg(hi_offset, (*tmp) >> 16);
-	mb.Ireg(lo_offset, (*tmp) && 0xFFFF);
+	mb_ireg_set(regs, hi_offset, (*tmp) >> 16);
+	mb_ireg_set(regs, lo_offset, (*tmp) & 0xFFFF);
+}
+
+#define MEASURE_INTERVAL 5000 /* ms */
+
+static bool measure_due(unsigned long *last_measurement)
+{
+	unsigned long now = millis();
+
+	if (now - *last_measurement < MEASURE_INTERVAL)
+		return false;
+	*last_measurement = now;
+	return true;
 }
 
+/* Each sensor is a small state machine which does at most one I2C
+ * transaction per step. loop() runs one step of one sensor per pass,
+ * so mb_task() never waits for more than a single transaction.
+ */
+
 static int voidmeasures = 0;
 #define VOIDMEASURES_NUM 2
 
-static void scd30_process(void)
+enum scd30_state {
+	SCD30_STATE_IDLE,
+	SCD30_STATE_CHECK,
+	SCD30_STATE_READ,
+};
+
+static enum scd30_state scd30_state;
+static unsigned long scd30_last_measurement;
+
+static void scd30_step(void)
 {
+	word *regs;
 	float temperature;
 	float humidity;
 	uint16_t co2;
 
-	if (!scd30.dataAvailable()) {
-		mb.Ireg(SCD30_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
-		mb.Ireg(SCD30_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
-		mb.Ireg(SCD30_CO2_VALID_IREG, VALUE_INVALID_MAGIC);
-		voidmeasures = 0;
+	switch (scd30_state) {
+	case SCD30_STATE_IDLE:
+		if (!measure_due(&scd30_last_measurement))
+			return;
+		scd30_state = SCD30_STATE_CHECK;
+		/* fall through */
+	case SCD30_STATE_CHECK:
+		if (!scd30.dataAvailable()) {
+			regs = mb_iregs_update_begin();
+			mb_ireg_set(regs, SCD30_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
+			mb_ireg_set(regs, SCD30_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
+			mb_ireg_set(regs, SCD30_CO2_VALID_IREG, VALUE_INVALID_MAGIC);
+			mb_iregs_update_end();
+			history_sample_take();
+			voidmeasures = 0;
+			scd30_state = SCD30_STATE_IDLE;
+			return;
+		}
+		scd30_state = SCD30_STATE_READ;
 		return;
-	}
-
-	co2 = scd30.getCO2();
-	temperature = scd30.getTemperature();
-	humidity = scd30.getHumidity();
-
-	if (voidmeasures < VOIDMEASURES_NUM) {
-		voidmeasures++;
+	case SCD30_STATE_READ:
+		/* getCO2() reads the whole measurement, the other two
+		 * return what it got.
+		 */
+		co2 = scd30.getCO2();
+		temperature = scd30.getTemperature();
+		humidity = scd30.getHumidity();
+		scd30_state = SCD30_STATE_IDLE;
+
+		if (voidmeasures < VOIDMEASURES_NUM) {
+			voidmeasures++;
+			return;
+		}
+
+		regs = mb_iregs_update_begin();
+		Iregs_float_set(regs, SCD30_TEMP_HI_IREG, SCD30_TEMP_LO_IREG,
+				SCD30_TEMP_IREG, SCD30_TEMP_VALID_IREG,
+				temperature);
+		Iregs_float_set(regs, SCD30_HUMIDITY_HI_IREG, SCD30_HUMIDITY_LO_IREG,
+				SCD30_HUMIDITY_IREG, SCD30_HUMIDITY_VALID_IREG,
+				humidity);
+		Iregs_int_set(regs, SCD30_CO2_IREG, SCD30_CO2_VALID_IREG, co2);
+		mb_iregs_update_end();
+		history_sample_take();
 		return;
 	}
-
-	Iregs_float_set(SCD30_TEMP_HI_IREG, SCD30_TEMP_LO_IREG,
-			SCD30_TEMP_IREG, SCD30_TEMP_VALID_IREG,
-			temperature);
-	Iregs_float_set(SCD30_HUMIDITY_HI_IREG, SCD30_HUMIDITY_LO_IREG,
-			SCD30_HUMIDITY_IREG, SCD30_HUMIDITY_VALID_IREG,
-			humidity);
-	Iregs_int_set(SCD30_CO2_IREG, SCD30_CO2_VALID_IREG, co2);
 }
 
+enum bme280_state {
+	BME280_STATE_IDLE,
+	BME280_STATE_CHECK,
+	BME280_STATE_READ_PRESSURE,
+	BME280_STATE_READ_TEMP,
+	BME280_STATE_SCD30_PRESSURE,
+};
+
+static enum bme280_state bme280_state;
+static unsigned long bme280_last_measurement;
+static float bme280_pressure;
 
-static void bme280_process(void)
+static void bme280_step(void)
 {
+	word *regs;
 	float temperature;
-//	float humidity;
-	float pressure;
 
-	if (!bme280.isMeasuring()) {
-		mb.Ireg(BME280_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
-		mb.Ireg(BME280_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
-		mb.Ireg(BME280_PRESSURE_VALID_IREG, VALUE_INVALID_MAGIC);
+	switch (bme280_state) {
+	case BME280_STATE_IDLE:
+		if (!measure_due(&bme280_last_measurement))
+			return;
+		bme280_state = BME280_STATE_CHECK;
+		/* fall through */
+	case BME280_STATE_CHECK:
+		if (!bme280.isMeasuring()) {
+			regs = mb_iregs_update_begin();
+			mb_ireg_set(regs, BME280_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
+			mb_ireg_set(regs, BME280_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
+			mb_ireg_set(regs, BME280_PRESSURE_VALID_IREG, VALUE_INVALID_MAGIC);
+			mb_iregs_update_end();
+			bme280_state = BME280_STATE_IDLE;
+			return;
+		}
+		bme280_state = BME280_STATE_READ_PRESSURE;
+		return;
+	case BME280_STATE_READ_PRESSURE:
+		bme280_pressure = bme280.readFloatPressure() / 100.0F;
+		bme280_state = BME280_STATE_READ_TEMP;
+		return;
+	case BME280_STATE_READ_TEMP:
+		temperature = bme280.readTempC();
+		bme280_state = BME280_STATE_SCD30_PRESSURE;
+
+		regs = mb_iregs_update_begin();
+		Iregs_float_set(regs, BME280_TEMP_HI_IREG, BME280_TEMP_LO_IREG,
+				BME280_TEMP_IREG, BME280_TEMP_VALID_IREG,
+				temperature);
+		Iregs_float_set(regs, BME280_PRESSURE_HI_IREG, BME280_PRESSURE_LO_IREG,
+				BME280_PRESSURE_IREG, BME280_PRESSURE_VALID_IREG,
+				bme280_pressure);
+		mb_iregs_update_end();
+		return;
+	case BME280_STATE_SCD30_PRESSURE:
+		scd30.setAmbientPressure((uint16_t) bme280_pressure);
+		bme280_state = BME280_STATE_IDLE;
 		return;
 	}
-	pressure = bme280.readFloatPressure() / 100.0F;
-	temperature = bme280.readTempC();
-//	humidity = bme280.readFloatHumidity();
-
-	scd30.setAmbientPressure((uint16_t) pressure);
-
-	Iregs_float_set(BME280_TEMP_HI_IREG, BME280_TEMP_LO_IREG,
-			BME280_TEMP_IREG, BME280_TEMP_VALID_IREG,
-			temperature);
-//	Iregs_float_set(BME280_HUMIDITY_HI_IREG, BME280_HUMIDITY_LO_IREG,
-//			BME280_HUMIDITY_IREG, BME280_HUMIDITY_VALID_IREG,
-//			humidity);
-	Iregs_float_set(BME280_PRESSURE_HI_IREG, BME280_PRESSURE_LO_IREG,
-			BME280_PRESSURE_IREG, BME280_PRESSURE_VALID_IREG,
-			pressure);
 }
 
 #define SHT31_INVALID_TEMP 130
 
-static void sht31_process(void)
+enum sht31_state {
+	SHT31_STATE_IDLE,
+	SHT31_STATE_READ,
+	SHT31_STATE_REQUEST,
+};
+
+static enum sht31_state sht31_state;
+static unsigned long sht31_last_measurement;
+
+static void sht31_step(void)
 {
+	word *regs;
 	float temperature;
 	float humidity;
 
-	if (!sht31.dataReady())
+	switch (sht31_state) {
+	case SHT31_STATE_IDLE:
+		if (!measure_due(&sht31_last_measurement))
+			return;
+		sht31_state = SHT31_STATE_READ;
+		/* fall through */
+	case SHT31_STATE_READ:
+		if (!sht31.dataReady()) {
+			sht31_state = SHT31_STATE_IDLE;
+			return;
+		}
+		sht31.readData();
+		sht31_state = SHT31_STATE_REQUEST;
 		return;
-
-	sht31.readData();
-	sht31.requestData();
-	temperature = sht31.getTemperature();
-	humidity = sht31.getHumidity();
-
-	if (temperature == SHT31_INVALID_TEMP) {
-		mb.Ireg(SHT31_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
-		mb.Ireg(SHT31_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
+	case SHT31_STATE_REQUEST:
+		sht31.requestData();
+		sht31_state = SHT31_STATE_IDLE;
+
+		temperature = sht31.getTemperature();
+		humidity = sht31.getHumidity();
+
+		if (temperature == SHT31_INVALID_TEMP) {
+			regs = mb_iregs_update_begin();
+			mb_ireg_set(regs, SHT31_TEMP_VALID_IREG, VALUE_INVALID_MAGIC);
+			mb_ireg_set(regs, SHT31_HUMIDITY_VALID_IREG, VALUE_INVALID_MAGIC);
+			mb_iregs_update_end();
+			return;
+		}
+
+		regs = mb_iregs_update_begin();
+		Iregs_float_set(regs, SHT31_TEMP_HI_IREG, SHT31_TEMP_LO_IREG,
+				SHT31_TEMP_IREG, SHT31_TEMP_VALID_IREG,
+				temperature);
+		Iregs_float_set(regs, SHT31_HUMIDITY_HI_IREG, SHT31_HUMIDITY_LO_IREG,
+				SHT31_HUMIDITY_IREG, SHT31_HUMIDITY_VALID_IREG,
+				humidity);
+		mb_iregs_update_end();
 		return;
 	}
-
-	Iregs_float_set(SHT31_TEMP_HI_IREG, SHT31_TEMP_LO_IREG,
-			SHT31_TEMP_IREG, SHT31_TEMP_VALID_IREG,
-			temperature);
-	Iregs_float_set(SHT31_HUMIDITY_HI_IREG, SHT31_HUMIDITY_LO_IREG,
-			SHT31_HUMIDITY_IREG, SHT31_HUMIDITY_VALID_IREG,
-			humidity);
 }
 
-#define MEASURE_INTERVAL 5000 /* ms */
+static void (*const sensor_steps[])(void) = {
+	scd30_step,
+	bme280_step,
+	sht31_step,
+};
+
+static uint8_t sensor_step_current;
+
+static void sensors_step(void)
+{
+	sensor_steps[sensor_step_current]();
+	sensor_step_current = (sensor_step_current + 1) % ARRAY_SIZE(sensor_steps);
+}
 
 static void check_mb_config_change(void)
 {
-	word new_address = mb.Hreg(CONFIG_ADDRESS_HREG);
+	word new_address = mb_hregs[CONFIG_ADDRESS_HREG];
+	word new_serial_config = mb_hregs[CONFIG_SERIAL_HREG];
 
-	config_enabled = mb.Hreg(CONFIG_ENABLE_HREG) == VALUE_CONFIG_ENABLE;
+	config_enabled = mb_hregs[CONFIG_ENABLE_HREG] == VALUE_CONFIG_ENABLE;
 
 	if (!config_enabled) {
-		mb.Hreg(CONFIG_ADDRESS_HREG, mb_address);
+		mb_hregs[CONFIG_ADDRESS_HREG] = mb_address;
+		mb_hregs[CONFIG_SERIAL_HREG] = mb_serial_config;
 		return;
 	}
 
-	if (new_address == mb_address)
+	if (new_address != mb_address) {
+		mb_address = new_address;
+		EEPROM.put(EEPROM_ADDRESS_OFFSET, mb_address);
+	}
+
+	if (new_serial_config == mb_serial_config)
+		return;
+	if (!serial_config_valid(new_serial_config)) {
+		mb_hregs[CONFIG_SERIAL_HREG] = mb_serial_config;
 		return;
-	mb_address = new_address;
-	EEPROM.put(EEPROM_ADDRESS_OFFSET, mb_address);
+	}
+	mb_serial_config = new_serial_config;
+	mb_serial_config_changed = true;
+	EEPROM.put(EEPROM_SERIAL_CONFIG_OFFSET, mb_serial_config);
 }
 
-unsigned long last_measurement = 0;
-
 void loop()
 {
-	unsigned long now = millis();
-
 #ifndef SERIAL_DEBUG
-	mb.task();
+	mb_task();
 #endif
 
 	check_mb_config_change();
 
-	digitalWrite(LED_BUILTIN, mb.Coil(LED_COIL));
-
-	if (last_measurement + MEASURE_INTERVAL > now)
-		return;
-	last_measurement = now;
+	digitalWrite(LED_BUILTIN, mb_coils[LED_COIL]);
 
-	scd30_process();
-	bme280_process();
-	sht31_process();
+	sensors_step();
 }
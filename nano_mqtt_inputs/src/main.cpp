@@ -31,6 +31,13 @@ char name[NAME_SIZE];
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Reading PINx directly avoids the port lookup and timer check digitalRead()
+ * does for every pin. Input pins are grouped by port in pins_init() so each
+ * used input register is read only once per scan. */
+#ifdef __AVR__
+#define INPUT_PORT_SCAN
+#endif
+
 enum pin_type {
 	PIN_TYPE_DIGITAL_INPUT,
 	PIN_TYPE_DIGITAL_A_INPUT,
@@ -50,6 +57,10 @@ struct pin {
 	uint8_t old_state:1,
 		state:1,
 		new_state_cnt:6;
+#ifdef INPUT_PORT_SCAN
+	uint8_t port; /* index into input_ports */
+	uint8_t mask; /* bit within the input port register */
+#endif
 };
 
 /* values: 0, 1 */
@@ -95,6 +106,53 @@ struct pin pins[] = {
 #define for_each_pin(pin, i)								\
 	for (i = 0, pin = &pins[i]; i < PINS_COUNT; pin = &pins[++i])
 
+#ifdef INPUT_PORT_SCAN
+#define INPUT_PORTS_MAX 3 /* PORTB, PORTC, PORTD */
+
+struct input_port {
+	volatile uint8_t *reg;
+	uint8_t val;
+};
+
+struct input_port input_ports[INPUT_PORTS_MAX];
+uint8_t input_ports_count;
+
+void input_port_pin_init(struct pin *pin)
+{
+	volatile uint8_t *reg = portInputRegister(digitalPinToPort(pin->pin));
+	uint8_t i;
+
+	for (i = 0; i < input_ports_count; i++)
+		if (input_ports[i].reg == reg)
+			break;
+	if (i == input_ports_count)
+		input_ports[input_ports_count++].reg = reg;
+	pin->port = i;
+	pin->mask = digitalPinToBitMask(pin->pin);
+}
+
+void input_ports_read(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < input_ports_count; i++)
+		input_ports[i].val = *input_ports[i].reg;
+}
+
+uint8_t input_port_pin_read(struct pin *pin)
+{
+	return input_ports[pin->port].val & pin->mask ? HIGH : LOW;
+}
+#else
+static inline void input_port_pin_init(struct pin *pin) {}
+static inline void input_ports_read(void) {}
+
+static inline uint8_t input_port_pin_read(struct pin *pin)
+{
+	return digitalRead(pin->pin);
+}
+#endif
+
 #define TMP_BUF_LEN 64
 char tmp_buf[TMP_BUF_LEN];
 
@@ -125,11 +183,12 @@ void input_pins_update_state()
 	uint8_t new_state;
 	uint8_t i;
 
+	input_ports_read();
 	for_each_pin(pin, i) {
 		switch (pin->type) {
 		case PIN_TYPE_DIGITAL_INPUT: /* fall-through */
 		case PIN_TYPE_DIGITAL_A_INPUT:
-			new_state = digitalRead(pin->pin);
+			new_state = input_port_pin_read(pin);
 			break;
 		case PIN_TYPE_DIGITAL_AX_INPUT:
 			new_state = analogRead(pin->pin) < 500 ? 0 : 1;
@@ -174,8 +233,11 @@ void pins_init(void)
 	struct pin *pin;
 	uint8_t i;
 
-	for_each_pin(pin, i)
+	for_each_pin(pin, i) {
 		pinMode(pin->pin, INPUT);
+		if (pin->type != PIN_TYPE_DIGITAL_AX_INPUT)
+			input_port_pin_init(pin);
+	}
 }
 
 void print_ip(IPAddress ip)
@@ -242,7 +304,7 @@ void payload_mac_to_eeprom(int offset, int size, byte *payload, int length)
 	uint8_t i;
 
 	for (i = 0; i < 6; i++) {
-		EEPROM.write(offset + i, strtol(pos, &pos, 16));
+		EEPROM.update(offset + i, strtol(pos, &pos, 16));
 		pos++;
 		if (pos >= (char *) payload + length)
 			return;
@@ -256,9 +318,9 @@ void str_to_eeprom(int offset, int size, byte *payload, int length)
 
 	for (i = 0; i < size; i++) {
 		if (i + 1 == size || i >= length)
-			EEPROM.write(offset + i, 0);
+			EEPROM.update(offset + i, 0);
 		else
-			EEPROM.write(offset + i, *pos++);
+			EEPROM.update(offset + i, *pos++);
 	}
 }
 
@@ -287,7 +349,7 @@ void callback(char *topic, byte *payload, unsigned int length)
 		uint32_t filter = strtol((const char *) payload, NULL, 10);
 
 		if (filter < EEPROM_FILTER_MAX)
-			EEPROM.put(EEPROM_FILTER_OFFSET, filter);
+			EEPROM.put(EEPROM_FILTER_OFFSET, (uint8_t) filter);
 	}
 	digitalWrite(LED_BUILTIN, LOW);
 }
@@ -31,6 +31,16 @@ char name[NAME_SIZE];
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Subscribe to a few wildcard filters instead of each config item and
+ * output pin topic separately, saving a SUBSCRIBE round trip per topic
+ * on every connect. callback() ignores topics it does not know. */
+//#define MQTT_WILDCARD_SUBSCRIBE
+
+/* Besides the per-pin topics, publish the state of all pins as one
+ * retained JSON object on "<name>/state" on connect. Define this to also
+ * publish it after every loop() pass in which some pin changed. */
+//#define STATE_SNAPSHOT_ON_CHANGE
+
 enum pin_type {
 	PIN_TYPE_D,
 	PIN_TYPE_A,
@@ -152,14 +162,100 @@ void load_print_pin_flavours(void)
 	}
 }
 
+bool state_changed; /* since the last state snapshot */
+
 void pin_publish(struct pin *pin)
 {
 	char state_buf[16];
 
 	sprintf(state_buf, "%u", pin->state);
+	state_changed = true;
 	client.publish(pin_topic(pin), state_buf);
 }
 
+/* beginPublish() needs the payload length up front, this only counts. */
+class CountingPrint : public Print {
+public:
+	size_t len = 0;
+
+	size_t write(uint8_t c) { len++; return 1; }
+	using Print::write;
+};
+
+/* The client sends every write() on its own, with Ethernet that is a TCP
+ * segment each. This collects the payload and passes it on in chunks.
+ */
+class BufferedPrint : public Print {
+public:
+	BufferedPrint(Print &out) : out(out) {}
+
+	size_t write(uint8_t c)
+	{
+		buf[len++] = c;
+		if (len == sizeof(buf))
+			flush();
+		return 1;
+	}
+	using Print::write;
+
+	void flush(void)
+	{
+		if (len)
+			out.write(buf, len);
+		len = 0;
+	}
+
+private:
+	Print &out;
+	uint8_t buf[64];
+	size_t len = 0;
+};
+
+char *state_topic(void)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/state", name);
+	return tmp_buf;
+}
+
+/* {"<pin subtopic>":<state>,...} */
+void state_snapshot_print(Print &out)
+{
+	bool first = true;
+	struct pin *pin;
+	uint8_t i;
+
+	out.print('{');
+	for_each_pin(pin, i) {
+		if (pin->flavour == PIN_FLAVOUR_DISABLED)
+			continue;
+		if (!first)
+			out.print(',');
+		first = false;
+		out.print('"');
+		out.print(pin_flavour_subtopic[pin->flavour]);
+		out.print('/');
+		out.print(pin_type_subtopic[pin->type]);
+		out.print(pin->index);
+		out.print("\":");
+		out.print(pin->state);
+	}
+	out.print('}');
+}
+
+void state_snapshot_publish(void)
+{
+	CountingPrint counter;
+	BufferedPrint out(client);
+
+	state_changed = false;
+	state_snapshot_print(counter);
+	if (!client.beginPublish(state_topic(), counter.len, true))
+		return;
+	state_snapshot_print(out);
+	out.flush();
+	client.endPublish();
+}
+
 void input_pins_update_state()
 {
 	uint8_t new_state;
@@ -215,6 +311,7 @@ void input_pins_publish(bool changed_only)
 void output_pin_update_state(struct pin *pin, uint8_t new_state)
 {
 	pin->state = new_state;
+	state_changed = true;
 	switch (pin->flavour) {
 	case PIN_FLAVOUR_DIGITAL_OUTPUT:
 		digitalWrite(pin->pin, pin->state);
@@ -341,7 +438,7 @@ void payload_mac_to_eeprom(int offset, int size, byte *payload, int length)
 	uint8_t i;
 
 	for (i = 0; i < 6; i++) {
-		EEPROM.write(offset + i, strtol(pos, &pos, 16));
+		EEPROM.update(offset + i, strtol(pos, &pos, 16));
 		pos++;
 		if (pos >= (char *) payload + length)
 			return;
@@ -355,9 +452,9 @@ void str_to_eeprom(int offset, int size, byte *payload, int length)
 
 	for (i = 0; i < size; i++) {
 		if (i + 1 == size || i >= length)
-			EEPROM.write(offset + i, 0);
+			EEPROM.update(offset + i, 0);
 		else
-			EEPROM.write(offset + i, *pos++);
+			EEPROM.update(offset + i, *pos++);
 	}
 }
 
@@ -409,7 +506,7 @@ void callback(char *topic, byte *payload, unsigned int length)
 		uint32_t filter = strtol((const char *) payload, NULL, 10);
 
 		if (filter < EEPROM_FILTER_MAX)
-			EEPROM.put(EEPROM_FILTER_OFFSET, filter);
+			EEPROM.put(EEPROM_FILTER_OFFSET, (uint8_t) filter);
 	} else if (check_pin_flavours_to_eeprom(topic, payload, length)) {
 	} else {
 		pins_msg_process(topic, (const char *) payload);
@@ -417,6 +514,113 @@ void callback(char *topic, byte *payload, unsigned int length)
 	digitalWrite(LED_BUILTIN, LOW);
 }
 
+/* The MQTT connection is driven from loop() one step per pass, TCP connect
+ * first, MQTT CONNECT/CONNACK in the next pass, each bounded by a short
+ * timeout, so local I/O keeps running while the broker is away. Failed
+ * attempts are retried with jittered exponential backoff. */
+#define MQTT_PORT 1883
+#define MQTT_TCP_TIMEOUT 500 /* ms */
+#define MQTT_SOCKET_TIMEOUT 1 /* s, CONNACK wait */
+#define MQTT_RETRY_TIMEOUT_MIN 1000
+#define MQTT_RETRY_TIMEOUT_MAX 60000
+
+enum mqtt_state {
+	MQTT_STATE_TCP_CONNECT,
+	MQTT_STATE_MQTT_CONNECT,
+	MQTT_STATE_CONNECTED,
+	MQTT_STATE_BACKOFF,
+};
+
+static enum mqtt_state mqtt_state;
+static IPAddress mqtt_server;
+static unsigned long mqtt_retry_timeout = MQTT_RETRY_TIMEOUT_MIN;
+static unsigned long mqtt_backoff_timeout;
+static unsigned long mqtt_last_attempt;
+
+void mqtt_backoff(unsigned long now)
+{
+	/* Jitter spreads out reconnects of devices that lost the broker
+	 * at the same time. */
+	mqtt_backoff_timeout = mqtt_retry_timeout +
+			       random(mqtt_retry_timeout / 2);
+	mqtt_retry_timeout = min(mqtt_retry_timeout * 2,
+				 (unsigned long) MQTT_RETRY_TIMEOUT_MAX);
+	mqtt_last_attempt = now;
+	mqtt_state = MQTT_STATE_BACKOFF;
+}
+
+#ifdef MQTT_WILDCARD_SUBSCRIBE
+void wildcard_subscribe(void)
+{
+	bool subscribed[ARRAY_SIZE(pin_flavour_subtopic)] = {};
+	struct pin *pin;
+	uint8_t i;
+
+	client.subscribe(config_topic("#"));
+	for_each_pin(pin, i) {
+		if (!is_pin_output(pin) || subscribed[pin->flavour])
+			continue;
+		snprintf(tmp_buf, TMP_BUF_LEN, "%s/%s/#", name,
+			 pin_flavour_subtopic[pin->flavour]);
+		client.subscribe(tmp_buf);
+		subscribed[pin->flavour] = true;
+	}
+}
+#endif
+
+void mqtt_connected_setup(void)
+{
+	input_pins_update_state();
+	input_pins_publish(false);
+	state_snapshot_publish();
+#ifdef MQTT_WILDCARD_SUBSCRIBE
+	wildcard_subscribe();
+#else
+	client.subscribe(config_topic("name"));
+	client.subscribe(config_topic("mac"));
+	client.subscribe(config_topic("ip"));
+	client.subscribe(config_topic("mqttip"));
+	client.subscribe(config_topic("filter"));
+	pins_subscribe();
+#endif
+}
+
+bool mqtt_process(unsigned long now)
+{
+	switch (mqtt_state) {
+	case MQTT_STATE_TCP_CONNECT:
+		if (ethClient.connect(mqtt_server, MQTT_PORT))
+			mqtt_state = MQTT_STATE_MQTT_CONNECT;
+		else
+			mqtt_backoff(now);
+		break;
+	case MQTT_STATE_MQTT_CONNECT:
+		/* TCP is up already, so this only does CONNECT/CONNACK. */
+		if (!client.connect(name)) {
+			ethClient.stop();
+			mqtt_backoff(now);
+			break;
+		}
+		Serial.println("CONNECTED");
+		mqtt_retry_timeout = MQTT_RETRY_TIMEOUT_MIN;
+		mqtt_state = MQTT_STATE_CONNECTED;
+		mqtt_connected_setup();
+		break;
+	case MQTT_STATE_CONNECTED:
+		if (client.connected())
+			return true;
+		Serial.println("DISCONNECTED");
+		ethClient.stop();
+		mqtt_state = MQTT_STATE_TCP_CONNECT;
+		break;
+	case MQTT_STATE_BACKOFF:
+		if (now - mqtt_last_attempt >= mqtt_backoff_timeout)
+			mqtt_state = MQTT_STATE_TCP_CONNECT;
+		break;
+	}
+	return false;
+}
+
 void setup(void)
 {
 	byte mac[MAC_LEN];
@@ -436,6 +640,7 @@ void setup(void)
 	EEPROM.get(EEPROM_MAC_OFFSET, mac);
 	mac[0] &= 0xfe; /* Clear multicast bit. */
 	mac[0] |= 0x02; /* Set local assignment bit. */
+	randomSeed(mac[3] << 16 | mac[4] << 8 | mac[5]);
 
 	sprintf(macstr, "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 	Serial.print("MAC:");
@@ -460,46 +665,24 @@ void setup(void)
 	Ethernet.begin(mac, ip);
 	pins_init();
 
-	client.setServer(mqttip, 1883);
+	client.setServer(mqttip, MQTT_PORT);
+	client.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+	mqtt_server = mqttip;
+	ethClient.setConnectionTimeout(MQTT_TCP_TIMEOUT);
 	client.setCallback(callback);
 }
 
-#define MQTT_RETRY_TIMEOUT 5000
-
-static bool mqtt_connected;
-static unsigned long mqtt_last_attempt;
-
 void loop(void)
 {
 	unsigned long now = millis();
 
-	if (!client.connected()) {
-		if (mqtt_connected) {
-			mqtt_last_attempt = 0;
-			Serial.println("DISCONNECTED");
-			mqtt_connected = false;
-		}
-		if (!mqtt_last_attempt ||
-		    mqtt_last_attempt + MQTT_RETRY_TIMEOUT < now ||
-		    mqtt_last_attempt > now) {
-			mqtt_last_attempt = now;
-
-			if (client.connect(name)) {
-				Serial.println("CONNECTED");
-				mqtt_connected = true;
-				input_pins_update_state();
-				input_pins_publish(false);
-				client.subscribe(config_topic("name"));
-				client.subscribe(config_topic("mac"));
-				client.subscribe(config_topic("ip"));
-				client.subscribe(config_topic("mqttip"));
-				client.subscribe(config_topic("filter"));
-				pins_subscribe();
-			}
-		}
-	} else {
+	if (mqtt_process(now)) {
 		input_pins_update_state();
 		input_pins_publish(true);
+#ifdef STATE_SNAPSHOT_ON_CHANGE
+		if (state_changed)
+			state_snapshot_publish();
+#endif
 		client.loop();
 	}
 }
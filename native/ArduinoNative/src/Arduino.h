@@ -0,0 +1,243 @@
+/*
+ * Native: Arduino core stand-in for running sketches on Linux
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_ARDUINO_H_
+#define _NATIVE_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+using std::min;
+using std::max;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+
+#define LED_BUILTIN 13
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+
+#define NATIVE_PINS_COUNT 128
+
+#define PROGMEM
+#define F(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+#define pgm_read_dword(addr) (*(const uint32_t *) (addr))
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+#define bit(b) (1UL << (b))
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int val);
+
+static inline void interrupts(void) {}
+static inline void noInterrupts(void) {}
+
+#define IRAM_ATTR
+#define digitalPinToInterrupt(p) (p)
+
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode);
+void attachInterruptArg(uint8_t pin, void (*isr)(void *), void *arg, int mode);
+void detachInterrupt(uint8_t pin);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+class String {
+public:
+	String(const char *str = "") : s(str ? str : "") {}
+	String(const std::string &str) : s(str) {}
+	String(char c) : s(1, c) {}
+	String(int val, int base = DEC) { from_long(val, base); }
+	String(unsigned int val, int base = DEC) { from_ulong(val, base); }
+	String(long val, int base = DEC) { from_long(val, base); }
+	String(unsigned long val, int base = DEC) { from_ulong(val, base); }
+	String(unsigned char val, int base = DEC) { from_ulong(val, base); }
+	String(double val, int digits = 2);
+
+	const char *c_str() const { return s.c_str(); }
+	unsigned int length() const { return s.length(); }
+	long toInt() const { return strtol(s.c_str(), NULL, 10); }
+	void toCharArray(char *buf, unsigned int size) const;
+	int indexOf(char c) const;
+	String substring(unsigned int from) const;
+	String substring(unsigned int from, unsigned int to) const;
+	void trim(void);
+	char operator[](unsigned int i) const { return s[i]; }
+
+	String &operator+=(const String &rhs) { s += rhs.s; return *this; }
+	String &operator+=(const char *rhs) { s += rhs; return *this; }
+	String &operator+=(char c) { s += c; return *this; }
+	bool operator==(const String &rhs) const { return s == rhs.s; }
+	bool operator==(const char *rhs) const { return s == rhs; }
+	bool operator!=(const String &rhs) const { return s != rhs.s; }
+	bool operator!=(const char *rhs) const { return s != rhs; }
+
+	friend String operator+(const String &lhs, const String &rhs);
+
+private:
+	void from_long(long val, int base);
+	void from_ulong(unsigned long val, int base);
+	std::string s;
+};
+
+String operator+(const String &lhs, const String &rhs);
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t *buf, size_t size);
+	size_t write(const char *str) { return write((const uint8_t *) str, strlen(str)); }
+
+	size_t print(const char *str) { return write(str); }
+	size_t print(const String &str) { return write(str.c_str()); }
+	size_t print(char c) { return write((uint8_t) c); }
+	size_t print(unsigned char val, int base = DEC) { return print((unsigned long) val, base); }
+	size_t print(int val, int base = DEC) { return print((long) val, base); }
+	size_t print(unsigned int val, int base = DEC) { return print((unsigned long) val, base); }
+	size_t print(long val, int base = DEC);
+	size_t print(unsigned long val, int base = DEC);
+	size_t print(double val, int digits = 2);
+
+	template <typename T>
+	size_t println(T val) { return print(val) + println(); }
+	template <typename T>
+	size_t println(T val, int arg) { return print(val, arg) + println(); }
+	size_t println(void) { return write("\r\n"); }
+
+	size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class IPAddress {
+public:
+	IPAddress() { addr.dword = 0; }
+	IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+	IPAddress(uint32_t dword) { addr.dword = dword; }
+	IPAddress(const uint8_t *bytes) { memcpy(addr.bytes, bytes, 4); }
+
+	bool fromString(const char *str);
+	bool fromString(const String &str) { return fromString(str.c_str()); }
+	operator uint32_t() const { return addr.dword; }
+	bool operator==(const IPAddress &rhs) const { return addr.dword == rhs.addr.dword; }
+	bool operator==(uint32_t rhs) const { return addr.dword == rhs; }
+	uint8_t operator[](int index) const { return addr.bytes[index]; }
+	uint8_t &operator[](int index) { return addr.bytes[index]; }
+
+private:
+	union {
+		uint8_t bytes[4];
+		uint32_t dword;
+	} addr;
+};
+
+#define INADDR_NONE IPAddress(0, 0, 0, 0)
+
+class Stream : public Print {
+public:
+	virtual int available(void) { return 0; }
+	virtual int read(void) { return -1; }
+	virtual int peek(void) { return -1; }
+	virtual void flush(void) {}
+};
+
+class HardwareSerial : public Stream {
+public:
+	void begin(unsigned long baud, uint8_t config = 0) {}
+	void end(void) {}
+	int available(void);
+	int read(void);
+	int availableForWrite(void) { return 64; }
+	size_t write(uint8_t c);
+	using Print::write;
+	operator bool() { return true; }
+
+	/* Bytes the sketch will read back, fed by the benchmark runner. */
+	std::string rx;
+};
+
+#define SERIAL_8N1 0x06
+#define SERIAL_8E1 0x26
+#define SERIAL_8O1 0x36
+#define SERIAL_8N2 0x0E
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+extern HardwareSerial Serial2;
+
+class Client : public Stream {
+public:
+	virtual int connect(IPAddress ip, uint16_t port) = 0;
+	virtual uint8_t connected(void) = 0;
+	virtual void stop(void) = 0;
+	virtual size_t write(uint8_t c) { return 1; }
+	virtual size_t write(const uint8_t *buf, size_t size) { return size; }
+	virtual int read(uint8_t *buf, size_t size) { return -1; }
+	using Print::write;
+	using Stream::read;
+	operator bool() { return connected(); }
+};
+
+void setup(void);
+void loop(void);
+
+#endif /* _NATIVE_ARDUINO_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Native: Controllino stand-in
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_CONTROLLINO_H_
+#define _NATIVE_CONTROLLINO_H_
+
+#include "Arduino.h"
+
+#if !defined(CONTROLLINO_MINI) && !defined(CONTROLLINO_MAXI) && \
+    !defined(CONTROLLINO_MEGA) && !defined(CONTROLLINO_MAXI_AUTOMATION)
+#define CONTROLLINO_MEGA
+#endif
+
+/* Pin numbers follow the Controllino MEGA variant. */
+
+#define CONTROLLINO_D0 2
+#define CONTROLLINO_D1 3
+#define CONTROLLINO_D2 4
+#define CONTROLLINO_D3 5
+#define CONTROLLINO_D4 6
+#define CONTROLLINO_D5 7
+#define CONTROLLINO_D6 8
+#define CONTROLLINO_D7 9
+#define CONTROLLINO_D8 10
+#define CONTROLLINO_D9 11
+#define CONTROLLINO_D10 12
+#define CONTROLLINO_D11 13
+#define CONTROLLINO_D12 42
+#define CONTROLLINO_D13 43
+#define CONTROLLINO_D14 44
+#define CONTROLLINO_D15 45
+#define CONTROLLINO_D16 46
+#define CONTROLLINO_D17 47
+#define CONTROLLINO_D18 48
+#define CONTROLLINO_D19 49
+#define CONTROLLINO_D20 77
+#define CONTROLLINO_D21 78
+#define CONTROLLINO_D22 79
+#define CONTROLLINO_D23 80
+
+#define CONTROLLINO_A0 54
+#define CONTROLLINO_A1 55
+#define CONTROLLINO_A2 56
+#define CONTROLLINO_A3 57
+#define CONTROLLINO_A4 58
+#define CONTROLLINO_A5 59
+#define CONTROLLINO_A6 60
+#define CONTROLLINO_A7 61
+#define CONTROLLINO_A8 62
+#define CONTROLLINO_A9 63
+#define CONTROLLINO_A10 64
+#define CONTROLLINO_A11 65
+#define CONTROLLINO_A12 66
+#define CONTROLLINO_A13 67
+#define CONTROLLINO_A14 68
+#define CONTROLLINO_A15 69
+#define CONTROLLINO_I16 38
+#define CONTROLLINO_I17 39
+#define CONTROLLINO_I18 40
+
+#define CONTROLLINO_IN0 18
+#define CONTROLLINO_IN1 19
+
+#define CONTROLLINO_R0 22
+#define CONTROLLINO_R1 23
+#define CONTROLLINO_R2 24
+#define CONTROLLINO_R3 25
+#define CONTROLLINO_R4 26
+#define CONTROLLINO_R5 27
+#define CONTROLLINO_R6 28
+#define CONTROLLINO_R7 29
+#define CONTROLLINO_R8 30
+#define CONTROLLINO_R9 31
+#define CONTROLLINO_R10 37
+#define CONTROLLINO_R11 36
+#define CONTROLLINO_R12 35
+#define CONTROLLINO_R13 34
+#define CONTROLLINO_R14 33
+#define CONTROLLINO_R15 32
+
+/* The sketches poke these directly for D20-D23. */
+extern volatile uint8_t PORTD;
+extern volatile uint8_t PORTJ;
+extern volatile uint8_t DDRD;
+extern volatile uint8_t DDRJ;
+
+#endif /* _NATIVE_CONTROLLINO_H_ */
@@ -0,0 +1,33 @@
+/*
+ * Native: DallasTemperature stand-in
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_DALLASTEMPERATURE_H_
+#define _NATIVE_DALLASTEMPERATURE_H_
+
+/* The MQTT I/O sketches only include the header, there are no
+ * 1-wire devices on the native target.
+ */
+
+#include "Arduino.h"
+
+#define DEVICE_DISCONNECTED_C -127
+
+typedef uint8_t DeviceAddress[8];
+
+#endif /* _NATIVE_DALLASTEMPERATURE_H_ */
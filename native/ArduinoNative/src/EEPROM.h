@@ -0,0 +1,64 @@
+/*
+ * Native: EEPROM stand-in
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_EEPROM_H_
+#define _NATIVE_EEPROM_H_
+
+#include "Arduino.h"
+
+#define NATIVE_EEPROM_SIZE 4096
+
+/* Behaves like the AVR EEPROM library (put() only writes the bytes
+ * that differ) and provides the begin()/commit() pair of the ESP32
+ * flash-backed one.
+ */
+class EEPROMClass {
+public:
+	bool begin(size_t size) { return size <= NATIVE_EEPROM_SIZE; }
+	bool commit(void);
+	uint8_t read(int idx) { return data[idx]; }
+	void write(int idx, uint8_t val);
+	void update(int idx, uint8_t val);
+	uint16_t length(void) { return NATIVE_EEPROM_SIZE; }
+	uint8_t &operator[](int idx) { return data[idx]; }
+
+	template <typename T> T &get(int idx, T &t)
+	{
+		memcpy(&t, &data[idx], sizeof(T));
+		return t;
+	}
+
+	template <typename T> const T &put(int idx, const T &t)
+	{
+		const uint8_t *ptr = (const uint8_t *) &t;
+		size_t i;
+
+		for (i = 0; i < sizeof(T); i++)
+			update(idx + i, ptr[i]);
+		return t;
+	}
+
+private:
+	uint8_t data[NATIVE_EEPROM_SIZE];
+	bool dirty;
+};
+
+extern EEPROMClass EEPROM;
+
+#endif /* _NATIVE_EEPROM_H_ */
@@ -0,0 +1,66 @@
+/*
+ * Native: Ethernet stand-in
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_ETHERNET_H_
+#define _NATIVE_ETHERNET_H_
+
+#include "Arduino.h"
+
+#define MAX_SOCK_NUM 8
+
+class EthernetClass {
+public:
+	void init(uint8_t cs) {}
+	int begin(uint8_t *mac) { return 1; }
+	void begin(uint8_t *mac, IPAddress ip) { local_ip = ip; }
+	IPAddress localIP(void) { return local_ip; }
+	int maintain(void) { return 0; }
+
+private:
+	IPAddress local_ip;
+};
+
+extern EthernetClass Ethernet;
+
+class EthernetClient : public Client {
+public:
+	int connect(IPAddress ip, uint16_t port);
+	uint8_t connected(void) { return is_connected; }
+	void stop(void) { is_connected = false; }
+	void setConnectionTimeout(uint16_t timeout) { connection_timeout = timeout; }
+	using Client::write;
+
+private:
+	bool is_connected = false;
+	uint16_t connection_timeout = 1000;
+};
+
+/* Nobody ever connects, available() hands out a closed client. */
+class EthernetServer {
+public:
+	EthernetServer(uint16_t port) : port(port) {}
+	void begin(void) {}
+	EthernetClient available(void) { return EthernetClient(); }
+	EthernetClient accept(void) { return EthernetClient(); }
+
+private:
+	uint16_t port;
+};
+
+#endif /* _NATIVE_ETHERNET_H_ */
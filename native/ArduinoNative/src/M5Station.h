@@ -0,0 +1,73 @@
+/*
+ * Native: M5Station stand-in
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_M5STATION_H_
+#define _NATIVE_M5STATION_H_
+
+#include "Arduino.h"
+
+#define BLACK 0x0000
+#define BLUE 0x001F
+#define RED 0xF800
+#define GREEN 0x07E0
+#define YELLOW 0xFFE0
+#define WHITE 0xFFFF
+
+class M5Lcd : public Print {
+public:
+	void fillScreen(uint16_t color) {}
+	void fillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t color) {}
+	void setTextColor(uint16_t color) {}
+	void setTextSize(uint8_t size) {}
+	void setCursor(int16_t x, int16_t y) {}
+	int16_t width(void) { return 240; }
+	int16_t height(void) { return 135; }
+	size_t write(uint8_t c) { return 1; }
+	using Print::write;
+};
+
+class M5Button {
+public:
+	bool isPressed(void) { return false; }
+	bool wasPressed(void) { return false; }
+	bool wasReleased(void) { return false; }
+	bool pressedFor(uint32_t ms) { return false; }
+};
+
+class M5StationClass {
+public:
+	void begin(bool lcd = true, bool power = true, bool serial = true) {}
+	void update(void) {}
+
+	M5Lcd Lcd;
+	M5Button BtnA;
+	M5Button BtnB;
+	M5Button BtnC;
+};
+
+extern M5StationClass M5;
+
+class EspClass {
+public:
+	void restart(void) { exit(0); }
+};
+
+extern EspClass ESP;
+
+#endif /* _NATIVE_M5STATION_H_ */
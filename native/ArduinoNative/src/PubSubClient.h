@@ -0,0 +1,72 @@
+/*
+ * Native: PubSubClient stand-in talking to a simulated broker
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_PUBSUBCLIENT_H_
+#define _NATIVE_PUBSUBCLIENT_H_
+
+#include "Arduino.h"
+
+#define MQTT_MAX_PACKET_SIZE 256
+
+#define MQTT_CONNECTION_TIMEOUT -4
+#define MQTT_CONNECT_FAILED -2
+#define MQTT_DISCONNECTED -1
+#define MQTT_CONNECTED 0
+
+#define MQTT_CALLBACK_SIGNATURE void (*callback)(char *, uint8_t *, unsigned int)
+
+class PubSubClient : public Print {
+public:
+	PubSubClient(Client &client) : client(&client) {}
+
+	PubSubClient &setServer(IPAddress ip, uint16_t port);
+	PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+	PubSubClient &setKeepAlive(uint16_t keep_alive) { return *this; }
+	PubSubClient &setSocketTimeout(uint16_t timeout) { return *this; }
+	bool setBufferSize(uint16_t size) { return true; }
+
+	bool connect(const char *id);
+	void disconnect(void);
+	bool connected(void);
+	int state(void) { return mqtt_state; }
+
+	bool publish(const char *topic, const char *payload);
+	bool publish(const char *topic, const char *payload, bool retained);
+	bool publish(const char *topic, const uint8_t *payload,
+		     unsigned int length, bool retained);
+	bool beginPublish(const char *topic, unsigned int length, bool retained);
+	size_t write(uint8_t c);
+	size_t write(const uint8_t *buf, size_t size);
+	using Print::write;
+	int endPublish(void);
+
+	bool subscribe(const char *topic);
+	bool unsubscribe(const char *topic);
+	bool loop(void);
+
+	MQTT_CALLBACK_SIGNATURE = NULL;
+
+private:
+	Client *client;
+	IPAddress ip;
+	uint16_t port;
+	int mqtt_state = MQTT_DISCONNECTED;
+};
+
+#endif /* _NATIVE_PUBSUBCLIENT_H_ */
@@ -0,0 +1,33 @@
+/*
+ * Native: SPI stand-in
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_SPI_H_
+#define _NATIVE_SPI_H_
+
+#include "Arduino.h"
+
+class SPIClass {
+public:
+	void begin(void) {}
+	void begin(int8_t sck, int8_t miso, int8_t mosi, int8_t ss) {}
+};
+
+extern SPIClass SPI;
+
+#endif /* _NATIVE_SPI_H_ */
@@ -0,0 +1,54 @@
+/*
+ * Native: WiFi stand-in
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_WIFI_H_
+#define _NATIVE_WIFI_H_
+
+#include "Arduino.h"
+
+#define WIFI_STA 1
+
+enum wl_status_t {
+	WL_IDLE_STATUS = 0,
+	WL_CONNECTED = 3,
+	WL_DISCONNECTED = 6,
+};
+
+class WiFiClass {
+public:
+	bool mode(int mode) { return true; }
+	wl_status_t begin(const char *ssid, const char *pass) { return WL_CONNECTED; }
+	wl_status_t status(void) { return WL_CONNECTED; }
+};
+
+extern WiFiClass WiFi;
+
+class WiFiClient : public Client {
+public:
+	int connect(IPAddress ip, uint16_t port);
+	int connect(IPAddress ip, uint16_t port, int32_t timeout);
+	uint8_t connected(void) { return is_connected; }
+	void stop(void) { is_connected = false; }
+	using Client::write;
+
+private:
+	bool is_connected = false;
+};
+
+#endif /* _NATIVE_WIFI_H_ */
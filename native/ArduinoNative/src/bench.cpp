@@ -0,0 +1,240 @@
+/*
+ * Native: loop() and message dispatch benchmark runner
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <chrono>
+#include <new>
+#include <unistd.h>
+#include "Arduino.h"
+#include "native.h"
+
+/* Count every allocation the sketch does. Arduino String and the
+ * libraries end up in operator new on the native target.
+ */
+
+void *operator new(size_t size)
+{
+	void *ptr = malloc(size ? size : 1);
+
+	if (!ptr)
+		throw std::bad_alloc();
+	native_stats.alloc_count++;
+	native_stats.alloc_bytes += size;
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t size) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr, size_t size) noexcept
+{
+	free(ptr);
+}
+
+static uint64_t now_ns(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void inputs_toggle(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < NATIVE_PINS_COUNT; i++) {
+		if (!native_pin_used[i] || native_pin_mode[i] == OUTPUT)
+			continue;
+		native_pin_set(i, !native_pin_level[i]);
+	}
+}
+
+static void stats_print(const char *phase, const struct native_stats *before)
+{
+	printf("%s: %lu allocations, %lu bytes allocated\n", phase,
+	       native_stats.alloc_count - before->alloc_count,
+	       native_stats.alloc_bytes - before->alloc_bytes);
+	printf("%s: %lu publishes, %lu payload bytes, %lu subscribes\n", phase,
+	       native_stats.mqtt_publish_count - before->mqtt_publish_count,
+	       native_stats.mqtt_publish_bytes - before->mqtt_publish_bytes,
+	       native_stats.mqtt_subscribe_count - before->mqtt_subscribe_count);
+	printf("%s: %lu EEPROM bytes written, %lu commits\n", phase,
+	       native_stats.eeprom_write_bytes - before->eeprom_write_bytes,
+	       native_stats.eeprom_commit_count - before->eeprom_commit_count);
+}
+
+static bool dispatch_topic_usable(const char *topic)
+{
+	return !strchr(topic, '#') && !strchr(topic, '+') &&
+	       !strstr(topic, "/config/");
+}
+
+#define BENCH_TOPICS_MAX 32
+#define BENCH_CONNECT_LOOPS 1000
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n LOOPS] [-m MESSAGES] [-t TOGGLE] [-T TOPIC]... [-c TOPIC=VALUE]... [-d] [-v]\n"
+		"  -n LOOPS     number of loop() iterations to measure (default 100000)\n"
+		"  -m MESSAGES  messages dispatched per topic (default 100)\n"
+		"  -t TOGGLE    toggle all inputs every TOGGLE iterations, 0 to disable (default 1000)\n"
+		"  -T TOPIC     dispatch to TOPIC as well, may be repeated\n"
+		"  -c TOPIC=VALUE\n"
+		"               deliver a config message and reboot before measuring,\n"
+		"               may be repeated\n"
+		"  -d           simulate the MQTT broker being down\n"
+		"  -v           echo the serial output of the sketch\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *extra_topics[BENCH_TOPICS_MAX];
+	unsigned int extra_topics_count = 0;
+	char *configs[BENCH_TOPICS_MAX];
+	unsigned int configs_count = 0;
+	unsigned long loops = 100000;
+	unsigned long messages = 100;
+	unsigned long toggle = 1000;
+	struct native_stats before;
+	uint64_t dispatch_max = 0;
+	uint64_t dispatch_sum = 0;
+	unsigned long dispatched = 0;
+	const char **topics;
+	unsigned int count;
+	uint64_t start, t;
+	unsigned long i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:m:t:T:c:dvh")) != -1) {
+		switch (opt) {
+		case 'n':
+			loops = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			messages = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			toggle = strtoul(optarg, NULL, 10);
+			break;
+		case 'T':
+			if (extra_topics_count < BENCH_TOPICS_MAX)
+				extra_topics[extra_topics_count++] = optarg;
+			break;
+		case 'c':
+			if (!strchr(optarg, '=')) {
+				usage(argv[0]);
+				return 1;
+			}
+			if (configs_count < BENCH_TOPICS_MAX)
+				configs[configs_count++] = optarg;
+			break;
+		case 'd':
+			native_broker_up = false;
+			break;
+		case 'v':
+			native_serial_echo = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (configs_count) {
+		/* Config changes only take effect after reboot. */
+		setup();
+		for (i = 0; i < BENCH_CONNECT_LOOPS &&
+			    !native_stats.mqtt_connect_count; i++) {
+			native_timers_run();
+			loop();
+		}
+		for (i = 0; i < configs_count; i++) {
+			char *value = strchr(configs[i], '=');
+
+			*value++ = '\0';
+			native_mqtt_deliver(configs[i], value);
+		}
+		native_mqtt_disconnect();
+		native_tasks_stop();
+	}
+
+	before = native_stats;
+	start = now_ns();
+	setup();
+	printf("setup: %.3f ms\n", (now_ns() - start) / 1e6);
+	stats_print("setup", &before);
+
+	before = native_stats;
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		if (toggle && i && !(i % toggle))
+			inputs_toggle();
+		native_timers_run();
+		loop();
+	}
+	t = now_ns() - start;
+	printf("loop: %lu iterations in %.3f s, %.0f iterations/s, %.0f ns/iteration\n",
+	       loops, t / 1e9, loops / (t / 1e9), (double) t / (loops ? loops : 1));
+	stats_print("loop", &before);
+
+	count = native_mqtt_subscriptions(&topics);
+	before = native_stats;
+	for (j = 0; j < count + extra_topics_count; j++) {
+		const char *topic = j < count ? topics[j] :
+						extra_topics[j - count];
+
+		if (j < count && !dispatch_topic_usable(topic))
+			continue;
+		for (i = 0; i < messages; i++) {
+			start = now_ns();
+			native_mqtt_deliver(topic, i % 2 ? "0" : "1");
+			t = now_ns() - start;
+			dispatch_sum += t;
+			if (t > dispatch_max)
+				dispatch_max = t;
+			dispatched++;
+		}
+	}
+	if (dispatched)
+		printf("dispatch: %lu messages, %.0f ns average, %llu ns max\n",
+		       dispatched, (double) dispatch_sum / dispatched,
+		       (unsigned long long) dispatch_max);
+	else
+		printf("dispatch: no usable topics, use -T\n");
+	stats_print("dispatch", &before);
+
+	native_tasks_stop();
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Native: FreeRTOS task API stand-in
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_FREERTOS_TASK_H_
+#define _NATIVE_FREERTOS_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void *arg);
+typedef struct native_task *TaskHandle_t;
+
+/* Every task is a thread of its own, core and priority are ignored.
+ * Tasks end in their next delay once native_tasks_stop() is called.
+ */
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+				   uint32_t stack_depth, void *arg,
+				   UBaseType_t priority, TaskHandle_t *handle,
+				   BaseType_t core);
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t *prev_wake, TickType_t increment);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xPortGetCoreID(void);
+
+#endif /* _NATIVE_FREERTOS_TASK_H_ */
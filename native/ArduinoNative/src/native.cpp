@@ -0,0 +1,662 @@
+/*
+ * Native: Arduino core and library stand-ins
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "Arduino.h"
+#include "native.h"
+#include "SPI.h"
+#include "Ethernet.h"
+#include "WiFi.h"
+#include "EEPROM.h"
+#include "PubSubClient.h"
+#include "Controllino.h"
+#include "M5Station.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+uint16_t native_pin_level[NATIVE_PINS_COUNT];
+uint8_t native_pin_mode[NATIVE_PINS_COUNT];
+bool native_pin_used[NATIVE_PINS_COUNT];
+bool native_broker_up = true;
+bool native_serial_echo;
+struct native_stats native_stats;
+
+static std::chrono::steady_clock::time_point start_time =
+	std::chrono::steady_clock::now();
+
+unsigned long millis(void)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start_time).count();
+}
+
+unsigned long micros(void)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - start_time).count();
+}
+
+void delay(unsigned long ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	native_pin_mode[pin] = mode;
+	native_pin_used[pin] = true;
+	if (mode == INPUT_PULLUP)
+		native_pin_level[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	native_pin_level[pin] = val ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin)
+{
+	return native_pin_level[pin] ? HIGH : LOW;
+}
+
+int analogRead(uint8_t pin)
+{
+	return native_pin_level[pin] ? 1023 : 0;
+}
+
+void analogWrite(uint8_t pin, int val)
+{
+	native_pin_level[pin] = val;
+}
+
+struct native_irq {
+	void (*isr)(void);
+	void (*isr_arg)(void *);
+	void *arg;
+	int mode;
+};
+
+static struct native_irq native_irqs[NATIVE_PINS_COUNT];
+
+void attachInterrupt(uint8_t pin, void (*isr)(void), int mode)
+{
+	native_irqs[pin] = (struct native_irq) { .isr = isr, .mode = mode };
+}
+
+void attachInterruptArg(uint8_t pin, void (*isr)(void *), void *arg, int mode)
+{
+	native_irqs[pin] = (struct native_irq) {
+		.isr_arg = isr, .arg = arg, .mode = mode,
+	};
+}
+
+void detachInterrupt(uint8_t pin)
+{
+	native_irqs[pin] = (struct native_irq) {};
+}
+
+void native_pin_set(uint8_t pin, uint16_t level)
+{
+	struct native_irq *irq = &native_irqs[pin];
+	uint16_t old = native_pin_level[pin];
+
+	native_pin_level[pin] = level;
+	if (!!old == !!level)
+		return;
+	if (irq->mode == RISING && !level)
+		return;
+	if (irq->mode == FALLING && level)
+		return;
+	if (irq->isr)
+		irq->isr();
+	else if (irq->isr_arg)
+		irq->isr_arg(irq->arg);
+}
+
+#define NATIVE_TIMERS_MAX 8
+
+struct native_esp_timer {
+	esp_timer_create_args_t args;
+	uint64_t period;
+	uint64_t next;
+	bool running;
+};
+
+static struct native_esp_timer native_timers[NATIVE_TIMERS_MAX];
+static unsigned int native_timers_count;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+			   esp_timer_handle_t *handle)
+{
+	struct native_esp_timer *timer;
+
+	if (native_timers_count == NATIVE_TIMERS_MAX)
+		return ESP_FAIL;
+	timer = &native_timers[native_timers_count++];
+	timer->args = *args;
+	timer->running = false;
+	*handle = timer;
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+	timer->period = period;
+	timer->next = micros() + period;
+	timer->running = true;
+	return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+	timer->running = false;
+	return ESP_OK;
+}
+
+int64_t esp_timer_get_time(void)
+{
+	return micros();
+}
+
+void native_timers_run(void)
+{
+	uint64_t now = micros();
+	unsigned int i;
+
+	for (i = 0; i < native_timers_count; i++) {
+		struct native_esp_timer *timer = &native_timers[i];
+
+		while (timer->running && timer->next <= now) {
+			timer->args.callback(timer->args.arg);
+			timer->next += timer->period;
+		}
+	}
+}
+
+/* Thrown from the delays to unwind a task once it is asked to stop. */
+struct native_task_exit {};
+
+static std::vector<std::thread> native_tasks;
+static std::atomic<bool> native_tasks_stopping;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name,
+				   uint32_t stack_depth, void *arg,
+				   UBaseType_t priority, TaskHandle_t *handle,
+				   BaseType_t core)
+{
+	native_tasks.emplace_back([fn, arg]() {
+		try {
+			fn(arg);
+		} catch (native_task_exit &) {
+		}
+	});
+	if (handle)
+		*handle = NULL;
+	return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	if (native_tasks_stopping)
+		throw native_task_exit();
+	delay(ticks * portTICK_PERIOD_MS);
+}
+
+void vTaskDelayUntil(TickType_t *prev_wake, TickType_t increment)
+{
+	TickType_t now = xTaskGetTickCount();
+
+	*prev_wake += increment;
+	/* Late already, FreeRTOS does not wait either. */
+	vTaskDelay((int32_t) (*prev_wake - now) > 0 ? *prev_wake - now : 0);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return millis() / portTICK_PERIOD_MS;
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+	return 1;
+}
+
+void native_tasks_stop(void)
+{
+	native_tasks_stopping = true;
+	for (auto &task : native_tasks)
+		task.join();
+	native_tasks.clear();
+	native_tasks_stopping = false;
+}
+
+long random(long max)
+{
+	return max ? rand() % max : 0;
+}
+
+long random(long min, long max)
+{
+	return min >= max ? min : min + random(max - min);
+}
+
+void randomSeed(unsigned long seed)
+{
+	srand(seed);
+}
+
+String::String(double val, int digits)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%.*f", digits, val);
+	s = buf;
+}
+
+void String::from_long(long val, int base)
+{
+	if (base == DEC) {
+		s = std::to_string(val);
+		return;
+	}
+	from_ulong((unsigned long) val, base);
+}
+
+void String::from_ulong(unsigned long val, int base)
+{
+	char buf[sizeof(unsigned long) * 8 + 1];
+
+	snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%lu", val);
+	s = buf;
+}
+
+void String::toCharArray(char *buf, unsigned int size) const
+{
+	if (!size)
+		return;
+	strncpy(buf, s.c_str(), size - 1);
+	buf[size - 1] = '\0';
+}
+
+int String::indexOf(char c) const
+{
+	size_t pos = s.find(c);
+
+	return pos == std::string::npos ? -1 : pos;
+}
+
+String String::substring(unsigned int from) const
+{
+	return from < s.length() ? String(s.substr(from)) : String();
+}
+
+String String::substring(unsigned int from, unsigned int to) const
+{
+	return from < s.length() ? String(s.substr(from, to - from)) : String();
+}
+
+void String::trim(void)
+{
+	size_t first = s.find_first_not_of(" \t\r\n");
+	size_t last = s.find_last_not_of(" \t\r\n");
+
+	if (first == std::string::npos)
+		s.clear();
+	else
+		s = s.substr(first, last - first + 1);
+}
+
+String operator+(const String &lhs, const String &rhs)
+{
+	return String(lhs.s + rhs.s);
+}
+
+size_t Print::write(const uint8_t *buf, size_t size)
+{
+	size_t n = 0;
+
+	while (size--)
+		n += write(*buf++);
+	return n;
+}
+
+size_t Print::print(long val, int base)
+{
+	if (base == DEC && val < 0)
+		return print('-') + print((unsigned long) -val, base);
+	return print((unsigned long) val, base);
+}
+
+size_t Print::print(unsigned long val, int base)
+{
+	char buf[sizeof(unsigned long) * 8 + 1];
+
+	snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%lu", val);
+	return write(buf);
+}
+
+size_t Print::print(double val, int digits)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%.*f", digits, val);
+	return write(buf);
+}
+
+size_t Print::printf(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	return write(buf);
+}
+
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+	addr.bytes[0] = a;
+	addr.bytes[1] = b;
+	addr.bytes[2] = c;
+	addr.bytes[3] = d;
+}
+
+bool IPAddress::fromString(const char *str)
+{
+	unsigned int a, b, c, d;
+	char tail;
+
+	if (sscanf(str, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail) != 4 ||
+	    a > 255 || b > 255 || c > 255 || d > 255)
+		return false;
+	*this = IPAddress(a, b, c, d);
+	return true;
+}
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+HardwareSerial Serial2;
+
+int HardwareSerial::available(void)
+{
+	return rx.length();
+}
+
+int HardwareSerial::read(void)
+{
+	int c;
+
+	if (rx.empty())
+		return -1;
+	c = (uint8_t) rx[0];
+	rx.erase(0, 1);
+	return c;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+	if (native_serial_echo && this == &Serial)
+		putchar(c);
+	return 1;
+}
+
+SPIClass SPI;
+EthernetClass Ethernet;
+WiFiClass WiFi;
+EEPROMClass EEPROM;
+M5StationClass M5;
+EspClass ESP;
+
+volatile uint8_t PORTD;
+volatile uint8_t PORTJ;
+volatile uint8_t DDRD;
+volatile uint8_t DDRJ;
+
+int EthernetClient::connect(IPAddress ip, uint16_t port)
+{
+	if (!native_broker_up) {
+		delay(connection_timeout);
+		return 0;
+	}
+	is_connected = true;
+	return 1;
+}
+
+#define WIFI_CLIENT_DEF_CONN_TIMEOUT_MS 3000
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+	return connect(ip, port, WIFI_CLIENT_DEF_CONN_TIMEOUT_MS);
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port, int32_t timeout)
+{
+	if (!native_broker_up) {
+		delay(timeout);
+		return 0;
+	}
+	is_connected = true;
+	return 1;
+}
+
+void EEPROMClass::write(int idx, uint8_t val)
+{
+	data[idx] = val;
+	dirty = true;
+	native_stats.eeprom_write_bytes++;
+}
+
+void EEPROMClass::update(int idx, uint8_t val)
+{
+	if (data[idx] != val)
+		write(idx, val);
+}
+
+bool EEPROMClass::commit(void)
+{
+	if (!dirty)
+		return true;
+	dirty = false;
+	native_stats.eeprom_commit_count++;
+	return true;
+}
+
+/* Simulated broker state is kept in fixed arrays so that it does not
+ * show up in the allocation statistics of the sketch.
+ */
+
+#define NATIVE_TOPIC_LEN 128
+#define NATIVE_SUBSCRIPTIONS_MAX 256
+#define NATIVE_INBOUND_MAX 64
+
+static char subscriptions[NATIVE_SUBSCRIPTIONS_MAX][NATIVE_TOPIC_LEN];
+static const char *subscription_ptrs[NATIVE_SUBSCRIPTIONS_MAX];
+static unsigned int subscription_count;
+
+static struct {
+	char topic[NATIVE_TOPIC_LEN];
+	char payload[MQTT_MAX_PACKET_SIZE];
+} inbound[NATIVE_INBOUND_MAX];
+static unsigned int inbound_head;
+static unsigned int inbound_tail;
+
+static PubSubClient *mqtt_client;
+
+PubSubClient &PubSubClient::setServer(IPAddress ip, uint16_t port)
+{
+	this->ip = ip;
+	this->port = port;
+	return *this;
+}
+
+PubSubClient &PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE)
+{
+	this->callback = callback;
+	mqtt_client = this;
+	return *this;
+}
+
+bool PubSubClient::connect(const char *id)
+{
+	if (!client->connected() && !client->connect(ip, port)) {
+		mqtt_state = MQTT_CONNECT_FAILED;
+		return false;
+	}
+	mqtt_state = MQTT_CONNECTED;
+	subscription_count = 0;
+	native_stats.mqtt_connect_count++;
+	return true;
+}
+
+void PubSubClient::disconnect(void)
+{
+	mqtt_state = MQTT_DISCONNECTED;
+	client->stop();
+}
+
+bool PubSubClient::connected(void)
+{
+	return client->connected() && mqtt_state == MQTT_CONNECTED;
+}
+
+bool PubSubClient::publish(const char *topic, const char *payload)
+{
+	return publish(topic, (const uint8_t *) payload, strlen(payload), false);
+}
+
+bool PubSubClient::publish(const char *topic, const char *payload,
+			   bool retained)
+{
+	return publish(topic, (const uint8_t *) payload, strlen(payload),
+		       retained);
+}
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload,
+			   unsigned int length, bool retained)
+{
+	if (!connected())
+		return false;
+	if (strlen(topic) + length + 7 > MQTT_MAX_PACKET_SIZE)
+		return false;
+	native_stats.mqtt_publish_count++;
+	native_stats.mqtt_publish_bytes += length;
+	return true;
+}
+
+bool PubSubClient::beginPublish(const char *topic, unsigned int length,
+				bool retained)
+{
+	return connected();
+}
+
+size_t PubSubClient::write(uint8_t c)
+{
+	native_stats.mqtt_publish_bytes++;
+	return 1;
+}
+
+size_t PubSubClient::write(const uint8_t *buf, size_t size)
+{
+	native_stats.mqtt_publish_bytes += size;
+	return size;
+}
+
+int PubSubClient::endPublish(void)
+{
+	native_stats.mqtt_publish_count++;
+	return 1;
+}
+
+bool PubSubClient::subscribe(const char *topic)
+{
+	if (!connected())
+		return false;
+	native_stats.mqtt_subscribe_count++;
+	if (subscription_count == NATIVE_SUBSCRIPTIONS_MAX)
+		return true;
+	strncpy(subscriptions[subscription_count], topic,
+		NATIVE_TOPIC_LEN - 1);
+	subscription_ptrs[subscription_count] =
+		subscriptions[subscription_count];
+	subscription_count++;
+	return true;
+}
+
+bool PubSubClient::unsubscribe(const char *topic)
+{
+	return connected();
+}
+
+bool PubSubClient::loop(void)
+{
+	if (!connected())
+		return false;
+	if (inbound_head != inbound_tail) {
+		unsigned int i = inbound_tail % NATIVE_INBOUND_MAX;
+
+		native_mqtt_deliver(inbound[i].topic, inbound[i].payload);
+		inbound_tail++;
+	}
+	return true;
+}
+
+void native_mqtt_deliver(const char *topic, const char *payload)
+{
+	static char topic_buf[NATIVE_TOPIC_LEN];
+	static uint8_t payload_buf[MQTT_MAX_PACKET_SIZE];
+	unsigned int length = strlen(payload);
+
+	if (!mqtt_client || !mqtt_client->callback)
+		return;
+	strncpy(topic_buf, topic, NATIVE_TOPIC_LEN - 1);
+	memcpy(payload_buf, payload, length);
+	mqtt_client->callback(topic_buf, payload_buf, length);
+}
+
+void native_mqtt_inject(const char *topic, const char *payload)
+{
+	unsigned int i = inbound_head % NATIVE_INBOUND_MAX;
+
+	if (inbound_head - inbound_tail == NATIVE_INBOUND_MAX)
+		return;
+	strncpy(inbound[i].topic, topic, NATIVE_TOPIC_LEN - 1);
+	strncpy(inbound[i].payload, payload, MQTT_MAX_PACKET_SIZE - 1);
+	inbound_head++;
+}
+
+void native_mqtt_disconnect(void)
+{
+	if (mqtt_client)
+		mqtt_client->disconnect();
+}
+
+unsigned int native_mqtt_subscriptions(const char ***topics)
+{
+	*topics = subscription_ptrs;
+	return subscription_count;
+}
@@ -0,0 +1,73 @@
+/*
+ * Native: hooks between the Arduino stand-in and the benchmark runner
+ * Copyright (c) 2026 Jiri Pirko <jiri@resnulli.us>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _NATIVE_H_
+#define _NATIVE_H_
+
+#include "Arduino.h"
+
+/* Simulated pin levels. digitalRead()/analogRead() return these,
+ * digitalWrite()/analogWrite() store into them.
+ */
+extern uint16_t native_pin_level[NATIVE_PINS_COUNT];
+extern uint8_t native_pin_mode[NATIVE_PINS_COUNT];
+extern bool native_pin_used[NATIVE_PINS_COUNT];
+
+/* Change an input pin level from outside, runs the attached
+ * interrupt handler if the change matches its mode.
+ */
+void native_pin_set(uint8_t pin, uint16_t level);
+
+/* Run the periodic esp_timer callbacks that are due, once for every
+ * period that has passed since the last run.
+ */
+void native_timers_run(void);
+
+/* End all FreeRTOS tasks the sketch created, before setup() runs again
+ * and before exit.
+ */
+void native_tasks_stop(void);
+
+/* Simulated broker. When it is down, TCP connect attempts block
+ * for the client connection timeout, just like the real thing.
+ */
+extern bool native_broker_up;
+
+void native_mqtt_deliver(const char *topic, const char *payload);
+void native_mqtt_inject(const char *topic, const char *payload);
+void native_mqtt_disconnect(void);
+unsigned int native_mqtt_subscriptions(const char ***topics);
+
+struct native_stats {
+	unsigned long alloc_count;
+	unsigned long alloc_bytes;
+	unsigned long mqtt_publish_count;
+	unsigned long mqtt_publish_bytes;
+	unsigned long mqtt_subscribe_count;
+	unsigned long mqtt_connect_count;
+	unsigned long eeprom_write_bytes;
+	unsigned long eeprom_commit_count;
+};
+
+extern struct native_stats native_stats;
+
+/* Print the sketch serial output to stdout. */
+extern bool native_serial_echo;
+
+#endif /* _NATIVE_H_ */
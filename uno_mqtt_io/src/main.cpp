@@ -31,6 +31,29 @@ char name[NAME_SIZE];
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Reading PINx directly avoids the port lookup and timer check digitalRead()
+ * does for every pin. Input pins are grouped by port in pins_init() so each
+ * used input register is read only once per scan. */
+#ifdef __AVR__
+#define INPUT_PORT_SCAN
+#endif
+
+/* Capture digital input edges from pin change interrupts instead of polling
+ * them in loop(). Each edge is queued with a timestamp and published, along
+ * with the timestamp on "<pin topic>/us", so a pulse shorter than a loop()
+ * pass is not lost. Input filter does not apply to these pins. */
+//#define INPUT_IRQ
+
+/* Subscribe to a few wildcard filters instead of each config item and
+ * output pin topic separately, saving a SUBSCRIBE round trip per topic
+ * on every connect. callback() ignores topics it does not know. */
+//#define MQTT_WILDCARD_SUBSCRIBE
+
+/* Besides the per-pin topics, publish the state of all pins as one
+ * retained JSON object on "<name>/state" on connect. Define this to also
+ * publish it after every loop() pass in which some pin changed. */
+//#define STATE_SNAPSHOT_ON_CHANGE
+
 enum pin_type {
 	PIN_TYPE_D,
 	PIN_TYPE_A,
@@ -42,6 +65,7 @@ enum pin_flavour {
 	PIN_FLAVOUR_DIGITAL_INPUT,
 	PIN_FLAVOUR_DIGITAL_OUTPUT,
 	PIN_FLAVOUR_PWM_OUTPUT,
+	PIN_FLAVOUR_COUNTER,
 };
 
 const char *pin_type_subtopic[] = {
@@ -55,6 +79,7 @@ const char *pin_flavour_subtopic[] = {
 	[PIN_FLAVOUR_DIGITAL_INPUT] = "din",
 	[PIN_FLAVOUR_DIGITAL_OUTPUT] = "dout",
 	[PIN_FLAVOUR_PWM_OUTPUT] = "pwmout",
+	[PIN_FLAVOUR_COUNTER] = "counter",
 };
 
 struct pin {
@@ -63,8 +88,14 @@ struct pin {
 	uint8_t pin; /* pin number */
 	uint8_t old_state;
 	uint8_t state;
-	uint8_t new_state_cnt:6,
-		flavour:2;
+	uint8_t flavour;
+	uint8_t filter; /* debounce window, ms */
+	volatile uint8_t debounced; /* level stable for at least filter */
+	uint8_t debounce_ms; /* how long the level differs from debounced */
+#ifdef INPUT_PORT_SCAN
+	uint8_t port; /* index into input_ports */
+	uint8_t mask; /* bit within the input port register */
+#endif
 };
 
 bool is_pin_output(struct pin *pin)
@@ -73,6 +104,14 @@ bool is_pin_output(struct pin *pin)
 	       pin->flavour == PIN_FLAVOUR_PWM_OUTPUT;
 }
 
+#ifdef INPUT_IRQ
+bool is_pin_irq(struct pin *pin)
+{
+	return pin->flavour == PIN_FLAVOUR_DIGITAL_INPUT &&
+	       pin->type != PIN_TYPE_AX;
+}
+#endif
+
 #define PIN_D(_index, _pin) {								\
 	.type = PIN_TYPE_D,								\
 	.index = _index,								\
@@ -101,9 +140,60 @@ struct pin_flavours {
 	uint8_t pin_flavours[PINS_COUNT];
 };
 
+struct pin_filters {
+	uint8_t pin_filters[PINS_COUNT]; /* ms, 0 or 0xff means config/filter */
+};
+
 #define for_each_pin(pin, i)								\
 	for (i = 0, pin = &pins[i]; i < PINS_COUNT; pin = &pins[++i])
 
+#ifdef INPUT_PORT_SCAN
+#define INPUT_PORTS_MAX 3 /* PORTB, PORTC, PORTD */
+
+struct input_port {
+	volatile uint8_t *reg;
+	uint8_t val;
+};
+
+struct input_port input_ports[INPUT_PORTS_MAX];
+uint8_t input_ports_count;
+
+void input_port_pin_init(struct pin *pin)
+{
+	volatile uint8_t *reg = portInputRegister(digitalPinToPort(pin->pin));
+	uint8_t i;
+
+	for (i = 0; i < input_ports_count; i++)
+		if (input_ports[i].reg == reg)
+			break;
+	if (i == input_ports_count)
+		input_ports[input_ports_count++].reg = reg;
+	pin->port = i;
+	pin->mask = digitalPinToBitMask(pin->pin);
+}
+
+void input_ports_read(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < input_ports_count; i++)
+		input_ports[i].val = *input_ports[i].reg;
+}
+
+uint8_t input_port_pin_read(struct pin *pin)
+{
+	return input_ports[pin->port].val & pin->mask ? HIGH : LOW;
+}
+#else
+static inline void input_port_pin_init(struct pin *pin) {}
+static inline void input_ports_read(void) {}
+
+static inline uint8_t input_port_pin_read(struct pin *pin)
+{
+	return digitalRead(pin->pin);
+}
+#endif
+
 #define TMP_BUF_LEN 64
 char tmp_buf[TMP_BUF_LEN];
 
@@ -122,6 +212,13 @@ char *pin_config_topic(struct pin *pin)
 	return tmp_buf;
 }
 
+char *pin_filter_config_topic(struct pin *pin)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/config/%s%u/filter", name,
+		 pin_type_subtopic[pin->type], pin->index);
+	return tmp_buf;
+}
+
 struct pin_flavours pin_flavours;
 
 void load_print_pin_flavours(void)
@@ -138,27 +235,216 @@ void load_print_pin_flavours(void)
 	}
 }
 
+bool state_changed; /* since the last state snapshot */
+
 void pin_publish(struct pin *pin)
 {
 	char state_buf[16];
 
 	sprintf(state_buf, "%u", pin->state);
+	state_changed = true;
 	client.publish(pin_topic(pin), state_buf);
 }
 
+/* beginPublish() needs the payload length up front, this only counts. */
+class CountingPrint : public Print {
+public:
+	size_t len = 0;
+
+	size_t write(uint8_t c) { len++; return 1; }
+	using Print::write;
+};
+
+/* The client sends every write() on its own, with Ethernet that is a TCP
+ * segment each. This collects the payload and passes it on in chunks.
+ */
+class BufferedPrint : public Print {
+public:
+	BufferedPrint(Print &out) : out(out) {}
+
+	size_t write(uint8_t c)
+	{
+		buf[len++] = c;
+		if (len == sizeof(buf))
+			flush();
+		return 1;
+	}
+	using Print::write;
+
+	void flush(void)
+	{
+		if (len)
+			out.write(buf, len);
+		len = 0;
+	}
+
+private:
+	Print &out;
+	uint8_t buf[64];
+	size_t len = 0;
+};
+
+char *state_topic(void)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/state", name);
+	return tmp_buf;
+}
+
+/* {"<pin subtopic>":<state>,...} */
+void state_snapshot_print(Print &out)
+{
+	bool first = true;
+	struct pin *pin;
+	uint8_t i;
+
+	out.print('{');
+	for_each_pin(pin, i) {
+		if (pin->flavour == PIN_FLAVOUR_DISABLED ||
+		    pin->flavour == PIN_FLAVOUR_COUNTER)
+			continue;
+		if (!first)
+			out.print(',');
+		first = false;
+		out.print('"');
+		out.print(pin_flavour_subtopic[pin->flavour]);
+		out.print('/');
+		out.print(pin_type_subtopic[pin->type]);
+		out.print(pin->index);
+		out.print("\":");
+		out.print(pin->state);
+	}
+	out.print('}');
+}
+
+void state_snapshot_publish(void)
+{
+	CountingPrint counter;
+	BufferedPrint out(client);
+
+	state_changed = false;
+	state_snapshot_print(counter);
+	if (!client.beginPublish(state_topic(), counter.len, true))
+		return;
+	state_snapshot_print(out);
+	out.flush();
+	client.endPublish();
+}
+
+/* Digital inputs are sampled and debounced from a 1 ms timer tick rather
+ * than by counting loop() passes, so the filter window does not depend on
+ * how busy loop() is. A new level has to hold for the pin's filter time
+ * before it becomes pin->debounced, loop() only picks that up. */
+uint8_t input_filter; /* default filter, ms */
+uint8_t debounce_pins[PINS_COUNT];
+uint8_t debounce_pins_count;
+
+bool is_pin_debounced(struct pin *pin)
+{
+#ifdef INPUT_IRQ
+	if (is_pin_irq(pin))
+		return false;
+#endif
+	return pin->flavour == PIN_FLAVOUR_DIGITAL_INPUT &&
+	       pin->type != PIN_TYPE_AX;
+}
+
+void debounce_tick(uint8_t ms)
+{
+	struct pin *pin;
+	uint8_t level;
+	uint8_t i;
+
+	input_ports_read();
+	for (i = 0; i < debounce_pins_count; i++) {
+		pin = &pins[debounce_pins[i]];
+		level = input_port_pin_read(pin);
+		if (level == pin->debounced) {
+			pin->debounce_ms = 0;
+			continue;
+		}
+		pin->debounce_ms = min(pin->debounce_ms + ms, 0xff);
+		if (pin->debounce_ms < pin->filter)
+			continue;
+		pin->debounced = level;
+		pin->debounce_ms = 0;
+	}
+}
+
+#ifdef __AVR__
+/* Timer0 already runs for millis(). Its compare A interrupt fires once per
+ * 1.024 ms period whatever OCR0A is set to, so PWM output on the Timer0
+ * pins is not disturbed. Timer2 would only tick at 490 Hz in the
+ * phase-correct PWM mode the core sets up. */
+ISR(TIMER0_COMPA_vect)
+{
+	debounce_tick(1);
+}
+
+void debounce_timer_start(void)
+{
+	TIMSK0 |= _BV(OCIE0A);
+}
+
+static inline void debounce_poll(void) {}
+#else
+unsigned long debounce_last;
+
+void debounce_timer_start(void)
+{
+	debounce_last = millis();
+}
+
+/* No timer hooked up, run the elapsed time as one tick from loop(). */
+void debounce_poll(void)
+{
+	unsigned long now = millis();
+	unsigned long ms = now - debounce_last;
+
+	if (!ms)
+		return;
+	debounce_last = now;
+	debounce_tick(min(ms, 0xffUL));
+}
+#endif
+
+void debounce_pin_init(struct pin *pin, uint8_t pin_index, uint8_t filter)
+{
+	pin->filter = filter && filter != 0xff ? filter : input_filter;
+	debounce_pins[debounce_pins_count++] = pin_index;
+}
+
+void debounce_start(void)
+{
+	struct pin *pin;
+	uint8_t i;
+
+	input_ports_read();
+	for (i = 0; i < debounce_pins_count; i++) {
+		pin = &pins[debounce_pins[i]];
+		pin->debounced = input_port_pin_read(pin);
+		pin->debounce_ms = 0;
+	}
+	debounce_timer_start();
+}
+
 void input_pins_update_state()
 {
 	uint8_t new_state;
 	struct pin *pin;
 	uint8_t i;
 
+	debounce_poll();
 	for_each_pin(pin, i) {
 		switch (pin->flavour) {
 		case PIN_FLAVOUR_DIGITAL_INPUT:
 			switch (pin->type) {
 			case PIN_TYPE_D: /* fall-through */
 			case PIN_TYPE_A:
-				new_state = digitalRead(pin->pin);
+				/* INPUT_IRQ pins go unfiltered, read the
+				 * port as last sampled by the tick. */
+				new_state = is_pin_debounced(pin) ?
+					    pin->debounced :
+					    input_port_pin_read(pin);
 				break;
 			case PIN_TYPE_AX:
 				new_state = analogRead(pin->pin) < 500 ? 0 : 1;
@@ -172,8 +458,6 @@ void input_pins_update_state()
 	}
 }
 
-uint8_t input_filter;
-
 void input_pins_publish(bool changed_only)
 {
 	struct pin *pin;
@@ -182,25 +466,254 @@ void input_pins_publish(bool changed_only)
 	for_each_pin(pin, i) {
 		switch (pin->flavour) {
 		case PIN_FLAVOUR_DIGITAL_INPUT:
-			if (changed_only) {
-				if (pin->old_state == pin->state) {
-					pin->new_state_cnt = 0;
-					continue;
-				}
-				if (pin->new_state_cnt++ < input_filter)
-					continue;
-			}
+#ifdef INPUT_IRQ
+			if (changed_only && is_pin_irq(pin))
+				continue;
+#endif
+			if (changed_only && pin->old_state == pin->state)
+				continue;
 			pin_publish(pin);
 			pin->old_state = pin->state;
-			pin->new_state_cnt = 0;
 			break;
 		}
 	}
 }
 
+#ifdef INPUT_IRQ
+#define PIN_EVENTS_SIZE 32 /* power of 2 */
+
+struct pin_event {
+	uint8_t pin_index;
+	uint8_t level;
+	unsigned long us;
+};
+
+/* Single producer (ISR), single consumer (loop()). Head is only written
+ * by the ISR, tail only by loop(), so no locking is needed. */
+volatile struct pin_event pin_events[PIN_EVENTS_SIZE];
+volatile uint8_t pin_events_head;
+volatile uint8_t pin_events_tail;
+volatile bool pin_events_overflow;
+
+#define PCINT_GROUPS 3 /* PCINT0 (PORTB), PCINT1 (PORTC), PCINT2 (PORTD) */
+#define PCINT_NONE 0xff
+
+struct pcint_group {
+	volatile uint8_t *reg;
+	uint8_t last;
+	uint8_t pin_index[8];
+};
+
+struct pcint_group pcint_groups[PCINT_GROUPS];
+
+void pin_event_push(uint8_t pin_index, uint8_t level, unsigned long us)
+{
+	uint8_t head = pin_events_head;
+	volatile struct pin_event *event;
+
+	if ((uint8_t) (head - pin_events_tail) == PIN_EVENTS_SIZE) {
+		pin_events_overflow = true;
+		return;
+	}
+	event = &pin_events[head % PIN_EVENTS_SIZE];
+	event->pin_index = pin_index;
+	event->level = level;
+	event->us = us;
+	pin_events_head = head + 1;
+}
+
+void pcint_group_process(struct pcint_group *group)
+{
+	unsigned long us = micros();
+	uint8_t val = *group->reg;
+	uint8_t changed = val ^ group->last;
+	uint8_t bit;
+
+	group->last = val;
+	for (bit = 0; bit < 8; bit++) {
+		if (!(changed & _BV(bit)) || group->pin_index[bit] == PCINT_NONE)
+			continue;
+		pin_event_push(group->pin_index[bit], !!(val & _BV(bit)), us);
+	}
+}
+
+ISR(PCINT0_vect)
+{
+	pcint_group_process(&pcint_groups[0]);
+}
+
+ISR(PCINT1_vect)
+{
+	pcint_group_process(&pcint_groups[1]);
+}
+
+ISR(PCINT2_vect)
+{
+	pcint_group_process(&pcint_groups[2]);
+}
+
+void pcint_pin_init(struct pin *pin, uint8_t pin_index)
+{
+	struct pcint_group *group;
+	uint8_t bit;
+
+	group = &pcint_groups[digitalPinToPCICRbit(pin->pin)];
+	bit = digitalPinToPCMSKbit(pin->pin);
+	if (!group->reg) {
+		group->reg = portInputRegister(digitalPinToPort(pin->pin));
+		memset(group->pin_index, PCINT_NONE, sizeof(group->pin_index));
+	}
+	group->pin_index[bit] = pin_index;
+	group->last = *group->reg;
+	*digitalPinToPCMSK(pin->pin) |= _BV(bit);
+	*digitalPinToPCICR(pin->pin) |= _BV(digitalPinToPCICRbit(pin->pin));
+}
+
+char *pin_us_topic(struct pin *pin)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/%s/%s%u/us", name,
+		 pin_flavour_subtopic[pin->flavour],
+		 pin_type_subtopic[pin->type], pin->index);
+	return tmp_buf;
+}
+
+void pin_events_reset(void)
+{
+	pin_events_tail = pin_events_head;
+	pin_events_overflow = false;
+}
+
+void pin_events_process(void)
+{
+	uint8_t tail = pin_events_tail;
+	volatile struct pin_event *event;
+	char state_buf[16];
+	unsigned long us;
+	struct pin *pin;
+	uint8_t level;
+
+	while (tail != pin_events_head) {
+		event = &pin_events[tail % PIN_EVENTS_SIZE];
+		pin = &pins[event->pin_index];
+		level = event->level;
+		us = event->us;
+		pin_events_tail = ++tail;
+
+		sprintf(state_buf, "%lu", us);
+		client.publish(pin_us_topic(pin), state_buf);
+		sprintf(state_buf, "%u", level);
+		client.publish(pin_topic(pin), state_buf);
+		pin->old_state = level;
+		state_changed = true;
+	}
+
+	if (pin_events_overflow) {
+		/* Edges were lost, publish the current state of all pins. */
+		pin_events_reset();
+		input_pins_publish(false);
+	}
+}
+#endif
+
+/* Pulse counter, meant for S0 outputs of energy and water meters. Falling
+ * edges are counted from external interrupt, so only pins with INTx can be
+ * counters. The total is published on the pin topic and the rate, in
+ * pulses per hour, on "<pin topic>/rate" every counter_interval seconds.
+ * For a 1000 imp/kWh meter the rate equals power in W. */
+#define COUNTERS_COUNT 2 /* INT0 (D2), INT1 (D3) */
+
+struct counter {
+	struct pin *pin;
+	volatile uint32_t count;
+	uint32_t count_last; /* count at the last rate publish */
+};
+
+struct counter counters[COUNTERS_COUNT];
+
+void counter0_isr(void)
+{
+	counters[0].count++;
+}
+
+void counter1_isr(void)
+{
+	counters[1].count++;
+}
+
+void (*counter_isrs[COUNTERS_COUNT])(void) = {
+	counter0_isr,
+	counter1_isr,
+};
+
+uint32_t counter_read(struct counter *counter)
+{
+	uint32_t count;
+
+	noInterrupts();
+	count = counter->count;
+	interrupts();
+	return count;
+}
+
+bool counter_pin_init(struct pin *pin)
+{
+	uint8_t irq = digitalPinToInterrupt(pin->pin);
+	struct counter *counter;
+
+	if (irq >= COUNTERS_COUNT)
+		return false;
+	counter = &counters[irq];
+	counter->pin = pin;
+	counter->count_last = counter->count;
+	attachInterrupt(irq, counter_isrs[irq], FALLING);
+	return true;
+}
+
+char *pin_rate_topic(struct pin *pin)
+{
+	snprintf(tmp_buf, TMP_BUF_LEN, "%s/%s/%s%u/rate", name,
+		 pin_flavour_subtopic[pin->flavour],
+		 pin_type_subtopic[pin->type], pin->index);
+	return tmp_buf;
+}
+
+uint16_t counter_interval; /* seconds */
+static unsigned long counters_last_publish;
+
+void counters_publish(unsigned long now, bool force)
+{
+	unsigned long elapsed = now - counters_last_publish;
+	struct counter *counter;
+	char state_buf[16];
+	uint32_t count;
+	uint32_t rate;
+	uint8_t i;
+
+	if (!force && elapsed < counter_interval * 1000UL)
+		return;
+
+	for (i = 0; i < COUNTERS_COUNT; i++) {
+		counter = &counters[i];
+		if (!counter->pin)
+			continue;
+		count = counter_read(counter);
+		sprintf(state_buf, "%lu", (unsigned long) count);
+		client.publish(pin_topic(counter->pin), state_buf);
+		if (force)
+			continue;
+		rate = (uint64_t) (count - counter->count_last) * 3600000 / elapsed;
+		sprintf(state_buf, "%lu", (unsigned long) rate);
+		client.publish(pin_rate_topic(counter->pin), state_buf);
+		counter->count_last = count;
+	}
+	if (!force)
+		counters_last_publish = now;
+}
+
 void output_pin_update_state(struct pin *pin, uint8_t new_state)
 {
 	pin->state = new_state;
+	state_changed = true;
 	switch (pin->flavour) {
 	case PIN_FLAVOUR_DIGITAL_OUTPUT:
 		digitalWrite(pin->pin, pin->state);
@@ -229,26 +742,48 @@ void pins_subscribe(void)
 
 	for_each_pin(pin, i) {
 		client.subscribe(pin_config_topic(pin));
+		client.subscribe(pin_filter_config_topic(pin));
 		if (is_pin_output(pin))
 			client.subscribe(pin_topic(pin));
 	}
 }
 
+struct pin_filters pin_filters;
+
 void pins_init(void)
 {
 	struct pin *pin;
 	uint8_t i;
 
+	debounce_pins_count = 0;
 	for_each_pin(pin, i) {
 		switch (pin->flavour){
 		case PIN_FLAVOUR_DIGITAL_INPUT:
 			pinMode(pin->pin, INPUT);
+			if (pin->type != PIN_TYPE_AX)
+				input_port_pin_init(pin);
+#ifdef INPUT_IRQ
+			if (is_pin_irq(pin))
+				pcint_pin_init(pin, i);
+#endif
+			if (is_pin_debounced(pin))
+				debounce_pin_init(pin, i,
+						  pin_filters.pin_filters[i]);
 			break;
 		case PIN_FLAVOUR_DIGITAL_OUTPUT:
 			pinMode(pin->pin, OUTPUT);
 			break;
+		case PIN_FLAVOUR_COUNTER:
+			pinMode(pin->pin, INPUT_PULLUP);
+			if (!counter_pin_init(pin)) {
+				Serial.print(pin_config_topic(pin));
+				Serial.println(": NO COUNTER IRQ");
+				pin->flavour = PIN_FLAVOUR_DISABLED;
+			}
+			break;
 		}
 	}
+	debounce_start();
 }
 
 char *config_topic(const char *item)
@@ -275,8 +810,12 @@ byte eeprom_default_mac[] = {0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
 IPAddress eeprom_default_ip = IPAddress(172, 22, 1, 10);
 IPAddress eeprom_default_mqttip = IPAddress(172, 22, 1, 1);
 uint8_t eeprom_default_filter = 16;
-#define EEPROM_FILTER_MAX 32
+#define EEPROM_FILTER_MAX 256 /* ms */
 static struct pin_flavours eeprom_default_pin_flavours; /* all zeroes means all digital inputs */
+uint16_t eeprom_default_counter_interval = 60;
+#define EEPROM_COUNTER_INTERVAL_MAX 3600
+static uint32_t eeprom_default_counts[COUNTERS_COUNT];
+static struct pin_filters eeprom_default_pin_filters; /* all zeroes means config/filter for all */
 
 
 #define EEPROM_MAGIC_OFFSET 0
@@ -303,6 +842,15 @@ static struct pin_flavours eeprom_default_pin_flavours; /* all zeroes means all
 #define EEPROM_PIN_FLAVOURS_OFFSET EEPROM_FILTER_OFFSET + EEPROM_FILTER_SIZE
 #define EEPROM_PIN_FLAVOURS_SIZE sizeof(struct pin_flavours)
 
+#define EEPROM_COUNTER_INTERVAL_OFFSET EEPROM_PIN_FLAVOURS_OFFSET + EEPROM_PIN_FLAVOURS_SIZE
+#define EEPROM_COUNTER_INTERVAL_SIZE sizeof(eeprom_default_counter_interval)
+
+#define EEPROM_COUNTS_OFFSET EEPROM_COUNTER_INTERVAL_OFFSET + EEPROM_COUNTER_INTERVAL_SIZE
+#define EEPROM_COUNTS_SIZE sizeof(eeprom_default_counts)
+
+#define EEPROM_PIN_FILTERS_OFFSET EEPROM_COUNTS_OFFSET + EEPROM_COUNTS_SIZE
+#define EEPROM_PIN_FILTERS_SIZE sizeof(struct pin_filters)
+
 void eeprom_check(void)
 {
 	uint32_t magic;
@@ -319,6 +867,52 @@ void eeprom_check(void)
 	EEPROM.put(EEPROM_MQTTIP_OFFSET, eeprom_default_mqttip);
 	EEPROM.put(EEPROM_FILTER_OFFSET, eeprom_default_filter);
 	EEPROM.put(EEPROM_PIN_FLAVOURS_OFFSET, eeprom_default_pin_flavours);
+	EEPROM.put(EEPROM_COUNTER_INTERVAL_OFFSET, eeprom_default_counter_interval);
+	EEPROM.put(EEPROM_COUNTS_OFFSET, eeprom_default_counts);
+	EEPROM.put(EEPROM_PIN_FILTERS_OFFSET, eeprom_default_pin_filters);
+}
+
+/* Counter totals survive reboot. EEPROM cells wear out, so write them at
+ * most once per interval and only if they changed. */
+#define COUNTERS_CHECKPOINT_INTERVAL (60UL * 60 * 1000)
+
+static uint32_t counts[COUNTERS_COUNT];
+static unsigned long counters_last_checkpoint;
+
+void counters_load(void)
+{
+	uint8_t i;
+
+	EEPROM.get(EEPROM_COUNTS_OFFSET, counts);
+	for (i = 0; i < COUNTERS_COUNT; i++) {
+		/* Erased area after upgrade from layout without counters. */
+		if (counts[i] == 0xffffffff)
+			counts[i] = 0;
+		counters[i].count = counts[i];
+	}
+}
+
+void counters_checkpoint(unsigned long now)
+{
+	bool changed = false;
+	uint32_t count;
+	uint8_t i;
+
+	if (now - counters_last_checkpoint < COUNTERS_CHECKPOINT_INTERVAL)
+		return;
+	counters_last_checkpoint = now;
+
+	for (i = 0; i < COUNTERS_COUNT; i++) {
+		if (!counters[i].pin)
+			continue;
+		count = counter_read(&counters[i]);
+		if (counts[i] == count)
+			continue;
+		counts[i] = count;
+		changed = true;
+	}
+	if (changed)
+		EEPROM.put(EEPROM_COUNTS_OFFSET, counts);
 }
 
 void payload_mac_to_eeprom(int offset, int size, byte *payload, int length)
@@ -327,7 +921,7 @@ void payload_mac_to_eeprom(int offset, int size, byte *payload, int length)
 	uint8_t i;
 
 	for (i = 0; i < 6; i++) {
-		EEPROM.write(offset + i, strtol(pos, &pos, 16));
+		EEPROM.update(offset + i, strtol(pos, &pos, 16));
 		pos++;
 		if (pos >= (char *) payload + length)
 			return;
@@ -341,9 +935,9 @@ void str_to_eeprom(int offset, int size, byte *payload, int length)
 
 	for (i = 0; i < size; i++) {
 		if (i + 1 == size || i >= length)
-			EEPROM.write(offset + i, 0);
+			EEPROM.update(offset + i, 0);
 		else
-			EEPROM.write(offset + i, *pos++);
+			EEPROM.update(offset + i, *pos++);
 	}
 }
 
@@ -362,6 +956,9 @@ bool check_pin_flavours_to_eeprom(char *topic, byte *payload,
 		else if (!strcmp((const char *) payload,
 			    pin_flavour_subtopic[PIN_FLAVOUR_DIGITAL_OUTPUT]))
 			pin_flavours.pin_flavours[i] = PIN_FLAVOUR_DIGITAL_OUTPUT;
+		else if (!strcmp((const char *) payload,
+			    pin_flavour_subtopic[PIN_FLAVOUR_COUNTER]))
+			pin_flavours.pin_flavours[i] = PIN_FLAVOUR_COUNTER;
 		else
 			continue;
 		EEPROM.put(EEPROM_PIN_FLAVOURS_OFFSET, pin_flavours);
@@ -370,6 +967,26 @@ bool check_pin_flavours_to_eeprom(char *topic, byte *payload,
 	return false;
 }
 
+bool check_pin_filters_to_eeprom(char *topic, byte *payload,
+				 unsigned int length)
+{
+	struct pin *pin;
+	uint32_t filter;
+	uint8_t i;
+
+	for_each_pin(pin, i) {
+		if (strcmp(topic, pin_filter_config_topic(pin)))
+			continue;
+		filter = strtol((const char *) payload, NULL, 10);
+		if (filter >= 0xff)
+			return true;
+		pin_filters.pin_filters[i] = filter;
+		EEPROM.put(EEPROM_PIN_FILTERS_OFFSET, pin_filters);
+		return true;
+	}
+	return false;
+}
+
 void callback(char *topic, byte *payload, unsigned int length)
 {
 	payload[length] = '\0';
@@ -395,14 +1012,132 @@ void callback(char *topic, byte *payload, unsigned int length)
 		uint32_t filter = strtol((const char *) payload, NULL, 10);
 
 		if (filter < EEPROM_FILTER_MAX)
-			EEPROM.put(EEPROM_FILTER_OFFSET, filter);
+			EEPROM.put(EEPROM_FILTER_OFFSET, (uint8_t) filter);
+	} else if (!strcmp(topic, config_topic("counter_interval"))) {
+		uint32_t interval = strtol((const char *) payload, NULL, 10);
+
+		if (interval && interval <= EEPROM_COUNTER_INTERVAL_MAX)
+			EEPROM.put(EEPROM_COUNTER_INTERVAL_OFFSET, (uint16_t) interval);
 	} else if (check_pin_flavours_to_eeprom(topic, payload, length)) {
+	} else if (check_pin_filters_to_eeprom(topic, payload, length)) {
 	} else {
 		pins_msg_process(topic, (const char *) payload);
 	}
 	digitalWrite(LED_BUILTIN, LOW);
 }
 
+/* The MQTT connection is driven from loop() one step per pass, TCP connect
+ * first, MQTT CONNECT/CONNACK in the next pass, each bounded by a short
+ * timeout, so local I/O keeps running while the broker is away. Failed
+ * attempts are retried with jittered exponential backoff. */
+#define MQTT_PORT 1883
+#define MQTT_TCP_TIMEOUT 500 /* ms */
+#define MQTT_SOCKET_TIMEOUT 1 /* s, CONNACK wait */
+#define MQTT_RETRY_TIMEOUT_MIN 1000
+#define MQTT_RETRY_TIMEOUT_MAX 60000
+
+enum mqtt_state {
+	MQTT_STATE_TCP_CONNECT,
+	MQTT_STATE_MQTT_CONNECT,
+	MQTT_STATE_CONNECTED,
+	MQTT_STATE_BACKOFF,
+};
+
+static enum mqtt_state mqtt_state;
+static IPAddress mqtt_server;
+static unsigned long mqtt_retry_timeout = MQTT_RETRY_TIMEOUT_MIN;
+static unsigned long mqtt_backoff_timeout;
+static unsigned long mqtt_last_attempt;
+
+void mqtt_backoff(unsigned long now)
+{
+	/* Jitter spreads out reconnects of devices that lost the broker
+	 * at the same time. */
+	mqtt_backoff_timeout = mqtt_retry_timeout +
+			       random(mqtt_retry_timeout / 2);
+	mqtt_retry_timeout = min(mqtt_retry_timeout * 2,
+				 (unsigned long) MQTT_RETRY_TIMEOUT_MAX);
+	mqtt_last_attempt = now;
+	mqtt_state = MQTT_STATE_BACKOFF;
+}
+
+#ifdef MQTT_WILDCARD_SUBSCRIBE
+void wildcard_subscribe(void)
+{
+	bool subscribed[ARRAY_SIZE(pin_flavour_subtopic)] = {};
+	struct pin *pin;
+	uint8_t i;
+
+	client.subscribe(config_topic("#"));
+	for_each_pin(pin, i) {
+		if (!is_pin_output(pin) || subscribed[pin->flavour])
+			continue;
+		snprintf(tmp_buf, TMP_BUF_LEN, "%s/%s/#", name,
+			 pin_flavour_subtopic[pin->flavour]);
+		client.subscribe(tmp_buf);
+		subscribed[pin->flavour] = true;
+	}
+}
+#endif
+
+void mqtt_connected_setup(unsigned long now)
+{
+#ifdef INPUT_IRQ
+	pin_events_reset();
+#endif
+	input_pins_update_state();
+	input_pins_publish(false);
+	counters_publish(now, true);
+	state_snapshot_publish();
+#ifdef MQTT_WILDCARD_SUBSCRIBE
+	wildcard_subscribe();
+#else
+	client.subscribe(config_topic("name"));
+	client.subscribe(config_topic("mac"));
+	client.subscribe(config_topic("ip"));
+	client.subscribe(config_topic("mqttip"));
+	client.subscribe(config_topic("filter"));
+	client.subscribe(config_topic("counter_interval"));
+	pins_subscribe();
+#endif
+}
+
+bool mqtt_process(unsigned long now)
+{
+	switch (mqtt_state) {
+	case MQTT_STATE_TCP_CONNECT:
+		if (ethClient.connect(mqtt_server, MQTT_PORT))
+			mqtt_state = MQTT_STATE_MQTT_CONNECT;
+		else
+			mqtt_backoff(now);
+		break;
+	case MQTT_STATE_MQTT_CONNECT:
+		/* TCP is up already, so this only does CONNECT/CONNACK. */
+		if (!client.connect(name)) {
+			ethClient.stop();
+			mqtt_backoff(now);
+			break;
+		}
+		Serial.println("CONNECTED");
+		mqtt_retry_timeout = MQTT_RETRY_TIMEOUT_MIN;
+		mqtt_state = MQTT_STATE_CONNECTED;
+		mqtt_connected_setup(now);
+		break;
+	case MQTT_STATE_CONNECTED:
+		if (client.connected())
+			return true;
+		Serial.println("DISCONNECTED");
+		ethClient.stop();
+		mqtt_state = MQTT_STATE_TCP_CONNECT;
+		break;
+	case MQTT_STATE_BACKOFF:
+		if (now - mqtt_last_attempt >= mqtt_backoff_timeout)
+			mqtt_state = MQTT_STATE_TCP_CONNECT;
+		break;
+	}
+	return false;
+}
+
 void setup(void)
 {
 	byte mac[MAC_LEN];
@@ -422,6 +1157,7 @@ void setup(void)
 	EEPROM.get(EEPROM_MAC_OFFSET, mac);
 	mac[0] &= 0xfe; /* Clear multicast bit. */
 	mac[0] |= 0x02; /* Set local assignment bit. */
+	randomSeed(mac[3] << 16 | mac[4] << 8 | mac[5]);
 
 	sprintf(macstr, "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 	Serial.print("MAC:");
@@ -439,53 +1175,44 @@ void setup(void)
 	Serial.print("FILTER:");
 	Serial.println(input_filter);
 
+	EEPROM.get(EEPROM_COUNTER_INTERVAL_OFFSET, counter_interval);
+	if (!counter_interval || counter_interval > EEPROM_COUNTER_INTERVAL_MAX)
+		counter_interval = eeprom_default_counter_interval;
+	Serial.print("COUNTER INTERVAL:");
+	Serial.println(counter_interval);
+
 	EEPROM.get(EEPROM_PIN_FLAVOURS_OFFSET, pin_flavours);
 	Serial.println("PIN FLAVOURS:");
 	load_print_pin_flavours();
+	EEPROM.get(EEPROM_PIN_FILTERS_OFFSET, pin_filters);
+	counters_load();
 
 	Ethernet.begin(mac, ip);
 	pins_init();
 
-	client.setServer(mqttip, 1883);
+	client.setServer(mqttip, MQTT_PORT);
+	client.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+	mqtt_server = mqttip;
+	ethClient.setConnectionTimeout(MQTT_TCP_TIMEOUT);
 	client.setCallback(callback);
 }
 
-#define MQTT_RETRY_TIMEOUT 5000
-
-static bool mqtt_connected;
-static unsigned long mqtt_last_attempt;
-
 void loop(void)
 {
 	unsigned long now = millis();
 
-	if (!client.connected()) {
-		if (mqtt_connected) {
-			mqtt_last_attempt = 0;
-			Serial.println("DISCONNECTED");
-			mqtt_connected = false;
-		}
-		if (!mqtt_last_attempt ||
-		    mqtt_last_attempt + MQTT_RETRY_TIMEOUT < now ||
-		    mqtt_last_attempt > now) {
-			mqtt_last_attempt = now;
-
-			if (client.connect(name)) {
-				Serial.println("CONNECTED");
-				mqtt_connected = true;
-				input_pins_update_state();
-				input_pins_publish(false);
-				client.subscribe(config_topic("name"));
-				client.subscribe(config_topic("mac"));
-				client.subscribe(config_topic("ip"));
-				client.subscribe(config_topic("mqttip"));
-				client.subscribe(config_topic("filter"));
-				pins_subscribe();
-			}
-		}
-	} else {
+	if (mqtt_process(now)) {
 		input_pins_update_state();
+#ifdef INPUT_IRQ
+		pin_events_process();
+#endif
 		input_pins_publish(true);
+#ifdef STATE_SNAPSHOT_ON_CHANGE
+		if (state_changed)
+			state_snapshot_publish();
+#endif
+		counters_publish(now, false);
 		client.loop();
 	}
+	counters_checkpoint(now);
 }
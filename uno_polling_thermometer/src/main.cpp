@@ -23,6 +23,16 @@
 
 #define ONE_WIRE_BUS 2
 
+/* Start the temperature conversion on all devices at once with a skip ROM
+ * Convert T, wait one conversion time and then read the scratchpads one by
+ * one. Comment out to convert device by device, which takes up to
+ * a conversion time per device.
+ */
+#define OW_TEMP_PARALLEL_CONVERSION
+
+/* 9 to 12 bits, each bit less halves the conversion time. */
+#define OW_TEMP_RESOLUTION 12
+
 OneWire oneWire(ONE_WIRE_BUS);
 DallasTemperature sensors(&oneWire);
 
@@ -45,28 +55,32 @@ struct ow_temp_device {
 };
 
 #define OW_TEMP_DEVICE_MAX 16
+#define OW_TEMP_RESCAN_INTERVAL 600000 /* ms */
 
+/* The device list is kept across read cycles. The bus is searched again
+ * only when the list is not known yet, once per OW_TEMP_RESCAN_INTERVAL
+ * and on the next cycle after some device failed to read.
+ */
 struct ow_temp {
+	bool search_needed;
+	unsigned long last_search_millis;
 	bool read_in_progress;
 	unsigned long last_read_millis;
 	bool waiting_on_conversion;
 	unsigned long start_conversion_millis;
+	bool conversion_done;
 	bool had_devices;
 	int current_device;
 	uint8_t device_count;
 	struct ow_temp_device device[OW_TEMP_DEVICE_MAX];
 };
 
-static void ow_temp_scan(struct ow_temp *temp, unsigned int interval)
+static void ow_temp_search(struct ow_temp *temp)
 {
-	unsigned long now = millis();
 	DeviceAddress address;
+	uint8_t i;
 
-	if (temp->last_read_millis &&
-	    (now - temp->last_read_millis < interval))
-		return;
-
-	memset(temp, 0, sizeof(*temp));
+	temp->device_count = 0;
 	oneWire.reset_search();
 	while (oneWire.search(address)) {
 		if (OneWire::crc8(address, 7) != address[7] ||
@@ -75,14 +89,42 @@ static void ow_temp_scan(struct ow_temp *temp, unsigned int interval)
 		memcpy(temp->device[temp->device_count++].address, address,
 		       sizeof(address));
 	}
+	/* The library writes the configuration only where it differs. */
+	for (i = 0; i < temp->device_count; i++)
+		sensors.setResolution(temp->device[i].address,
+				      OW_TEMP_RESOLUTION, true);
+	temp->search_needed = false;
+	temp->last_search_millis = millis();
 	if (temp->device_count) {
-		temp->read_in_progress = true;
 		temp->had_devices = true;
 	} else if (temp->had_devices) {
+		temp->had_devices = false;
 		ow_temp_init();
 	}
 }
 
+static void ow_temp_scan(struct ow_temp *temp, unsigned int interval)
+{
+	unsigned long now = millis();
+
+	if (temp->last_read_millis &&
+	    (now - temp->last_read_millis < interval))
+		return;
+
+	temp->last_read_millis = now;
+	if (!temp->last_search_millis || temp->search_needed ||
+	    now - temp->last_search_millis > OW_TEMP_RESCAN_INTERVAL)
+		ow_temp_search(temp);
+
+	temp->current_device = 0;
+	temp->waiting_on_conversion = false;
+	temp->conversion_done = false;
+	if (temp->device_count)
+		temp->read_in_progress = true;
+	else
+		temp->search_needed = true;
+}
+
 static bool ow_temp_device_next(struct ow_temp *temp)
 {
 	unsigned long now = millis();
@@ -96,9 +138,64 @@ static bool ow_temp_device_next(struct ow_temp *temp)
 	return true;
 }
 
+static void ow_temp_device_read(struct ow_temp *temp)
+{
+	float temp_value;
+
+	temp_value = sensors.getTempC(temp->device[temp->current_device].address);
+	if (temp_value == DEVICE_DISCONNECTED_C) {
+		temp->search_needed = true;
+	} else {
+		Serial.print("Found device: ");
+		printAddress(temp->device[temp->current_device].address);
+		Serial.print(", temp C: ");
+		Serial.println(temp_value);
+	}
+}
+
+/* DS18B20 needs 750 ms at 12 bits, half of it for each bit less. Don't
+ * bother the bus before that, give up a while after.
+ */
+#define OW_TEMP_CONVERSION_TIME (750 >> (12 - OW_TEMP_RESOLUTION))
+#define OW_TEMP_CONVERSION_TIMEOUT (OW_TEMP_CONVERSION_TIME + 200)
+
+#ifdef OW_TEMP_PARALLEL_CONVERSION
+static void ow_temp_conversion_start(struct ow_temp *temp)
+{
+	sensors.requestTemperatures();
+	temp->waiting_on_conversion = true;
+	temp->start_conversion_millis = millis();
+}
+
+static void ow_temp_conversion_wait_check(struct ow_temp *temp)
+{
+	unsigned long now = millis();
+
+	if (now - temp->start_conversion_millis < OW_TEMP_CONVERSION_TIME)
+		return;
+	if (sensors.isConversionComplete()) {
+		temp->conversion_done = true;
+	} else if (now - temp->start_conversion_millis > OW_TEMP_CONVERSION_TIMEOUT) {
+		/* Nothing to read, try again next interval. */
+		temp->search_needed = true;
+		temp->read_in_progress = false;
+		temp->last_read_millis = now;
+	} else {
+		return;
+	}
+	temp->waiting_on_conversion = false;
+}
+
+static void ow_temp_device_read_next(struct ow_temp *temp)
+{
+	ow_temp_device_read(temp);
+	ow_temp_device_next(temp);
+}
+#else
 static void ow_temp_conversion_start(struct ow_temp *temp)
 {
 	while (!sensors.requestTemperaturesByAddress(temp->device[temp->current_device].address)) {
+		temp->search_needed = true;
 		if (!ow_temp_device_next(temp))
 			return;
 	}
@@ -106,36 +203,34 @@ static void ow_temp_conversion_start(struct ow_temp *temp)
 	temp->start_conversion_millis = millis();;
 }
 
-#define OW_TEMP_CONVERSION_TIMEOUT 950
-
 static void ow_temp_conversion_wait_check(struct ow_temp *temp)
 {
 	unsigned long now = millis();
-	float temp_value;
 
+	if (now - temp->start_conversion_millis < OW_TEMP_CONVERSION_TIME)
+		return;
 	if (!sensors.isConversionComplete()) {
 		if (now - temp->start_conversion_millis > OW_TEMP_CONVERSION_TIMEOUT)
 			goto next;
 		return;
 	}
 
-	temp_value = sensors.getTempC(temp->device[temp->current_device].address);
-	if (temp_value != DEVICE_DISCONNECTED_C) {
-		Serial.print("Found device: ");
-		printAddress(temp->device[temp->current_device].address);
-		Serial.print(", temp C: ");
-		Serial.println(temp_value);
-	}
+	ow_temp_device_read(temp);
 
 next:
 	temp->waiting_on_conversion = false;
 	ow_temp_device_next(temp);
 }
+#endif
 
 static void ow_temp_process(struct ow_temp *temp, unsigned int interval)
 {
 	if (!temp->read_in_progress)
 		ow_temp_scan(temp, interval);
+#ifdef OW_TEMP_PARALLEL_CONVERSION
+	else if (temp->conversion_done)
+		ow_temp_device_read_next(temp);
+#endif
 	else {
 		if (!temp->waiting_on_conversion)
 			ow_temp_conversion_start(temp);
@@ -26,6 +26,11 @@
 #define LED_BUILTIN 13
 #define ONE_WIRE_BUS 2
 
+/* 9 to 12 bits, requestTemperatures() blocks for 750 ms at 12 bits and
+ * half of it for each bit less.
+ */
+#define OW_TEMP_RESOLUTION 12
+
 OneWire oneWire(ONE_WIRE_BUS);
 DallasTemperature sensors(&oneWire);
 
@@ -40,6 +45,7 @@ void setup()
 	Serial.begin(9600);
 
 	sensors.begin();
+	sensors.setResolution(OW_TEMP_RESOLUTION);
 
 	Wire.begin();
 